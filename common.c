@@ -13,6 +13,12 @@ tsocket(int type, const struct sockaddr_in *baddr)
      setsockopt(fd, IPPROTO_IP, IP_RECVORIGDSTADDR, &enable, sizeof(int)) < 0)
     goto onfail;
 
+  // Share binding with explicit port among workers, like listening sockets
+  // and l-side udp peers binding on origin dst.
+  if(opts.workers > 1 && baddr != NULL && baddr->sin_port != 0 &&
+     setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0)
+    goto onfail;
+
   // Bind address.
   if(baddr != NULL && bind(fd, (const struct sockaddr*) baddr, ADDRSIZE) < 0)
     goto onfail;
@@ -23,3 +29,15 @@ tsocket(int type, const struct sockaddr_in *baddr)
   if(fd > 0) close(fd);
   return -1;
 }
+
+
+/*
+ @Return: milliseconds of monotonic clock, to measure time elapsed.
+*/
+long
+mstime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
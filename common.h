@@ -4,23 +4,46 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
+#include <stdint.h>
 #include <regex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 
 #include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <asm/byteorder.h>
 #include <linux/netfilter_ipv4.h>
 
 #include "array.h"
+#include "htable.h"
 #include "dns.h"
+#include "reactor.h"
+#include "pool.h"
 #include "udppeer.h"
 #include "tcppeer.h"
+#include "redfa.h"
+#include "lpm.h"
+#include "lroute.h"
+#include "ljournal.h"
+#include "qcache.h"
+#include "dnsquery.h"
+#include "dnscache.h"
+#include "dnsflight.h"
+#include "upstream.h"
+#include "prefetch.h"
 #include "hostrule.h"
+#include "ruledb.h"
 #include "route.h"
 
 
@@ -34,6 +57,8 @@
 
 
 
+#define STATS_INTERVAL  60  // seconds, interval to report counters.
+
 #define ADDRSIZE  sizeof(struct sockaddr_in)
 #define FADDR(addr)   ntohl((addr)->sin_addr.s_addr),ntohs((addr)->sin_port)
 #define ISSAMEADDR(a1,a2)  ((a1)->sin_addr.s_addr == (a2)->sin_addr.s_addr && \
@@ -41,7 +66,55 @@
 			     (a1)->sin_port == (a2)->sin_port))
 
 
+/*
+ Runtime options, set by main(...) before any worker starts.
+
+@workers: count of worker threads, each owns its own listening sockets and
+  peers, binding with explicit port is shared among them via SO_REUSEPORT.
+@splice: 1 to relay TCP data via pipes with splice(...), without copying
+  data into user space.
+@poolsize: max count of objects kept by each pool of each worker, 0 to
+  allocate from system always.
+@hugepage: 1 to back pools with huge pages.
+@batch: max count of UDP pkts recv or sent by one syscall.
+@qdepth: max count of UDP pkts queued to send by each UDP peer, pkts
+  beyond are dropped.
+@ttlmin: min seconds a route learned from DNS kept, even TTL is less.
+@ttlgrace: seconds a learned route kept after TTL, for connections made
+  on the address before.
+@dnscache: max DNS answers of sections cached by each worker, 0 to disable.
+@coalesce: 1 to send one of identical DNS queries in flight to upstream,
+  response of which is fanned out to all clients.
+@race: 1 to send DNS query to another server of section as well, when the
+  one picked does not answer in time.
+@watch: 1 to reload rules when config file modified, besides on SIGHUP.
+@journal: file to keep routes learned, restored at startup, NULL to not.
+@prefetch: max names resolved ahead of clients by main thread, literal
+  domains of rules and names popular, 0 to disable.
+*/
+struct options{
+  unsigned workers;
+  int splice;
+  size_t poolsize;
+  int hugepage;
+  size_t batch;
+  size_t qdepth;
+  unsigned ttlmin, ttlgrace;
+  size_t dnscache;
+  int coalesce;
+  int race;
+  int watch;
+  const char *journal;
+  size_t prefetch;
+};
+
+extern struct options opts;
+
+
 int
 tsocket(int type, const struct sockaddr_in *baddr);
 
+long
+mstime(void);
+
 #endif
@@ -1,78 +1,71 @@
 #include "dns.h"
 
 
-/* Buffer to store DNS NAME(global) */
-char dnsnamebuf[DNSNAMEBUFLEN];
+/*
+  Read name in dns pkt, as a view into @pkt.
 
+  Validated in one pass: labels in pkt, length of name in limit, and
+  compression pointer points backward, before any byte walked, so never
+  loops.
 
-/*
-  Read name in dns pkt.
- 
   @pkt: dns pkt, header [ + content].
   @pktlen: length of pkt, include header.
   @start: start point to read name, when succ, it would be set as the
     next start point to process other info.
-  @name: buffer to store name had been read, may be truncked, always ends with '\0'.
-  @namelen: provide the length of @name.
+  @name: view of name read.
 
-  @Return: -1 when error, or bytes had been written to @name(include '\0').
+  @Return: -1 when error, 0 when succ.
 */
-ssize_t
-readdnsname(const void *pkt, size_t pktlen, size_t *start, void *name, size_t namelen)
+int
+readdnsname(const void *pkt, size_t pktlen, size_t *start, struct dnsname *name)
 {
   if(pkt == NULL || pktlen < sizeof(struct dnshdr) ||
      start == NULL || (*start) < sizeof(struct dnshdr) || (*start) >= pktlen ||
-     name == NULL || namelen <= 1) goto invaformat;
-
-  unsigned char *curr = ((unsigned char*) pkt) + (*start),
-    *maxcurr = NULL,
-    *end = ((unsigned char*) pkt) + pktlen,
-    *namecurr = (unsigned char*) name,
-    *nameend = ((unsigned char*) name) + namelen;
-  unsigned char ctl, flag;
-  unsigned short lenoroff;
-  size_t counter = 0;
-
-  while(counter++ < 100){
+     name == NULL) goto invaformat;
+
+  const unsigned char *data = (const unsigned char*) pkt;
+  size_t off = *start, limit = pktlen, next = 0, len = 0;
+
+  while(1){
     // Read control field.
-    if(curr + 1 > end){ trace("control field over boundary"); goto invaformat; }
-    
-    ctl = *curr++;
-    flag = (ctl >> 6);
-    lenoroff = (flag != 3) ? (ctl & 0x3F) : (((ctl & 0x3F) << 8) | *curr++);
-    if(curr > maxcurr) maxcurr = curr;
+    if(off >= limit){ trace("control field over boundary"); goto invaformat; }
+    unsigned char ctl = data[off], flag = (ctl >> 6);
 
     // A pointer.
     if(flag == 3){
-      curr = ((unsigned char*) pkt) + lenoroff;
+      if(off + 1 >= limit) goto invaformat;
+      size_t target = ((ctl & 0x3F) << 8) | data[off + 1];
+      if(target < sizeof(struct dnshdr) || target >= off){
+	trace("invalid pointer(%ld) at %ld", target, off); goto invaformat;
+      }
+      if(next == 0) next = off + 2;
+      limit = off;
+      off = target;
       continue;
     }
 
     // A label.
     if(flag == 0){
-      // End of name?
-      if(lenoroff == 0){
-	*namecurr++ = 0;
-	*start = maxcurr - ((unsigned char*) pkt);
-	return (namecurr - ((unsigned char*) name));
+      len += ctl + 1;
+      if(len > DNSNAME_MAX || off + 1 + ctl > limit){
+	trace("label overflow"); goto invaformat;
       }
+      off += 1 + ctl;
 
-      // Read label.
-      if(curr + lenoroff > end)	goto invaformat;
-      if(namecurr + lenoroff + 1 > nameend - 1){
-	trace("label overflow"); goto invaformat;
+      // End of name?
+      if(ctl == 0){
+	name->pkt = data;
+	name->pktlen = pktlen;
+	name->off = *start;
+	*start = (next != 0) ? next : off;
+	return 0;
       }
-      if(namecurr != (unsigned char*) name) *namecurr++ = '.';
-      memcpy(namecurr, curr, lenoroff);
-      namecurr += lenoroff;
-      curr += lenoroff;
       continue;
     }
 
     // Invalid flag.
     trace("invalid control flag(%u), ctl(%u)", flag, ctl); goto invaformat;
-  }// End of limited loop.
-  // Got here when exceed limited loop, may be an infinate loop.
+  }
 
  invaformat:
   errno = EINVAL;
@@ -80,16 +73,70 @@ readdnsname(const void *pkt, size_t pktlen, size_t *start, void *name, size_t na
 }
 
 
+/*
+ Get the next label of validated name from @off, following pointers.
+
+ @Return: label, its length first.
+*/
+static const unsigned char*
+dnsname_label(const unsigned char *pkt, size_t *off)
+{
+  while((pkt[*off] >> 6) == 3) *off = ((pkt[*off] & 0x3F) << 8) | pkt[*off + 1];
+  const unsigned char *label = pkt + *off;
+  *off += 1 + label[0];
+  return label;
+}
+
+
+/*
+ @Return: 1 when @a and @b are the same name, case-insensitive.
+*/
+int
+dnsname_eq(const struct dnsname *a, const struct dnsname *b)
+{
+  size_t aoff = a->off, boff = b->off;
+  while(1){
+    const unsigned char *alabel = dnsname_label(a->pkt, &aoff),
+      *blabel = dnsname_label(b->pkt, &boff);
+    if(alabel[0] != blabel[0]) return 0;
+    if(alabel[0] == 0) return 1;
+    if(strncasecmp((const char*) alabel + 1, (const char*) blabel + 1, alabel[0])) return 0;
+  }
+}
+
+
+/*
+ Write @name dotted into @buf, ends with '\0'.
+
+ @Return: -1 when @buflen not enough, or bytes written(include '\0').
+*/
+ssize_t
+dnsname_copy(const struct dnsname *name, char *buf, size_t buflen)
+{
+  size_t off = name->off, len = 0;
+  while(1){
+    const unsigned char *label = dnsname_label(name->pkt, &off);
+    if(label[0] == 0) break;
+    if(len + (len != 0) + label[0] + 1 > buflen){ errno = ENOBUFS; return -1; }
+    if(len != 0) buf[len++] = '.';
+    memcpy(buf + len, label + 1, label[0]);
+    len += label[0];
+  }
+  if(len + 1 > buflen){ errno = ENOBUFS; return -1; }
+  buf[len++] = 0;
+  return len;
+}
+
+
 int
 readdnsques(const void *pkt, size_t pktlen, size_t *start, struct dnsques *ques)
 {
   if(pkt == NULL || pktlen == 0 || start == NULL || *start < sizeof(struct dnshdr) ||
      ques == NULL){ errno = EINVAL; return -1; }
 
-  if(readdnsname(pkt, pktlen, start, dnsnamebuf, DNSNAMEBUFLEN) < 0){
+  if(readdnsname(pkt, pktlen, start, &(ques->name)) < 0){
     error("can not read the qname"); return -1;
   }
-  ques->name = dnsnamebuf;
 
   // Check if overflow.
   size_t tmplen = (*start) + 2*2;  // See struct dnsques.
@@ -114,10 +161,9 @@ readdnsrr(const void *pkt, size_t pktlen, size_t *start, struct dnsrr *rr)
   if(pkt == NULL || pktlen < sizeof(struct dnshdr) || start == NULL ||
      *start >= pktlen || rr == NULL){ errno = EINVAL; return -1; }
 
-  if(readdnsname(pkt, pktlen, start, dnsnamebuf, DNSNAMEBUFLEN) < 0){
+  if(readdnsname(pkt, pktlen, start, &(rr->name)) < 0){
     error("read dns name failed"); return -1;
   }
-  rr->name = dnsnamebuf;
   
   // Check if overflow.
   size_t tmplen = (*start) + 2*2 + 4 + 2;  // For how to calculate, see struct dnsrr.
@@ -149,3 +195,75 @@ readdnsrr(const void *pkt, size_t pktlen, size_t *start, struct dnsrr *rr)
   *start = tmplen + rr->rdatlen;
   return 0;
 }
+
+
+/*
+ Read EDNS state of pkt, records of which start at @start, i.e. end of
+ question section.
+
+ @Return: 0 when read, or -1 when records malformed.
+*/
+int
+readdnsedns(const void *pkt, size_t pktlen, size_t start, struct dnsedns *edns)
+{
+  if(pkt == NULL || pktlen < sizeof(struct dnshdr) || edns == NULL){
+    errno = EINVAL; return -1;
+  }
+
+  memset(edns, 0, sizeof(struct dnsedns));
+  edns->size = DNS_UDP_MAX;
+  const struct dnshdr *dns = (const struct dnshdr*) pkt;
+  size_t nrr = ntohs(dns->an_count) + ntohs(dns->ns_count) + ntohs(dns->ar_count);
+  struct dnsrr rr;
+  for(size_t i=0; i<nrr; i++){
+    if(readdnsrr(pkt, pktlen, &start, &rr) < 0) return -1;
+    if(rr.type != DNS_TYPE_OPT) continue;
+    // Class is size, TTL is extended rcode, version, then DO bit.
+    edns->opt = 1;
+    edns->dnssec = (rr.ttl >> 15) & 1;
+    if(rr.class > edns->size) edns->size = rr.class;
+  }
+  return 0;
+}
+
+
+/*
+ Write query of @type(IN class) on dotted @name to @pkt, recursion desired.
+
+ @Return: length of query, or -1 when @name invalid or @pktlen too short.
+*/
+ssize_t
+writednsquery(void *pkt, size_t pktlen, unsigned short id, const char *name,
+	      unsigned short type)
+{
+  if(pkt == NULL || name == NULL){ errno = EINVAL; return -1; }
+
+  size_t namelen = strlen(name);
+  if(namelen > 0 && name[namelen - 1] == '.') namelen --;
+  size_t len = sizeof(struct dnshdr) + namelen + 2 + 2*2;
+  if(namelen == 0 || namelen + 2 > DNSNAME_MAX){ errno = EINVAL; return -1; }
+  if(len > pktlen){ errno = ENOBUFS; return -1; }
+
+  struct dnshdr *dns = (struct dnshdr*) pkt;
+  memset(dns, 0, sizeof(struct dnshdr));
+  dns->id = id;
+  dns->rd = 1;
+  dns->qd_count = htons(1);
+
+  // Labels, each of length first.
+  unsigned char *p = ((unsigned char*) pkt) + sizeof(struct dnshdr);
+  for(size_t i=0; i<=namelen; ){
+    const char *dot = memchr(name + i, '.', namelen - i);
+    size_t labellen = ((dot != NULL) ? (size_t) (dot - name) : namelen) - i;
+    if(labellen == 0 || labellen > 63){ errno = EINVAL; return -1; }
+    *p++ = labellen;
+    memcpy(p, name + i, labellen);
+    p += labellen;
+    i += labellen + 1;
+  }
+  *p++ = 0;
+
+  unsigned short tc[2] = {htons(type), htons(1)};
+  memcpy(p, tc, sizeof(tc));
+  return len;
+}
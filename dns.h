@@ -5,6 +5,10 @@
 
 
 #define DNSNAMEBUFLEN    1024
+#define DNSNAME_MAX      255   // max length of name in pkt, RFC 1035.
+#define DNS_TYPE_OPT     41    // pseudo record of EDNS, its TTL is not a TTL.
+#define DNS_UDP_MAX      512   // max UDP payload without EDNS, RFC 1035.
+#define DNS_Z_CD         1     // checking disabled bit of z in struct dnshdr, RFC 4035.
 
 /*
  Header of DNS record.
@@ -50,14 +54,27 @@ struct dnshdr {
 };
 
 
+/*
+ View of a name in pkt, validated when read, labels are read from pkt in
+ place, following compression pointers, nothing copied.
+
+@pkt, @pktlen: the pkt holds the name.
+@off: offset of the first label of name.
+*/
+struct dnsname{
+  const unsigned char *pkt;
+  size_t pktlen, off;
+};
+
+
 struct dnsques{
-  const char *name;
+  struct dnsname name;
   unsigned short type, class;
 };
 
 
 struct dnsrr{
-  const char *name;
+  struct dnsname name;
   unsigned short type, class;
   unsigned ttl;
   unsigned short rdatlen;
@@ -65,8 +82,27 @@ struct dnsrr{
 };
 
 
+/*
+ EDNS state of query, RFC 6891.
+
+@opt: 1 when OPT record present, response has one only then.
+@dnssec: DO bit of OPT, RFC 3225.
+@size: UDP payload size requester accepts, DNS_UDP_MAX at least.
+*/
+struct dnsedns{
+  int opt, dnssec;
+  unsigned short size;
+};
+
+
+int
+readdnsname(const void *pkt, size_t pktlen, size_t *start, struct dnsname *name);
+
+int
+dnsname_eq(const struct dnsname *a, const struct dnsname *b);
+
 ssize_t
-readdnsname(const void *pkt, size_t pktlen, size_t *start, void *name, size_t namelen);
+dnsname_copy(const struct dnsname *name, char *buf, size_t buflen);
 
 
 int
@@ -76,4 +112,11 @@ readdnsques(const void *pkt, size_t pktlen, size_t *start, struct dnsques *ques)
 int
 readdnsrr(const void *pkt, size_t pktlen, size_t *start, struct dnsrr* rr);
 
+int
+readdnsedns(const void *pkt, size_t pktlen, size_t start, struct dnsedns *edns);
+
+ssize_t
+writednsquery(void *pkt, size_t pktlen, unsigned short id, const char *name,
+	      unsigned short type);
+
 #endif
@@ -0,0 +1,110 @@
+#include "dnscache.h"
+
+
+int
+dnscache_init(struct dnscache *c, size_t capa)
+{
+  if(c == NULL || capa == 0){ errno = EINVAL; return -1; }
+
+  memset(c, 0, sizeof(struct dnscache));
+  c->entries = (struct dnsanswer*) calloc(sizeof(struct dnsanswer), capa);
+  if(c->entries == NULL) return -1;
+  if((c->index = ht_new()) == NULL){
+    free(c->entries);
+    c->entries = NULL;
+    return -1;
+  }
+  c->capa = capa;
+  return 0;
+}
+
+
+static void
+dnscache_drop(struct dnscache *c, struct dnsanswer *ans)
+{
+  ht_del(c->index, ans->key, ans->keylen);
+  free(ans->key);
+  ans->key = NULL;
+  c->size --;
+}
+
+
+/*
+ Drop all answers, counters are kept.
+*/
+void
+dnscache_clear(struct dnscache *c)
+{
+  if(c == NULL || c->entries == NULL) return;
+
+  for(size_t i=0; i<c->capa; i++){
+    if(c->entries[i].key != NULL) dnscache_drop(c, &(c->entries[i]));
+  }
+  c->hand = 0;
+}
+
+
+/*
+ @Return: answer of @key not expired at @now, or NULL when miss.
+*/
+const struct dnsanswer*
+dnscache_get(struct dnscache *c, const void *key, size_t keylen, time_t now)
+{
+  struct dnsanswer *ans = (struct dnsanswer*) ht_get(c->index, key, keylen);
+  if(ans != NULL && ans->expire <= now){
+    dnscache_drop(c, ans);
+    ans = NULL;
+  }
+  if(ans == NULL){
+    c->misses ++;
+    return NULL;
+  }
+  c->hits ++;
+  ans->ref = 1;
+  return ans;
+}
+
+
+/*
+ Cache response @pkt of @key for @ttl seconds from @now, replace the one
+ cached before. Take the first slot unused, expired or not hit since last
+ pass of clock hand.
+*/
+int
+dnscache_put(struct dnscache *c, const void *key, size_t keylen,
+	     const void *pkt, size_t pktlen, time_t now, unsigned ttl)
+{
+  if(c == NULL || c->entries == NULL || key == NULL || pkt == NULL || ttl == 0){
+    errno = EINVAL; return -1;
+  }
+
+  struct dnsanswer *ans = (struct dnsanswer*) ht_get(c->index, key, keylen);
+  if(ans != NULL) dnscache_drop(c, ans);
+  while(1){
+    ans = &(c->entries[c->hand]);
+    c->hand = (c->hand + 1) % c->capa;
+    if(ans->key == NULL) break;
+    if(ans->ref && ans->expire > now){ ans->ref = 0; continue; }
+
+    // Evict.
+    dnscache_drop(c, ans);
+    break;
+  }
+
+  if((ans->key = malloc(keylen + pktlen)) == NULL) return -1;
+  memcpy(ans->key, key, keylen);
+  ans->keylen = keylen;
+  ans->pkt = ((unsigned char*) ans->key) + keylen;
+  memcpy(ans->pkt, pkt, pktlen);
+  ans->pktlen = pktlen;
+  ans->time = now;
+  ans->expire = now + ttl;
+  ans->ref = 0;
+  if(ht_put(c->index, ans->key, keylen, ans) < 0){
+    free(ans->key);
+    ans->key = NULL;
+    return -1;
+  }
+  c->size ++;
+  return 0;
+}
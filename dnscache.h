@@ -0,0 +1,61 @@
+#ifndef _DNSCACHE_H_
+#define _DNSCACHE_H_
+
+#include "common.h"
+
+
+#define DNSCACHE_TTLMAX   3600  // seconds, max an answer cached.
+
+
+/*
+ Answer cached, key and pkt in one block.
+
+@key: section, qtype, qclass and lower-case qname, NULL when slot unused.
+@pkt: response pkt, as recv from upstream.
+@time: when cached, to age TTLs of records.
+@expire: when the first record of pkt expires.
+@ref: 1 when hit since the clock hand passed.
+*/
+struct dnsanswer{
+  void *key;
+  size_t keylen;
+  void *pkt;
+  size_t pktlen;
+  time_t time, expire;
+  int ref;
+};
+
+
+/*
+ Cache of DNS answers, bounded with CLOCK replacement. NOT thread safe, each
+ worker owns its own.
+
+@tag: set by user, e.g. to tell which rules sections refer to.
+@index: struct dnsanswer by key.
+@entries: slots, @capa in all, @size used.
+@hand: next slot to check when putting.
+@hits, @misses: counters of lookup.
+*/
+struct dnscache{
+  unsigned long tag;
+  struct htable *index;
+  struct dnsanswer *entries;
+  size_t capa, size, hand;
+  unsigned long hits, misses;
+};
+
+
+int
+dnscache_init(struct dnscache *c, size_t capa);
+
+void
+dnscache_clear(struct dnscache *c);
+
+const struct dnsanswer*
+dnscache_get(struct dnscache *c, const void *key, size_t keylen, time_t now);
+
+int
+dnscache_put(struct dnscache *c, const void *key, size_t keylen,
+	     const void *pkt, size_t pktlen, time_t now, unsigned ttl);
+
+#endif
@@ -0,0 +1,114 @@
+#include "dnsflight.h"
+
+
+int
+dnsflights_init(struct dnsflights *f, size_t capa)
+{
+  if(f == NULL || capa == 0){ errno = EINVAL; return -1; }
+
+  memset(f, 0, sizeof(struct dnsflights));
+  f->ring = (struct dnsflight*) calloc(sizeof(struct dnsflight), capa);
+  if(f->ring == NULL) return -1;
+  if((f->index = ht_new()) == NULL){
+    free(f->ring);
+    f->ring = NULL;
+    return -1;
+  }
+  f->capa = capa;
+  return 0;
+}
+
+
+static int
+isleader(const struct dnsflight *flight, const struct sockaddr_in *client, unsigned short id)
+{
+  return flight->id == id &&
+    flight->leader.sin_addr.s_addr == client->sin_addr.s_addr &&
+    flight->leader.sin_port == client->sin_port;
+}
+
+
+/*
+ Join query @id of @client to the identical one in flight, of the same
+ @sig, or lead it when none or timeout. Query is sent on its own when too
+ many clients waiting, or of another @sig, as response of leader is not
+ the one for it.
+
+ @Return: 1 when joined, query should NOT be sent, 0 when it should, -1
+   when failed.
+*/
+int
+dnsflights_join(struct dnsflights *f, const void *key, size_t keylen, unsigned sig,
+		const struct sockaddr_in *client, const struct sockaddr_in *origdst,
+		unsigned short id, time_t now)
+{
+  if(f == NULL || f->ring == NULL || key == NULL || keylen > DNSFLIGHT_KEYLEN ||
+     client == NULL || origdst == NULL){ errno = EINVAL; return -1; }
+
+  struct dnsflight *flight = (struct dnsflight*) ht_get(f->index, key, keylen);
+  if(flight != NULL && now - flight->time <= DNSFLIGHT_TIMEOUT){
+    // Sent again by the leader.
+    if(isleader(flight, client, id)) return 0;
+
+    for(size_t i=0; i<flight->nwaiter; i++){
+      struct dnswaiter *i_waiter = &(flight->waiters[i]);
+      if(i_waiter->id == id && i_waiter->addr.sin_addr.s_addr == client->sin_addr.s_addr &&
+	 i_waiter->addr.sin_port == client->sin_port) return 1;
+    }
+    if(flight->nwaiter == DNSFLIGHT_WAITERS || flight->sig != sig) return 0;
+
+    struct dnswaiter *waiter = &(flight->waiters[flight->nwaiter++]);
+    memcpy(&(waiter->addr), client, ADDRSIZE);
+    memcpy(&(waiter->origdst), origdst, ADDRSIZE);
+    waiter->id = id;
+    f->joined ++;
+    return 1;
+  }
+
+  if(flight == NULL){
+    // Take the oldest slot.
+    flight = &(f->ring[f->next]);
+    f->next = (f->next + 1) % f->capa;
+    if(flight->time) ht_del(f->index, flight->key, flight->keylen);
+    flight->time = 0;
+
+    memcpy(flight->key, key, keylen);
+    flight->keylen = keylen;
+    if(ht_put(f->index, flight->key, keylen, flight) < 0) return -1;
+  }
+
+  // Lead it, clients waiting on the timeout one would retry.
+  memcpy(&(flight->leader), client, ADDRSIZE);
+  flight->id = id;
+  flight->sig = sig;
+  flight->time = now;
+  flight->nwaiter = 0;
+  return 0;
+}
+
+
+/*
+ Take query in flight answered by response @id to leader @client, it is no
+ longer tracked then.
+
+ @waiters: at least DNSFLIGHT_WAITERS, to copy clients waiting into.
+ @Return: count of clients waiting.
+*/
+size_t
+dnsflights_take(struct dnsflights *f, const void *key, size_t keylen,
+		const struct sockaddr_in *client, unsigned short id,
+		struct dnswaiter *waiters)
+{
+  if(f == NULL || f->ring == NULL || key == NULL || client == NULL || waiters == NULL)
+    return 0;
+
+  struct dnsflight *flight = (struct dnsflight*) ht_get(f->index, key, keylen);
+  if(flight == NULL || ! isleader(flight, client, id)) return 0;
+
+  ht_del(f->index, flight->key, flight->keylen);
+  flight->time = 0;
+  size_t n = flight->nwaiter;
+  memcpy(waiters, flight->waiters, n * sizeof(struct dnswaiter));
+  if(n) f->fanned ++;
+  return n;
+}
@@ -0,0 +1,80 @@
+#ifndef _DNSFLIGHT_H_
+#define _DNSFLIGHT_H_
+
+#include "common.h"
+
+
+#define DNSFLIGHT_MAX      1024  // max queries in flight tracked per worker.
+#define DNSFLIGHT_WAITERS  32    // max clients waiting on a query in flight.
+#define DNSFLIGHT_TIMEOUT  3     // seconds, query not answered is sent again.
+#define DNSFLIGHT_KEYLEN   (6 + 255 + 4)  // origin dst, then question of DNSNAME_MAX.
+
+
+/*
+ Client waiting for response of a query sent by another client.
+
+@addr: address of client.
+@origdst: dst the client sent to, where response comes from.
+@id: transaction id of its query, in network order.
+*/
+struct dnswaiter{
+  struct sockaddr_in addr, origdst;
+  unsigned short id;
+};
+
+
+/*
+ Query in flight, sent to upstream by the leader client.
+
+@key: dst the clients sent to, then question in pkt, case kept since client
+  may check case of response.
+@leader, @id: client who sent the query, and its transaction id.
+@sig: set by user, e.g. flags of query its response depends on, which
+  waiters have the same as leader.
+@time: when sent, 0 when slot unused.
+@waiters: clients of identical query, @nwaiter in all.
+*/
+struct dnsflight{
+  unsigned char key[DNSFLIGHT_KEYLEN];
+  size_t keylen;
+  struct sockaddr_in leader;
+  unsigned short id;
+  unsigned sig;
+  time_t time;
+  size_t nwaiter;
+  struct dnswaiter waiters[DNSFLIGHT_WAITERS];
+};
+
+
+/*
+ Queries in flight, in a ring of slots, the oldest one is overwritten when
+ full, clients waiting on it would retry. NOT thread safe, each worker owns
+ its own.
+
+@index: struct dnsflight by key.
+@ring: slots, @capa in all.
+@next: slot for next query.
+@joined, @fanned: counters of queries joined and responses fanned out.
+*/
+struct dnsflights{
+  struct htable *index;
+  struct dnsflight *ring;
+  size_t capa, next;
+  unsigned long joined, fanned;
+};
+
+
+int
+dnsflights_init(struct dnsflights *f, size_t capa);
+
+int
+dnsflights_join(struct dnsflights *f, const void *key, size_t keylen, unsigned sig,
+		const struct sockaddr_in *client, const struct sockaddr_in *origdst,
+		unsigned short id, time_t now);
+
+size_t
+dnsflights_take(struct dnsflights *f, const void *key, size_t keylen,
+		const struct sockaddr_in *client, unsigned short id,
+		struct dnswaiter *waiters);
+
+#endif
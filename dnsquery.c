@@ -0,0 +1,120 @@
+#include "dnsquery.h"
+
+
+int
+dnsqueries_init(struct dnsqueries *q, size_t capa)
+{
+  if(q == NULL || capa == 0){ errno = EINVAL; return -1; }
+
+  memset(q, 0, sizeof(struct dnsqueries));
+  q->ring = (struct dnsquery*) calloc(sizeof(struct dnsquery), capa);
+  if(q->ring == NULL) return -1;
+  if((q->index = ht_new()) == NULL){
+    free(q->ring);
+    q->ring = NULL;
+    return -1;
+  }
+  q->capa = capa;
+  return 0;
+}
+
+
+static void
+dnsqkey_set(struct dnsqkey *key, const struct sockaddr_in *client, unsigned short id)
+{
+  memset(key, 0, sizeof(struct dnsqkey));
+  key->addr = client->sin_addr.s_addr;
+  key->port = client->sin_port;
+  key->id = id;
+}
+
+
+/*
+ Forget all queries, e.g. when sections they refer to changed.
+*/
+void
+dnsqueries_clear(struct dnsqueries *q)
+{
+  if(q == NULL || q->ring == NULL) return;
+
+  for(size_t i=0; i<q->capa; i++){
+    struct dnsquery *i_query = &(q->ring[i]);
+    if(! i_query->time) continue;
+    ht_del(q->index, &(i_query->key), sizeof(i_query->key));
+    i_query->time = 0;
+  }
+}
+
+
+/*
+ Hash of @qname, case-insensitive.
+*/
+static size_t
+dnsqname_hash(const char *qname)
+{
+  char lname[DNSNAMEBUFLEN];
+  size_t len = 0;
+  for(; qname[len] != 0 && len < DNSNAMEBUFLEN; len++)
+    lname[len] = tolower((unsigned char) qname[len]);
+  return ht_hash(lname, len);
+}
+
+
+/*
+ Track query @id of @client on @qname, which is routed to section @idx.
+ Query of same key is replaced, e.g. when client retries.
+*/
+int
+dnsqueries_add(struct dnsqueries *q, const struct sockaddr_in *client, unsigned short id,
+	       const char *qname, unsigned idx, unsigned sig, time_t now, long sent)
+{
+  if(q == NULL || client == NULL || qname == NULL){ errno = EINVAL; return -1; }
+
+  struct dnsqkey key;
+  dnsqkey_set(&key, client, id);
+  struct dnsquery *query = (struct dnsquery*) ht_get(q->index, &key, sizeof(key));
+  if(query == NULL){
+    // Take the oldest slot.
+    query = &(q->ring[q->next]);
+    q->next = (q->next + 1) % q->capa;
+    if(query->time) ht_del(q->index, &(query->key), sizeof(query->key));
+    query->time = 0;
+
+    memcpy(&(query->key), &key, sizeof(key));
+    if(ht_put(q->index, &key, sizeof(key), query) < 0) return -1;
+  }
+  query->idx = idx;
+  query->sig = sig;
+  query->qhash = dnsqname_hash(qname);
+  query->time = now;
+  query->sent = sent;
+  return 0;
+}
+
+
+/*
+ Take query answered by response @id to @client on @qname, it is no
+ longer tracked then.
+
+ @Return: 0 with section of query set to @idx, its @sig, and when sent to
+   @sent, or -1 when not tracked, timeout, or of other qname.
+*/
+int
+dnsqueries_take(struct dnsqueries *q, const struct sockaddr_in *client, unsigned short id,
+		const char *qname, time_t now, unsigned *idx, unsigned *sig, long *sent)
+{
+  if(q == NULL || q->ring == NULL || client == NULL || qname == NULL) return -1;
+
+  struct dnsqkey key;
+  dnsqkey_set(&key, client, id);
+  struct dnsquery *query = (struct dnsquery*) ht_del(q->index, &key, sizeof(key));
+  if(query == NULL) return -1;
+
+  time_t qtime = query->time;
+  query->time = 0;
+  if(now - qtime > DNSQUERY_TIMEOUT || query->qhash != dnsqname_hash(qname)) return -1;
+  *idx = query->idx;
+  *sig = query->sig;
+  *sent = query->sent;
+  return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef _DNSQUERY_H_
+#define _DNSQUERY_H_
+
+#include "common.h"
+
+
+#define DNSQUERY_MAX      4096  // max queries tracked per worker.
+#define DNSQUERY_TIMEOUT  10    // seconds, query not answered is forgotten.
+
+
+/*
+ Key of query, address of client and transaction id, in network order.
+*/
+struct dnsqkey{
+  unsigned addr;
+  unsigned short port, id;
+};
+
+
+/*
+ Query routed, waiting for its response.
+
+@idx: section matched by qname, LPM_NONE when none.
+@qhash: hash of lower-case qname, to check response against.
+@time: when routed, 0 when slot unused.
+@sent: ms when routed, see mstime(...), to measure RTT of upstream.
+@sig: set by user, e.g. flags of query its response depends on.
+*/
+struct dnsquery{
+  struct dnsqkey key;
+  unsigned idx, sig;
+  size_t qhash;
+  time_t time;
+  long sent;
+};
+
+
+/*
+ Queries tracked, in a ring of slots, the oldest one is overwritten when
+ full. NOT thread safe, each worker owns its own, since response comes
+ back to the worker who sent the query.
+
+@index: struct dnsquery by key.
+@ring: slots, @capa in all.
+@next: slot for next query.
+*/
+struct dnsqueries{
+  struct htable *index;
+  struct dnsquery *ring;
+  size_t capa, next;
+};
+
+
+int
+dnsqueries_init(struct dnsqueries *q, size_t capa);
+
+void
+dnsqueries_clear(struct dnsqueries *q);
+
+int
+dnsqueries_add(struct dnsqueries *q, const struct sockaddr_in *client, unsigned short id,
+	       const char *qname, unsigned idx, unsigned sig, time_t now, long sent);
+
+int
+dnsqueries_take(struct dnsqueries *q, const struct sockaddr_in *client, unsigned short id,
+		const char *qname, time_t now, unsigned *idx, unsigned *sig, long *sent);
+
+#endif
@@ -1,6 +1,10 @@
 #include "hostrule.h"
 
 
+// Serial of the last rule set generated.
+static unsigned long ruleset_serial = 0;
+
+
 /* Regex error buffer(global) */
 #define regerrbuflen  1024
 char regerrbuf[regerrbuflen];
@@ -39,31 +43,40 @@ reg_free(regex_t **reg)
 
 
 struct hostrule*
-hostrule_new(unsigned src, unsigned dns)
+hostrule_new(unsigned src, const unsigned *dns, unsigned ndns)
 {
-  if(src == 0){ errno = EINVAL; return NULL; }
+  if(src == 0 || dns == NULL || ndns == 0 || ndns > HOSTRULE_DNS_MAX){
+    errno = EINVAL; return NULL;
+  }
 
   struct hostrule *hr = (struct hostrule*) calloc(sizeof(struct hostrule), 1);
   if(hr == NULL) return NULL;
 
   hr->src = src;
-  hr->dns = dns;
+  memcpy(hr->dns, dns, ndns * sizeof(unsigned));
+  hr->ndns = ndns;
   
   hr->regs = ary_new();
   if(hr->regs == NULL){
     error("could not create member @regs of hostrule"); goto onfail;
   }
 
-  hr->ips = ary_new();
-  if(hr->ips == NULL){
-    error("could not create member @ips of hostrule"); goto onfail;
+  hr->exprs = ary_new();
+  if(hr->exprs == NULL){
+    error("could not create member @exprs of hostrule"); goto onfail;
+  }
+
+  hr->domains = ht_new();
+  if(hr->domains == NULL){
+    error("could not create member @domains of hostrule"); goto onfail;
   }
   return hr;
 
  onfail:
   if(hr != NULL){
     if(hr->regs != NULL) ary_free(&(hr->regs));
-    if(hr->ips != NULL) ary_free(&(hr->ips));
+    if(hr->exprs != NULL) ary_free(&(hr->exprs));
+    if(hr->domains != NULL) ht_free(&(hr->domains));
     free(hr);
   }
   return NULL;
@@ -79,11 +92,126 @@ hostrule_free(struct hostrule **hr)
     reg_free(&i_reg);
   }
   ary_free(&((*hr)->regs));
+  for(size_t i=0; i<(*hr)->exprs->_size; i++) free((*hr)->exprs->_warehouse[i]);
+  ary_free(&((*hr)->exprs));
+  ht_free(&((*hr)->domains));
   free(*hr);
   *hr = NULL;
 }
 
 
+/*
+ Add lower-case @domain to @hr.
+*/
+int
+hostrule_adddomain(struct hostrule *hr, const char *domain)
+{
+  if(hr == NULL || domain == NULL || *domain == 0){ errno = EINVAL; return -1; }
+
+  return ht_put(hr->domains, domain, strlen(domain), hr);
+}
+
+
+/*
+ Check if host @name matches any domain or regex of @hr.
+
+ @Return: 1 when match, 0 when not.
+*/
+int
+hostrule_match(const struct hostrule *hr, const char *name)
+{
+  if(hr == NULL || name == NULL) return 0;
+
+  // Lookup @name and each of its parent domains, cost depends on count of
+  // labels only, no matter how many domains in the set.
+  size_t namelen = strlen(name);
+  if(hr->domains->_size > 0 && namelen < DNSNAMEBUFLEN){
+    char lname[DNSNAMEBUFLEN];
+    for(size_t i=0; i<namelen; i++) lname[i] = tolower((unsigned char) name[i]);
+
+    for(size_t i=0; i<namelen; ){
+      if(ht_get(hr->domains, lname + i, namelen - i) != NULL) return 1;
+      const char *dot = memchr(lname + i, '.', namelen - i);
+      if(dot == NULL) break;
+      i = dot - lname + 1;
+    }
+  }
+
+  for(size_t i=0; i<hr->regs->_size; i++){
+    regex_t *i_reg = (regex_t*) (hr->regs->_warehouse[i]);
+    if(regexec(i_reg, name, 0, NULL, 0) == 0) return 1;
+  }
+  return 0;
+}
+
+
+/*
+ Write lower-case domain of text @name, @end bytes, to @domain, dots in
+ it are escaped when @isreg.
+
+ @Return: 0 when a valid domain, -1 when not.
+*/
+static int
+parse_name(const char *name, size_t end, int isreg, char *domain, size_t domainlen)
+{
+  size_t n = 0;
+  for(size_t i=0; i<end; i++){
+    char c = name[i];
+    if(c == '\\'){
+      // Only escaped dot allowed in regex.
+      if(! isreg || i + 1 >= end || name[i + 1] != '.') return -1;
+      c = name[++i];
+    }else if(c == '.'){
+      // Unescaped dot matches any char in regex.
+      if(isreg) return -1;
+    }else if(isalnum((unsigned char) c) || c == '-' || c == '_'){
+      c = tolower((unsigned char) c);
+    }else return -1;
+
+    // No empty label.
+    if(c == '.' && (n == 0 || domain[n - 1] == '.')) return -1;
+    if(n + 1 >= domainlen) return -1;
+    domain[n++] = c;
+  }
+  if(n == 0 || domain[n - 1] == '.') return -1;
+
+  domain[n] = 0;
+  return 0;
+}
+
+
+/*
+ Check if @expr is a domain rule, either "+.example.com" or a regex in
+ shape of "^(.*\.)*example\.com$", which is the same, then write the
+ lower-case domain to @domain.
+
+ @Return: 0 when a domain rule, -1 when not.
+*/
+static int
+parse_domain(const char *expr, char *domain, size_t domainlen)
+{
+  const char *prefixes[] = {DOMAINRULE_PREFIX, "^(.*\\.)*", "^(.*\\.)?"};
+  size_t i = 0, end = strlen(expr);
+  int isreg = -1;
+
+  for(size_t j=0; j<sizeof(prefixes)/sizeof(const char*); j++){
+    size_t j_len = strlen(prefixes[j]);
+    if(strncmp(expr, prefixes[j], j_len) != 0) continue;
+    isreg = (j != 0);
+    i = j_len;
+    break;
+  }
+  if(isreg < 0) return -1;
+
+  // Regex must end with "$".
+  if(isreg){
+    if(end == i || expr[end - 1] != '$') return -1;
+    --end;
+  }
+  return parse_name(expr + i, end - i, isreg, domain, domainlen);
+}
+
+
 /*
   Parse IP from text "1.2.3.4".
 
@@ -149,10 +277,49 @@ isemptystr(const char *text)
 
 
 /*
+  Parse IP or CIDR from text "1.2.3.4" or "1.2.3.0/24", @plen is 32 for IP.
+
+  @Return: -1 when failed, 0 when succ.
+*/
+int
+parse_cidr(const char *text, unsigned *ip, unsigned *plen)
+{
+  const char *slash = strchr(text, '/');
+  if(slash == NULL){
+    size_t start = 0;
+    *ip = parse_ipv4((const unsigned char*) text, strlen(text), &start);
+    if(! *ip || ! isemptystr(text + start)) return -1;
+    *plen = 32;
+    return 0;
+  }
+
+  // Address before "/".
+  char addr[16];
+  size_t addrlen = slash - text, start = 0;
+  if(addrlen >= sizeof(addr)) return -1;
+  memcpy(addr, text, addrlen);
+  addr[addrlen] = 0;
+  *ip = parse_ipv4((const unsigned char*) addr, addrlen, &start);
+  if(! *ip || ! isemptystr(addr + start)) return -1;
+
+  // Length of prefix.
+  char *end;
+  if(! isdigit((unsigned char) slash[1])) return -1;
+  unsigned long n = strtoul(slash + 1, &end, 10);
+  if(n > 32 || ! isemptystr(end)) return -1;
+  *plen = n;
+  return 0;
+}
+
+
+/*
+  Parse source address, then DNS servers of section, HOSTRULE_DNS_MAX at
+  most, into @dns.
+
   @Return: -1 when error, 0 when succ.
 */
 int
-parse_sect(const char *section, unsigned *src, unsigned *dns)
+parse_sect(const char *section, unsigned *src, unsigned *dns, unsigned *ndns)
 {
   size_t seclen = strlen(section), start = 0;
 
@@ -160,149 +327,442 @@ parse_sect(const char *section, unsigned *src, unsigned *dns)
   if(! ip){ error("could not parse source address"); return -1; }
   *src = ip;
 
-  ip = parse_ipv4((const unsigned char*) section, seclen, &start);
-  if(! ip){ error("could not parse dns address"); return -1; }
-  *dns = ip;
+  *ndns = 0;
+  do{
+    if(*ndns == HOSTRULE_DNS_MAX){
+      error("more than %d dns addresses", HOSTRULE_DNS_MAX); return -1;
+    }
+    ip = parse_ipv4((const unsigned char*) section, seclen, &start);
+    if(! ip){ error("could not parse dns address"); return -1; }
+    dns[(*ndns)++] = ip;
+  }while(! isemptystr(section + start));
+  return 0;
+}
 
-  // Check if remain empty string.
-  if(isemptystr(section + start)) return 0;
 
-  error("unexpected string after dns");
-  return -1;
+/*
+ Add regex @expr to section @hr, into automaton when supported, or kept
+ compiled in @regs of section. It is always compiled to check syntax.
+*/
+static int
+ruleset_addexpr(struct ruleset *rs, struct hostrule *hr, const char *expr)
+{
+  regex_t *reg = reg_new(expr);
+  if(reg == NULL) return -1;
+
+  char *text = strdup(expr);
+  if(text == NULL || ary_append(hr->exprs, text) < 0){
+    free(text);
+    reg_free(&reg);
+    return -1;
+  }
+  if(redfa_add(rs->dfa, expr, hr->idx) == 0){
+    reg_free(&reg);
+    return 0;
+  }
+  if(ary_append(hr->regs, reg) < 0){
+    reg_free(&reg);
+    return -1;
+  }
+  return 0;
 }
 
 
 /*
- Generate rule list on config file like:
+ Generate rules from rule image @dbfile, compiled by ruledb_compile(...).
+ Only sections and regexes are loaded, domains and addresses are looked up
+ in the image mapped, however many they are.
+*/
+static int
+ruleset_loaddb(struct ruleset *rs, const char *dbfile)
+{
+  if((rs->db = ruledb_open(dbfile)) == NULL) return -1;
+
+  const struct ruledb_sect *sect;
+  for(unsigned i=0; (sect = ruledb_sect(rs->db, i)) != NULL; i++){
+    struct hostrule *hr = hostrule_new(sect->src, sect->dns, sect->ndns);
+    if(hr == NULL){ error("could not create host rule(section: %u)", i); return -1; }
+    hr->idx = i;
+    if(ary_append(rs->rules, hr) < 0){
+      error("could not append rule(section: %u)", i);
+      hostrule_free(&hr);
+      return -1;
+    }
+  }
 
-#comment line
-#max line length is 1023.
+  for(size_t i=0; i<rs->db->head->nexpr; i++){
+    unsigned i_sect;
+    const char *i_expr = ruledb_expr(rs->db, i, &i_sect);
+    if(i_expr == NULL || i_sect >= rs->rules->_size){
+      errno = EINVAL;
+      error("corrupted regex %ld of rule image", i); return -1;
+    }
+    if(ruleset_addexpr(rs, (struct hostrule*) rs->rules->_warehouse[i_sect], i_expr) < 0){
+      error("could not add regex %ld of rule image", i); return -1;
+    }
+  }
+  return 0;
+}
 
-#section line started with "@@", followed by two ip address:
-#  translated src(the 1st one) and dns server(the 2nd one).
-@@1.2.3.4  8.8.8.8
 
-# A regex expression to select host.
-.*\.google\.com
+/*
+ @Return: path of @path relative to directory of config @base, to free by
+   caller, or NULL when failed.
+*/
+static char*
+conf_path(const char *base, const char *path)
+{
+  const char *slash = strrchr(base, '/');
+  size_t dirlen = (path[0] != '/' && slash != NULL) ? (size_t) (slash - base + 1) : 0;
+  size_t pathlen = strlen(path);
+
+  char *full = (char*) malloc(dirlen + pathlen + 1);
+  if(full == NULL) return NULL;
+  memcpy(full, base, dirlen);
+  memcpy(full + dirlen, path, pathlen + 1);
+  return full;
+}
 
-# Or an destination IP address.
-210.210.210.1
 
-# Another section starts.
-@@2.3.4.5  4.4.2.2
-.*\.yahoo\.com
+/*
+ @Return: argument of directive @name in @line, trailing blanks removed, or
+   NULL when @line is not the directive.
+*/
+static char*
+conf_directive(char *line, const char *name)
+{
+  size_t namelen = strlen(name);
+  if(strncmp(line, name, namelen) != 0 || (line[namelen] != ' ' && line[namelen] != '\t'))
+    return NULL;
+
+  char *arg = line + namelen;
+  while(*arg == ' ' || *arg == '\t') arg++;
+  size_t arglen = strlen(arg);
+  while(arglen > 0 && (arg[arglen - 1] == ' ' || arg[arglen - 1] == '\t')) arg[--arglen] = 0;
+  return arglen ? arg : NULL;
+}
 
 
-@Return: list of struct hostrule.
+/*
+ Remove "\n" or "\r\n" at the end of @line of @linelen.
+
+ @Return: length left.
 */
-struct array*
-genrulelist(const char *cfgfile)
+static size_t
+conf_chomp(char *line, size_t linelen)
 {
-  if(cfgfile == NULL){ errno = EINVAL; return NULL; }
+  if(linelen > 0 && line[linelen - 1] == '\n') line[--linelen] = 0;
+  if(linelen > 0 && line[linelen - 1] == '\r') line[--linelen] = 0;
+  return linelen;
+}
 
-  FILE *f = NULL;
-  const size_t buflen = 1024;
-  char buf[buflen];
-  size_t i = 0;
-  struct hostrule *currrule = NULL;
 
-  // Prepare array to store host rule.
-  struct array *rulelist = ary_new();
-  if(rulelist == NULL){ error("could not create rule list"); return NULL; }
+/*
+ Load domain list @listfile into section @hr, one domain per line, as
+ "example.com" or "+.example.com", which selects it and any host under it,
+ text after blank or "#" ignored. Read line by line into hash of section,
+ no regex compiled, lines not a domain are skipped.
+
+ @Return: count of domains loaded, or -1 when failed.
+*/
+static long
+hostrule_loadlist(struct hostrule *hr, const char *listfile)
+{
+  FILE *f = fopen(listfile, "r");
+  if(f == NULL){ error("could not open domain list \"%s\"", listfile); return -1; }
+
+  char *line = NULL, domain[DNSNAMEBUFLEN];
+  size_t linecap = 0;
+  ssize_t linelen;
+  long n = 0, skipped = 0;
+  errno = 0;
+  while((linelen = getline(&line, &linecap, f)) >= 0){
+    char *name = line;
+    while(*name == ' ' || *name == '\t') name++;
+    if(strncmp(name, DOMAINRULE_PREFIX, strlen(DOMAINRULE_PREFIX)) == 0)
+      name += strlen(DOMAINRULE_PREFIX);
+    size_t namelen = strcspn(name, " \t#\r\n");
+    if(namelen == 0) continue;  // Empty line.
+
+    if(parse_name(name, namelen, 0, domain, DNSNAMEBUFLEN) < 0){
+      skipped ++;
+      continue;
+    }
+    if(hostrule_adddomain(hr, domain) < 0){
+      error("could not append domain of list \"%s\"", listfile);
+      n = -1;
+      break;
+    }
+    n ++;
+  }
+  if(n >= 0 && ferror(f)){ error("read domain list \"%s\" failed", listfile); n = -1; }
+  free(line);
+  fclose(f);
 
-  // Open config file.
-  f = fopen(cfgfile, "r");
-  if(f == NULL){ error("could not open config file"); goto onfail; }
+  if(skipped) warn("%ld lines of domain list \"%s\" skipped, not domains", skipped, listfile);
+  return n;
+}
 
-  while(1){
-    ++i;
 
-    // Read line.
-    if(fgets(buf, buflen, f) == NULL){
-      if(! errno) break; // EOF.
-      error("read config file failed at line %ld", i); goto onfail;
-    }
+/*
+ Parse config @cfgfile into @rs, lines of any length, sections go on across
+ files included, @currrule is the current one, NULL before the first.
+*/
+static int
+ruleset_loadconf(struct ruleset *rs, const char *cfgfile, struct hostrule **currrule,
+		 unsigned depth)
+{
+  if(depth > RULECONF_DEPTH_MAX){
+    errno = ELOOP;
+    error("config \"%s\" included too deep", cfgfile); return -1;
+  }
 
-    // Fail when long line found.
-    size_t i_linelen = strlen(buf);
-    if(i_linelen == 0) continue;  // Empty line.
-    if(i_linelen == buflen - 1){
-      error("long line at %ld, max length allowed %ld", i, buflen - 1); goto onfail;
-    }
+  FILE *f = fopen(cfgfile, "r");
+  if(f == NULL){ error("could not open config file \"%s\"", cfgfile); return -1; }
+
+  struct array *rulelist = rs->rules;
+  char *buf = NULL;
+  size_t bufcap = 0, i = 0;
+  ssize_t linelen;
+  errno = 0;
+  while((linelen = getline(&buf, &bufcap, f)) >= 0){
+    ++i;
 
     // Is a comment line?
     if(buf[0] == '#') continue;
-
-    // Remove '\n' and '\r' at the end of line.
-    if(buf[i_linelen - 1] == '\n'){
-      if(i_linelen >= 2 && buf[i_linelen - 2] == '\r'){
-	buf[i_linelen - 2] = 0;
-	i_linelen -= 2;
-      }else{
-	buf[i_linelen - 1] = 0;
-	--i_linelen;
-      }
-    }
-    if(i_linelen == 0) continue; // Empty line.
+    if(conf_chomp(buf, linelen) == 0) continue; // Empty line.
 
     // Is a section line?
     if(buf[0] == '@' && buf[1] == '@'){
-      unsigned src, dns;
-      if(parse_sect(buf + 2, &src, &dns) < 0){
+      unsigned src, dns[HOSTRULE_DNS_MAX], ndns;
+      if(parse_sect(buf + 2, &src, dns, &ndns) < 0){
 	error("syntax error on section(line: %ld)", i);
 	goto onfail;
       }
 
       // Create rule for new section.
-      if((currrule = hostrule_new(src, dns)) == NULL){
+      if((*currrule = hostrule_new(src, dns, ndns)) == NULL){
 	error("could not create host rule(line: %ld)", i); goto onfail;
       }
 
       // Append new rule to list.
-      if(ary_append(rulelist, currrule) < 0){
-	error("could not append rule(line: %ld)", i); goto onfail;
+      (*currrule)->idx = rulelist->_size;
+      if(ary_append(rulelist, *currrule) < 0){
+	error("could not append rule(line: %ld)", i);
+	hostrule_free(currrule);
+	goto onfail;
       }
-      debug("new section(src: %08X, dns: %08X) created", src, dns);
+      debug("new section(src: %08X, dns: %08X, ndns: %u) created", src, dns[0], ndns);
+      continue;
+    }
+
+    // Is an include line? Path is relative to this file.
+    char *arg;
+    if((arg = conf_directive(buf, RULECONF_INCLUDE)) != NULL){
+      char *path = conf_path(cfgfile, arg);
+      if(path == NULL){ error("could not include(line: %ld)", i); goto onfail; }
+      int r = ruleset_loadconf(rs, path, currrule, depth + 1);
+      free(path);
+      if(r < 0){ error("could not include \"%s\"(line: %ld)", arg, i); goto onfail; }
       continue;
     }
 
     // Any rule must followed a section line.
-    if(currrule == NULL){
+    if(*currrule == NULL){
       error("no section for line %ld", i); goto onfail;
     }
 
-    // Check if an IP address, if not so, treat as regex expression.
-    size_t i_start = 0;
-    unsigned i_ip = parse_ipv4((const unsigned char*) buf, i_linelen, &i_start);
-    if(i_ip && isemptystr(buf + i_start)){
-      if(ary_append(currrule->ips, (void*)(size_t) i_ip) < 0){
+    // Is a domain list of section?
+    if((arg = conf_directive(buf, RULECONF_DOMAINS)) != NULL){
+      char *path = conf_path(cfgfile, arg);
+      long n = (path != NULL) ? hostrule_loadlist(*currrule, path) : -1;
+      free(path);
+      if(n < 0){ error("could not load domain list \"%s\"(line: %ld)", arg, i); goto onfail; }
+      debug("%ld domains of list \"%s\" added", n, arg);
+      continue;
+    }
+    if(buf[0] == '@'){
+      errno = EINVAL;
+      error("unknown directive(line: %ld)", i); goto onfail;
+    }
+
+    // Check if an IP address or CIDR, if not so, treat as regex expression.
+    unsigned i_ip, i_plen;
+    if(parse_cidr(buf, &i_ip, &i_plen) == 0){
+      if(lpm_add(rs->dsts, i_ip, i_plen, (*currrule)->idx) < 0){
 	error("could not append IP(line: %ld)", i); goto onfail;
       }
-      debug("IP %08X added", i_ip);
+      debug("IP %08X/%u added", i_ip, i_plen);
+      continue;
+    }
+
+    // Check if a domain, looked up by hash instead of running regex.
+    char i_domain[DNSNAMEBUFLEN];
+    if(parse_domain(buf, i_domain, DNSNAMEBUFLEN) == 0){
+      if(hostrule_adddomain(*currrule, i_domain) < 0){
+	error("could not append domain(line: %ld)", i); goto onfail;
+      }
+      debug("Domain \"%s\" added", i_domain);
       continue;
     }
-    
-    regex_t *i_reg = reg_new(buf);
-    if(i_reg == NULL){ error("could not compile regex(line: %ld)", i); goto onfail; }
-    if(ary_append(currrule->regs, i_reg) < 0){
-      error("could not append compiled regex(line: %ld)", i); goto onfail;
+    if(strncmp(buf, DOMAINRULE_PREFIX, strlen(DOMAINRULE_PREFIX)) == 0){
+      errno = EINVAL;
+      error("invalid domain(line: %ld)", i); goto onfail;
+    }
+
+    if(ruleset_addexpr(rs, *currrule, buf) < 0){
+      error("could not add regex(line: %ld)", i); goto onfail;
     }
     debug("Host \"%s\" added", buf);
   }
-  
+  if(ferror(f)){ error("read config file failed at line %ld", i + 1); goto onfail; }
+
+  free(buf);
   fclose(f);
-  debug("got %ld section", rulelist->_size);
-  return rulelist;
-  
+  return 0;
 
  onfail:
-  for(size_t j=0; j<rulelist->_size; j++){
-    struct hostrule *i_hr= (struct hostrule*) (rulelist->_warehouse[j]);
-    hostrule_free(&i_hr);
+  error("load config file \"%s\" failed", cfgfile);
+  free(buf);
+  fclose(f);
+  return -1;
+}
+
+
+/*
+ Generate rule list on config file like:
+
+#comment line
+
+#section line started with "@@", followed by ip addresses: translated
+#  src(the 1st one) and dns servers(the others, 4 at most), queries go to
+#  the fastest one healthy.
+@@1.2.3.4  8.8.8.8  8.8.4.4
+
+# A regex expression to select host.
+.*\.google\.com
+
+# A domain, select the domain itself and any host under it, same as regex
+# "^(.*\.)*example\.com$", which is detected and loaded as a domain too.
++.example.com
+
+# A list of such domains, one per line, path is relative to this file.
+@domains gfwlist.txt
+
+# Or an destination IP address, or CIDR.
+210.210.210.1
+10.1.0.0/16
+
+# Another section starts.
+@@2.3.4.5  4.4.2.2
+.*\.yahoo\.com
+
+# Lines of another config, as if here, it may start sections too.
+@include more.conf
+
+
+Regexes of all sections are compiled into one automaton when supported.
+
+@cfgfile may be a rule image compiled of such config instead, see
+ruledb.h, which is mapped rather than parsed.
+
+@Return: rule set, or NULL when failed.
+*/
+struct ruleset*
+genruleset(const char *cfgfile)
+{
+  if(cfgfile == NULL){ errno = EINVAL; return NULL; }
+
+  struct hostrule *currrule = NULL;
+
+  // Prepare rule set to store host rule.
+  struct ruleset *rs = (struct ruleset*) calloc(sizeof(struct ruleset), 1);
+  if(rs == NULL){ error("could not create rule set"); return NULL; }
+  if((rs->rules = ary_new()) == NULL || (rs->dfa = redfa_new()) == NULL ||
+     (rs->dsts = lpm_new()) == NULL){
+    error("could not create rule list"); goto onfail;
   }
-  ary_free(&rulelist);
+  rs->serial = __sync_add_and_fetch(&ruleset_serial, 1);
+
+  if(ruledb_probe(cfgfile) == 1){
+    if(ruleset_loaddb(rs, cfgfile) < 0){
+      error("could not load rule image \"%s\"", cfgfile); goto onfail;
+    }
+    debug("got %ld section, %ld NFA states from rule image", rs->rules->_size,
+	  rs->dfa->nstate);
+    return rs;
+  }
+
+  if(ruleset_loadconf(rs, cfgfile, &currrule, 0) < 0) goto onfail;
+  debug("got %ld section, %ld NFA states, %ld prefixes", rs->rules->_size,
+	rs->dfa->nstate, rs->dsts->nprefix + rs->dsts->hosts->_size);
+  return rs;
   
-  if(f != NULL) fclose(f);
+
+ onfail:
+  ruleset_free(&rs);
   return NULL;  
 }
 
+
+void
+ruleset_free(struct ruleset **rs)
+{
+  if(rs == NULL || *rs == NULL) return;
+
+  if((*rs)->rules != NULL){
+    for(size_t i=0; i<(*rs)->rules->_size; i++){
+      struct hostrule *i_hr = (struct hostrule*) ((*rs)->rules->_warehouse[i]);
+      hostrule_free(&i_hr);
+    }
+    ary_free(&((*rs)->rules));
+  }
+  redfa_free(&((*rs)->dfa));
+  lpm_free(&((*rs)->dsts));
+  ruledb_close(&((*rs)->db));
+  free(*rs);
+  *rs = NULL;
+}
+
+
+/*
+ Find the first section matches host @name, the automaton reports the
+ first section of its regexes by one pass, so does the rule image of its
+ domains, only sections before them are checked on their domains and the
+ rest regexes.
+
+ @Return: rule of the section, or NULL when none.
+*/
+struct hostrule*
+ruleset_match(const struct ruleset *rs, const char *name)
+{
+  if(rs == NULL || name == NULL) return NULL;
+
+  unsigned first = redfa_match(rs->dfa, name);
+  size_t namelen = strlen(name);
+  if(rs->db != NULL && namelen < DNSNAMEBUFLEN){
+    char lname[DNSNAMEBUFLEN];
+    for(size_t i=0; i<namelen; i++) lname[i] = tolower((unsigned char) name[i]);
+    unsigned dom = ruledb_domain(rs->db, lname, namelen);
+    if(dom < first) first = dom;
+  }
+
+  size_t end = (first < rs->rules->_size) ? first : rs->rules->_size;
+  for(size_t i=0; i<end; i++){
+    struct hostrule *i_hr = (struct hostrule*) rs->rules->_warehouse[i];
+    if(hostrule_match(i_hr, name)) return i_hr;
+  }
+  return (first < rs->rules->_size) ? (struct hostrule*) rs->rules->_warehouse[first] : NULL;
+}
+
+
+/*
+ @Return: index of section of the longest prefix covering @ip(host order),
+   or LPM_NONE when none.
+*/
+unsigned
+ruleset_dst(const struct ruleset *rs, unsigned ip)
+{
+  if(rs->db != NULL) return ruledb_dst(rs->db, ip);
+  return lpm_get(rs->dsts, ip);
+}
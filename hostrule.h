@@ -4,14 +4,57 @@
 #include "common.h"
 
 
+// Prefix of a domain rule, "+.example.com" matches example.com and any
+// host under it.
+#define DOMAINRULE_PREFIX  "+."
+
+#define HOSTRULE_DNS_MAX   4     // max DNS servers of a section.
+
+// Directives of config, "@include <file>" reads lines of another config,
+// "@domains <file>" loads a list of domains, one per line, to section.
+#define RULECONF_INCLUDE    "@include"
+#define RULECONF_DOMAINS    "@domains"
+#define RULECONF_DEPTH_MAX  8     // max depth of configs included.
+
+
 /*
-@dns: should treat as NULL when zero.
+@idx: index of section in rule set.
+@dns: DNS servers of section, @ndns in all, query goes to the fastest one
+  healthy, see upstream.h.
 @regs: list of compiled regex_t to check if host name matches.
-@ips: list of ipv4 that match.
+@exprs: text of all regexes of section, in automaton or @regs, to compile
+  rule image.
+@domains: set of lower-case domains, host name matches when it or any of
+  its parent domains is in the set.
 */
 struct hostrule{
-  unsigned src, dns;
-  struct array *regs, *ips;
+  unsigned idx, src;
+  unsigned dns[HOSTRULE_DNS_MAX], ndns;
+  struct array *regs, *exprs;
+  struct htable *domains;
+};
+
+
+/*
+ Rules generated from config file.
+
+@serial: unique among all rule sets, to tell which one results cached of.
+@rules: list of struct hostrule, in order of sections.
+@dfa: regexes of all sections in one automaton, reports index of the
+  first section matched. Regexes it does not support are left in @regs of
+  their section.
+@dsts: index of section by destination address, from IP and CIDR of
+  config.
+@db: rule image mapped when config is one, domains and addresses are
+  looked up in it instead of @domains of sections and @dsts, which are
+  left empty.
+*/
+struct ruleset{
+  unsigned long serial;
+  struct array *rules;
+  struct redfa *dfa;
+  struct lpm *dsts;
+  struct ruledb *db;
 };
 
 
@@ -22,11 +65,17 @@ void
 reg_free(regex_t **reg);
 
 struct hostrule*
-hostrule_new(unsigned src, unsigned dns);
+hostrule_new(unsigned src, const unsigned *dns, unsigned ndns);
 
 void
 hostrule_free(struct hostrule **hr);
 
+int
+hostrule_adddomain(struct hostrule *hr, const char *domain);
+
+int
+hostrule_match(const struct hostrule *hr, const char *name);
+
 unsigned
 parse_ipv4(const unsigned char *data, size_t datalen, size_t *start);
 
@@ -34,9 +83,21 @@ int
 isemptystr(const char *text);
 
 int
-parse_sect(const char *section, unsigned *src, unsigned *dns);
+parse_cidr(const char *text, unsigned *ip, unsigned *plen);
+
+int
+parse_sect(const char *section, unsigned *src, unsigned *dns, unsigned *ndns);
+
+struct ruleset*
+genruleset(const char *cfgfile);
 
-struct array*
-genrulelist(const char *cfgfile);
+void
+ruleset_free(struct ruleset **rs);
+
+struct hostrule*
+ruleset_match(const struct ruleset *rs, const char *name);
+
+unsigned
+ruleset_dst(const struct ruleset *rs, unsigned ip);
 
 #endif
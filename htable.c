@@ -0,0 +1,165 @@
+#include "htable.h"
+
+
+#define HT_INIT_CAPA  16
+
+
+/*
+ FNV-1a hash.
+*/
+size_t
+ht_hash(const void *key, size_t keylen)
+{
+  const unsigned char *p = (const unsigned char*) key;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for(size_t i=0; i<keylen; i++){
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return (size_t) (h ^ (h >> 32));
+}
+
+
+struct htable*
+ht_new(void)
+{
+  struct htable *ht = (struct htable*) calloc(sizeof(struct htable), 1);
+  if(ht == NULL) return NULL;
+
+  ht->_capa = HT_INIT_CAPA;
+  ht->_buckets = (struct hnode**) calloc(sizeof(struct hnode*), ht->_capa);
+  if(ht->_buckets == NULL){
+    free(ht);
+    return NULL;
+  }
+  return ht;
+}
+
+
+/*
+ Free table and all nodes, data referenced by nodes is NOT freed.
+*/
+void
+ht_free(struct htable **ht)
+{
+  if(ht == NULL || *ht == NULL) return;
+
+  for(size_t i=0; i<(*ht)->_capa; i++){
+    struct hnode *node = (*ht)->_buckets[i];
+    while(node != NULL){
+      struct hnode *next = node->next;
+      free(node);
+      node = next;
+    }
+  }
+  free((*ht)->_buckets);
+  free(*ht);
+  *ht = NULL;
+}
+
+
+static struct hnode**
+ht_lookup(const struct htable *ht, size_t hash, const void *key, size_t keylen)
+{
+  struct hnode **pnode = &(ht->_buckets[hash & (ht->_capa - 1)]);
+  while(*pnode != NULL){
+    struct hnode *node = *pnode;
+    if(node->hash == hash && node->keylen == keylen &&
+       memcmp(node->key, key, keylen) == 0) break;
+    pnode = &(node->next);
+  }
+  return pnode;
+}
+
+
+/*
+ Double buckets, keep chains short.
+*/
+static int
+ht_grow(struct htable *ht)
+{
+  size_t newcapa = ht->_capa * 2;
+  struct hnode **buckets = (struct hnode**) calloc(sizeof(struct hnode*), newcapa);
+  if(buckets == NULL) return -1;
+
+  for(size_t i=0; i<ht->_capa; i++){
+    struct hnode *node = ht->_buckets[i];
+    while(node != NULL){
+      struct hnode *next = node->next;
+      size_t idx = node->hash & (newcapa - 1);
+      node->next = buckets[idx];
+      buckets[idx] = node;
+      node = next;
+    }
+  }
+  free(ht->_buckets);
+  ht->_buckets = buckets;
+  ht->_capa = newcapa;
+  return 0;
+}
+
+
+/*
+ @Return: data of @key, or NULL when not found.
+*/
+void*
+ht_get(const struct htable *ht, const void *key, size_t keylen)
+{
+  if(ht == NULL || key == NULL){ errno = EINVAL; return NULL; }
+
+  struct hnode *node = *ht_lookup(ht, ht_hash(key, keylen), key, keylen);
+  return (node != NULL) ? node->data : NULL;
+}
+
+
+/*
+ Set data of @key, replace the old one when exists.
+*/
+int
+ht_put(struct htable *ht, const void *key, size_t keylen, void *data)
+{
+  if(ht == NULL || key == NULL){ errno = EINVAL; return -1; }
+
+  size_t hash = ht_hash(key, keylen);
+  struct hnode **pnode = ht_lookup(ht, hash, key, keylen);
+  if(*pnode != NULL){
+    (*pnode)->data = data;
+    return 0;
+  }
+
+  struct hnode *node = (struct hnode*) malloc(sizeof(struct hnode) + keylen);
+  if(node == NULL) return -1;
+  node->next = NULL;
+  node->hash = hash;
+  node->data = data;
+  node->keylen = keylen;
+  memcpy(node->key, key, keylen);
+  *pnode = node;
+
+  // Grow when load factor exceeds 1, keep table usable when failed.
+  if(++(ht->_size) > ht->_capa && ht_grow(ht) < 0)
+    debug("could not grow hash table of size %ld", ht->_size);
+  return 0;
+}
+
+
+/*
+ Remove @key.
+
+ @Return: data of @key removed, or NULL when not found.
+*/
+void*
+ht_del(struct htable *ht, const void *key, size_t keylen)
+{
+  if(ht == NULL || key == NULL){ errno = EINVAL; return NULL; }
+
+  struct hnode **pnode = ht_lookup(ht, ht_hash(key, keylen), key, keylen);
+  struct hnode *node = *pnode;
+  if(node == NULL) return NULL;
+
+  void *data = node->data;
+  *pnode = node->next;
+  free(node);
+  ht->_size --;
+  return data;
+}
@@ -0,0 +1,52 @@
+#ifndef _HTABLE_H_
+#define _HTABLE_H_
+
+#include "common.h"
+
+
+/*
+ Node of hash table, key is copied into node.
+*/
+struct hnode{
+  struct hnode *next;
+  size_t hash;
+  void *data;
+  size_t keylen;
+  unsigned char key[];
+};
+
+
+/*
+ Hash table with separate chaining, keyed by bytes.
+
+@_size: count of nodes.
+@_buckets: heads of chain.
+@_capa: count of buckets, always power of 2.
+*/
+struct htable{
+  size_t _size;
+
+  struct hnode **_buckets;
+  size_t _capa;
+};
+
+
+size_t
+ht_hash(const void *key, size_t keylen);
+
+struct htable*
+ht_new(void);
+
+void
+ht_free(struct htable **ht);
+
+void*
+ht_get(const struct htable *ht, const void *key, size_t keylen);
+
+int
+ht_put(struct htable *ht, const void *key, size_t keylen, void *data);
+
+void*
+ht_del(struct htable *ht, const void *key, size_t keylen);
+
+#endif
@@ -0,0 +1,180 @@
+#include "ljournal.h"
+
+
+int
+ljournal_init(struct ljournal *j, const char *path)
+{
+  if(j == NULL || path == NULL){ errno = EINVAL; return -1; }
+
+  memset(j, 0, sizeof(struct ljournal));
+  j->fd = -1;
+  if((j->path = strdup(path)) == NULL) return -1;
+  return 0;
+}
+
+
+/*
+ Read all records of journal @path into @records, @n in all, to free by
+ caller. No record when file not exists.
+*/
+int
+ljournal_load(const char *path, struct ljrecord **records, size_t *n)
+{
+  if(path == NULL || records == NULL || n == NULL){ errno = EINVAL; return -1; }
+
+  *records = NULL;
+  *n = 0;
+  FILE *f = fopen(path, "rb");
+  if(f == NULL) return (errno == ENOENT) ? 0 : -1;
+
+  struct ljhead head;
+  if(fread(&head, sizeof(head), 1, f) != 1){
+    // Empty or head not written, as no record.
+    int r = ferror(f) ? -1 : 0;
+    fclose(f);
+    return r;
+  }
+  if(memcmp(head.magic, LJOURNAL_MAGIC, sizeof(head.magic)) ||
+     head.version != LJOURNAL_VERSION || head.recsize != sizeof(struct ljrecord)){
+    fclose(f);
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct stat st;
+  if(fstat(fileno(f), &st) < 0){ fclose(f); return -1; }
+  size_t capa = (st.st_size - sizeof(head)) / sizeof(struct ljrecord);
+  if(capa > 0 && (*records = (struct ljrecord*) malloc(capa * sizeof(struct ljrecord))) == NULL){
+    fclose(f);
+    return -1;
+  }
+  *n = fread(*records, sizeof(struct ljrecord), capa, f);
+  int r = ferror(f) ? -1 : 0;
+  fclose(f);
+  if(r < 0){
+    free(*records);
+    *records = NULL;
+    *n = 0;
+  }
+  return r;
+}
+
+
+/*
+ Add route of @ip to section of @src till @expire, written by next
+ ljournal_append(...) of records taken.
+*/
+int
+ljournal_add(struct ljournal *j, unsigned ip, unsigned src, time_t expire)
+{
+  if(j->npending == j->capa){
+    if(j->capa == LJOURNAL_PENDING_MAX){
+      j->dropped ++;
+      errno = ENOBUFS;
+      return -1;
+    }
+    size_t capa = j->capa ? j->capa * 2 : 64;
+    struct ljrecord *pending = (struct ljrecord*) realloc(j->pending, capa * sizeof(struct ljrecord));
+    if(pending == NULL){ j->dropped ++; return -1; }
+    j->pending = pending;
+    j->capa = capa;
+  }
+
+  struct ljrecord *rec = &(j->pending[j->npending++]);
+  rec->ip = ip;
+  rec->src = src;
+  rec->expire = expire;
+  return 0;
+}
+
+
+/*
+ Take records pending into @records, @n in all, to free by caller, so
+ they are written without holding what protects @j.
+*/
+void
+ljournal_take(struct ljournal *j, struct ljrecord **records, size_t *n)
+{
+  *records = j->pending;
+  *n = j->npending;
+  j->pending = NULL;
+  j->npending = j->capa = 0;
+}
+
+
+static int
+writeall(int fd, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char*) data;
+  while(len > 0){
+    ssize_t n = write(fd, p, len);
+    if(n < 0 && errno == EINTR) continue;
+    if(n < 0) return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+/*
+ Append @records, @n in all, to journal opened by ljournal_rewrite(...).
+ Journal is closed when failed, as a record may be written in part, and
+ should be rewritten then.
+*/
+int
+ljournal_append(struct ljournal *j, const struct ljrecord *records, size_t n)
+{
+  if(j->fd < 0){ errno = EBADF; return -1; }
+  if(n == 0) return 0;
+
+  if(writeall(j->fd, records, n * sizeof(struct ljrecord)) < 0){
+    int err = errno;
+    close(j->fd);
+    j->fd = -1;
+    errno = err;
+    return -1;
+  }
+  j->nrecord += n;
+  return 0;
+}
+
+
+/*
+ Replace journal with one of @records, @n in all, written aside then
+ renamed, so the old one is intact till then, and open it to append.
+*/
+int
+ljournal_rewrite(struct ljournal *j, const struct ljrecord *records, size_t n)
+{
+  size_t pathlen = strlen(j->path) + 5;
+  char *tmpfile = (char*) malloc(pathlen);
+  if(tmpfile == NULL) return -1;
+  snprintf(tmpfile, pathlen, "%s.tmp", j->path);
+
+  int fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if(fd < 0) goto onfail;
+
+  struct ljhead head;
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, LJOURNAL_MAGIC, sizeof(head.magic));
+  head.version = LJOURNAL_VERSION;
+  head.recsize = sizeof(struct ljrecord);
+  if(writeall(fd, &head, sizeof(head)) < 0 ||
+     writeall(fd, records, n * sizeof(struct ljrecord)) < 0 ||
+     fsync(fd) < 0 || rename(tmpfile, j->path) < 0) goto onfail;
+  free(tmpfile);
+
+  if(j->fd >= 0) close(j->fd);
+  j->fd = fd;
+  j->nrecord = n;
+  return 0;
+
+ onfail:
+  if(fd >= 0){
+    close(fd);
+    unlink(tmpfile);
+  }
+  free(tmpfile);
+  return -1;
+}
@@ -0,0 +1,76 @@
+#ifndef _LJOURNAL_H_
+#define _LJOURNAL_H_
+
+#include "common.h"
+
+
+#define LJOURNAL_MAGIC        "XNATLRJ"  // 8 bytes with NUL, head of journal.
+#define LJOURNAL_VERSION      1
+#define LJOURNAL_PENDING_MAX  65536      // max records pending, more are dropped.
+#define LJOURNAL_COMPACT_MIN  4096       // records in file before compacted.
+
+
+/*
+ Head of journal file, records follow till the end, a partial one at the
+ end, of write interrupted, is ignored.
+*/
+struct ljhead{
+  char magic[8];
+  uint32_t version, recsize;
+};
+
+
+/*
+ Route learned, section is told by its source address, which stays the
+ same when sections reordered.
+
+@ip: address, in host order.
+@src: source address of section, host order.
+@expire: wall clock time when route expires.
+*/
+struct ljrecord{
+  uint32_t ip, src;
+  int64_t expire;
+};
+
+
+/*
+ Append-only journal of learned routes, replayed at startup. Records are
+ added to memory, then appended to file in batch, the file is rewritten
+ with routes alive when too many records in it. NOT thread safe.
+
+@path: of journal file.
+@fd: opened to append, -1 when not yet.
+@pending: records not written yet, @npending in all, room for @capa.
+@nrecord: count of records in file.
+@dropped: count of records dropped when too many pending.
+*/
+struct ljournal{
+  char *path;
+  int fd;
+  struct ljrecord *pending;
+  size_t npending, capa;
+  size_t nrecord;
+  unsigned long dropped;
+};
+
+
+int
+ljournal_init(struct ljournal *j, const char *path);
+
+int
+ljournal_load(const char *path, struct ljrecord **records, size_t *n);
+
+int
+ljournal_add(struct ljournal *j, unsigned ip, unsigned src, time_t expire);
+
+void
+ljournal_take(struct ljournal *j, struct ljrecord **records, size_t *n);
+
+int
+ljournal_append(struct ljournal *j, const struct ljrecord *records, size_t n);
+
+int
+ljournal_rewrite(struct ljournal *j, const struct ljrecord *records, size_t n);
+
+#endif
@@ -0,0 +1,122 @@
+#include "lpm.h"
+
+
+static struct lpmnode*
+lpmnode_new(void)
+{
+  struct lpmnode *node = (struct lpmnode*) calloc(sizeof(struct lpmnode), 1);
+  if(node == NULL) return NULL;
+
+  for(int i=0; i<256; i++) node->val[i] = LPM_NONE;
+  return node;
+}
+
+
+static void
+lpmnode_free(struct lpmnode *node)
+{
+  if(node == NULL) return;
+
+  for(int i=0; i<256; i++) lpmnode_free(node->child[i]);
+  free(node);
+}
+
+
+struct lpm*
+lpm_new(void)
+{
+  struct lpm *t = (struct lpm*) calloc(sizeof(struct lpm), 1);
+  if(t == NULL) return NULL;
+
+  if((t->root = lpmnode_new()) == NULL || (t->hosts = ht_new()) == NULL){
+    lpmnode_free(t->root);
+    free(t);
+    return NULL;
+  }
+  return t;
+}
+
+
+void
+lpm_free(struct lpm **t)
+{
+  if(t == NULL || *t == NULL) return;
+
+  lpmnode_free((*t)->root);
+  ht_free(&((*t)->hosts));
+  free(*t);
+  *t = NULL;
+}
+
+
+/*
+ Add prefix @ip/@plen(host order) of @val.
+
+ @Return: 0 when added, 1 when same prefix exists with value not greater,
+   -1 when failed.
+*/
+int
+lpm_add(struct lpm *t, unsigned ip, unsigned plen, unsigned val)
+{
+  if(t == NULL || plen > 32 || val == LPM_NONE){ errno = EINVAL; return -1; }
+
+  if(plen == 32){
+    unsigned key = htonl(ip);
+    size_t old = (size_t) ht_get(t->hosts, &key, sizeof(key));
+    if(old != 0 && old - 1 <= val) return 1;
+    return ht_put(t->hosts, &key, sizeof(key), (void*) ((size_t) val + 1));
+  }
+
+  // Bits not in prefix ignored.
+  ip &= plen ? ~((1U << (32 - plen)) - 1) : 0;
+
+  // Go down to level where prefix ends.
+  struct lpmnode *node = t->root;
+  unsigned level = 0;
+  for(; plen > (level + 1) * 8; level++){
+    unsigned char idx = ip >> (24 - level * 8);
+    if(node->child[idx] == NULL && (node->child[idx] = lpmnode_new()) == NULL) return -1;
+    node = node->child[idx];
+  }
+
+  // Expand to entries covered, keep longer prefixes.
+  unsigned span = 1U << ((level + 1) * 8 - plen);
+  unsigned first = (unsigned char) (ip >> (24 - level * 8));
+  int exists = 0, changed = 0;
+  for(unsigned i=first; i<first+span; i++){
+    if(node->val[i] != LPM_NONE && node->plen[i] >= plen){
+      if(node->plen[i] > plen) continue;
+      exists = 1;
+      if(node->val[i] <= val) continue;
+    }
+    node->val[i] = val;
+    node->plen[i] = plen;
+    changed = 1;
+  }
+  if(! exists) t->nprefix ++;
+  return (exists && ! changed) ? 1 : 0;
+}
+
+
+/*
+ @Return: value of the longest prefix covering @ip(host order), or
+   LPM_NONE when none.
+*/
+unsigned
+lpm_get(const struct lpm *t, unsigned ip)
+{
+  if(t == NULL) return LPM_NONE;
+
+  unsigned key = htonl(ip);
+  size_t host = (size_t) ht_get(t->hosts, &key, sizeof(key));
+  if(host != 0) return host - 1;
+
+  unsigned val = LPM_NONE;
+  const struct lpmnode *node = t->root;
+  for(unsigned level=0; node != NULL && level<4; level++){
+    unsigned char idx = ip >> (24 - level * 8);
+    if(node->val[idx] != LPM_NONE) val = node->val[idx];
+    node = node->child[idx];
+  }
+  return val;
+}
@@ -0,0 +1,56 @@
+#ifndef _LPM_H_
+#define _LPM_H_
+
+#include "common.h"
+
+
+#define LPM_NONE  ((unsigned) -1)
+
+
+/*
+ Node of prefix trie, 8 bits of address per level, prefix not ending on
+ level boundary is expanded to all entries it covers.
+
+@child: node of next level.
+@val: value of the longest prefix ending on this level covering entry,
+  LPM_NONE when none.
+@plen: length of that prefix.
+*/
+struct lpmnode{
+  struct lpmnode *child[256];
+  unsigned val[256];
+  unsigned char plen[256];
+};
+
+
+/*
+ Longest-prefix-match table of ipv4 address to value, host addresses(/32)
+ are kept in hash, shorter prefixes in trie, so lookup is one hash probe
+ plus at most 4 levels, no matter how many entries.
+
+ Values are also priorities, on same prefix the least one is kept.
+
+@root: trie of prefixes shorter than 32.
+@hosts: value + 1 by host address in network order.
+@nprefix: count of prefixes in @root.
+*/
+struct lpm{
+  struct lpmnode *root;
+  struct htable *hosts;
+  size_t nprefix;
+};
+
+
+struct lpm*
+lpm_new(void);
+
+void
+lpm_free(struct lpm **t);
+
+int
+lpm_add(struct lpm *t, unsigned ip, unsigned plen, unsigned val);
+
+unsigned
+lpm_get(const struct lpm *t, unsigned ip);
+
+#endif
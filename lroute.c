@@ -0,0 +1,235 @@
+#include "lroute.h"
+
+
+struct lroutes*
+lroutes_new(void)
+{
+  struct lroutes *t = (struct lroutes*) calloc(sizeof(struct lroutes), 1);
+  if(t == NULL) return NULL;
+
+  if((t->index = ht_new()) == NULL || (t->heap = ary_new()) == NULL){
+    ht_free(&(t->index));
+    free(t);
+    return NULL;
+  }
+  for(size_t i=0; i<LROUTES_GENS; i++) t->gens[i] = 1;
+  return t;
+}
+
+
+void
+lroutes_free(struct lroutes **t)
+{
+  if(t == NULL || *t == NULL) return;
+
+  for(size_t i=0; i<(*t)->heap->_size; i++) free((*t)->heap->_warehouse[i]);
+  ary_free(&((*t)->heap));
+  ht_free(&((*t)->index));
+  free(*t);
+  *t = NULL;
+}
+
+
+/*
+ Route of @ip(host order) changed, copies of lookups in its stripe are stale.
+*/
+static void
+lroutes_touch(struct lroutes *t, unsigned ip)
+{
+  __atomic_add_fetch(&(t->gens[ip % LROUTES_GENS]), 1, __ATOMIC_SEQ_CST);
+}
+
+
+static void
+lroutes_swap(struct array *heap, size_t i, size_t j)
+{
+  struct lroute *ri = (struct lroute*) heap->_warehouse[i],
+    *rj = (struct lroute*) heap->_warehouse[j];
+  heap->_warehouse[i] = rj; rj->heapidx = i;
+  heap->_warehouse[j] = ri; ri->heapidx = j;
+}
+
+
+static void
+lroutes_up(struct array *heap, size_t i)
+{
+  while(i > 0){
+    size_t parent = (i - 1) / 2;
+    if(((struct lroute*) heap->_warehouse[parent])->expire <=
+       ((struct lroute*) heap->_warehouse[i])->expire) break;
+    lroutes_swap(heap, i, parent);
+    i = parent;
+  }
+}
+
+
+static void
+lroutes_down(struct array *heap, size_t i)
+{
+  while(1){
+    size_t least = i, l = 2 * i + 1, r = l + 1;
+    if(l < heap->_size && ((struct lroute*) heap->_warehouse[l])->expire <
+       ((struct lroute*) heap->_warehouse[least])->expire) least = l;
+    if(r < heap->_size && ((struct lroute*) heap->_warehouse[r])->expire <
+       ((struct lroute*) heap->_warehouse[least])->expire) least = r;
+    if(least == i) break;
+    lroutes_swap(heap, i, least);
+    i = least;
+  }
+}
+
+
+/*
+ Learn route of @ip(host order) to section @idx, till @expire. Route
+ learned before is refreshed, to the earlier section and later expire.
+
+ @Return: 0 when added, 1 when refreshed, -1 when failed.
+*/
+int
+lroutes_put(struct lroutes *t, unsigned ip, unsigned idx, time_t expire)
+{
+  if(t == NULL){ errno = EINVAL; return -1; }
+
+  unsigned key = htonl(ip);
+  struct lroute *lr = (struct lroute*) ht_get(t->index, &key, sizeof(key));
+  if(lr != NULL){
+    if(idx < lr->idx){
+      lr->idx = idx;
+      lroutes_touch(t, ip);
+    }
+    if(expire > lr->expire){
+      lr->expire = expire;
+      lroutes_down(t->heap, lr->heapidx);
+    }
+    return 1;
+  }
+
+  if((lr = (struct lroute*) malloc(sizeof(struct lroute))) == NULL) return -1;
+  lr->ip = ip;
+  lr->idx = idx;
+  lr->expire = expire;
+  lr->heapidx = t->heap->_size;
+  if(ary_append(t->heap, lr) < 0){
+    free(lr);
+    return -1;
+  }
+  if(ht_put(t->index, &key, sizeof(key), lr) < 0){
+    t->heap->_size --;
+    free(lr);
+    return -1;
+  }
+  lroutes_up(t->heap, lr->heapidx);
+  lroutes_touch(t, ip);
+  return 0;
+}
+
+
+/*
+ @Return: section of @ip(host order), or LPM_NONE when not learned or
+   expired at @now.
+*/
+unsigned
+lroutes_get(const struct lroutes *t, unsigned ip, time_t now)
+{
+  if(t == NULL) return LPM_NONE;
+
+  unsigned key = htonl(ip);
+  const struct lroute *lr = (const struct lroute*) ht_get(t->index, &key, sizeof(key));
+  return (lr != NULL && lr->expire > now) ? lr->idx : LPM_NONE;
+}
+
+
+/*
+ @expire: set to expire time of route when learned, expired or not.
+ @Return: section of @ip(host order), or LPM_NONE when not learned.
+*/
+unsigned
+lroutes_peek(const struct lroutes *t, unsigned ip, time_t *expire)
+{
+  if(t == NULL) return LPM_NONE;
+
+  unsigned key = htonl(ip);
+  const struct lroute *lr = (const struct lroute*) ht_get(t->index, &key, sizeof(key));
+  if(lr == NULL) return LPM_NONE;
+  *expire = lr->expire;
+  return lr->idx;
+}
+
+
+/*
+ @Return: generation of stripe of @ip(host order), safe to call without
+   what protects @t. Lookup of @ip is unchanged while it stays the same,
+   except that routes expire by time.
+*/
+unsigned long
+lroutes_gen(const struct lroutes *t, unsigned ip)
+{
+  return __atomic_load_n(&(t->gens[ip % LROUTES_GENS]), __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ Remove at most @max routes expired at @now, bound the time spent, rest
+ are removed by next call and never matched before.
+
+ @Return: count of routes removed.
+*/
+size_t
+lroutes_expire(struct lroutes *t, time_t now, size_t max)
+{
+  if(t == NULL) return 0;
+
+  size_t n = 0;
+  struct array *heap = t->heap;
+  while(n < max && heap->_size > 0){
+    struct lroute *lr = (struct lroute*) heap->_warehouse[0];
+    if(lr->expire > now) break;
+
+    lroutes_swap(heap, 0, heap->_size - 1);
+    heap->_size --;
+    lroutes_down(heap, 0);
+
+    unsigned key = htonl(lr->ip);
+    ht_del(t->index, &key, sizeof(key));
+    debug("route %08X of section %u expired", lr->ip, lr->idx);
+    free(lr);
+    n ++;
+  }
+  t->expired += n;
+  return n;
+}
+
+
+/*
+ Move routes to sections of new index, section @idx to @map[idx], routes
+ of section out of @map or mapped to LPM_NONE are removed.
+
+ @Return: count of routes removed.
+*/
+size_t
+lroutes_remap(struct lroutes *t, const unsigned *map, size_t nmap)
+{
+  if(t == NULL) return 0;
+
+  struct array *heap = t->heap;
+  size_t left = 0;
+  for(size_t i=0; i<heap->_size; i++){
+    struct lroute *lr = (struct lroute*) heap->_warehouse[i];
+    unsigned idx = (lr->idx < nmap) ? map[lr->idx] : LPM_NONE;
+    if(idx == LPM_NONE){
+      unsigned key = htonl(lr->ip);
+      ht_del(t->index, &key, sizeof(key));
+      free(lr);
+      continue;
+    }
+    lr->idx = idx;
+    lr->heapidx = left;
+    heap->_warehouse[left++] = lr;
+  }
+
+  size_t n = heap->_size - left;
+  heap->_size = left;
+  for(size_t i=left/2; i>0; i--) lroutes_down(heap, i - 1);
+  for(size_t i=0; i<LROUTES_GENS; i++) lroutes_touch(t, i);
+  return n;
+}
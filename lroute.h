@@ -0,0 +1,70 @@
+#ifndef _LROUTE_H_
+#define _LROUTE_H_
+
+#include "common.h"
+
+
+#define LROUTES_GENS  64  // stripes of generation, by address.
+
+/*
+ Route learned from A record of DNS response.
+
+@ip: address, in host order.
+@idx: index of section matched by the name.
+@expire: time when the route expires, by TTL of record.
+@heapidx: position in heap of table.
+*/
+struct lroute{
+  unsigned ip, idx;
+  time_t expire;
+  size_t heapidx;
+};
+
+
+/*
+ Table of learned routes, indexed by address, and kept in a min heap by
+ expire time, so the expired ones are removed from the top incrementally.
+ NOT thread safe.
+
+@index: struct lroute by address in network order.
+@heap: struct lroute, the one expires first on top.
+@expired: count of routes expired.
+@tag: set by user, e.g. to tell which rules sections refer to.
+@gens: generation of each stripe of addresses, increased atomically when
+  a route in it is added or moved to another section, so copies of
+  lookups kept by readers are checked without lock, see lroutes_gen(...).
+*/
+struct lroutes{
+  struct htable *index;
+  struct array *heap;
+  unsigned long expired;
+  unsigned long tag;
+  unsigned long gens[LROUTES_GENS];
+};
+
+
+struct lroutes*
+lroutes_new(void);
+
+void
+lroutes_free(struct lroutes **t);
+
+int
+lroutes_put(struct lroutes *t, unsigned ip, unsigned idx, time_t expire);
+
+unsigned
+lroutes_get(const struct lroutes *t, unsigned ip, time_t now);
+
+unsigned
+lroutes_peek(const struct lroutes *t, unsigned ip, time_t *expire);
+
+unsigned long
+lroutes_gen(const struct lroutes *t, unsigned ip);
+
+size_t
+lroutes_expire(struct lroutes *t, time_t now, size_t max);
+
+size_t
+lroutes_remap(struct lroutes *t, const unsigned *map, size_t nmap);
+
+#endif
@@ -1,19 +1,60 @@
 #include "common.h"
 
-extern struct array *route_rules;
+struct options opts = {
+  .workers = 1,
+  .splice = 0,
+  .poolsize = 1024,
+  .hugepage = 0,
+  .batch = 16,
+  .qdepth = 64,
+  .ttlmin = 60,
+  .ttlgrace = 300,
+  .dnscache = 0,
+  .coalesce = 0,
+  .race = 0,
+  .watch = 0,
+  .journal = NULL,
+  .prefetch = 0,
+};
+
+
+// Count of workers running, main thread reloads rules till all quit.
+static unsigned nrunning;
+
+
+/*
+ Worker, owns its own reactor, listening sockets and peers, flows are spread
+ across workers by kernel via SO_REUSEPORT.
+
+@id: index of worker, from 0.
+@tcpbaddr, @udpbaddr: address to listen, shared by all workers.
+@ret: return code of run(...).
+*/
+struct worker{
+  pthread_t tid;
+  unsigned id;
+  const struct sockaddr_in *tcpbaddr, *udpbaddr;
+  int ret;
+};
 
 
 int
-run(const struct sockaddr_in *tcpbaddr, const struct sockaddr_in *udpbaddr)
+run(struct worker *wk)
 {
+  const struct sockaddr_in *tcpbaddr = wk->tcpbaddr, *udpbaddr = wk->udpbaddr;
   if(tcpbaddr == NULL || udpbaddr == NULL){ errno = EINVAL; return -1; }
+
+  struct reactor *rt = reactor_new();
+  if(rt == NULL){ error("could not setup reactor"); return -1; }
   
   // TCP setup.
-  int tcpfd = -1;
-  if((tcpfd = tsocket(SOCK_STREAM, tcpbaddr)) < 0 || listen(tcpfd, 10) < 0){
+  struct tcplistener lsn;
+  lsn.ev.type = EVSRC_LISTENER;
+  if((lsn.fd = tsocket(SOCK_STREAM, tcpbaddr)) < 0 || listen(lsn.fd, 10) < 0 ||
+     reactor_add(rt, lsn.fd, &(lsn.ev)) < 0){
     error("could not setup tcp default socket"); return -1;
   }
-  info("TCP work on %08X:%u", FADDR(tcpbaddr));
+  info("TCP work on %08X:%u, worker %u", FADDR(tcpbaddr), wk->id);
 
   struct array *tcpdbplist = ary_new();
   if(tcpdbplist == NULL){ error("could not init dbpeer list"); return 1; }
@@ -21,61 +62,126 @@ run(const struct sockaddr_in *tcpbaddr, const struct sockaddr_in *udpbaddr)
 
   // UDP setup.
   struct udppeer *udppr = udppeer_new(udpbaddr, NULL);
-  struct array *udppeers[] = {ary_new(), ary_new()};
-  struct array *lpeers = udppeers[0], *rpeers = udppeers[1];
+  struct peerset *udppeers[] = {peerset_new(0), peerset_new(1)};
+  struct peerset *lpeers = udppeers[0], *rpeers = udppeers[1];
   if(udppr == NULL || lpeers == NULL || rpeers == NULL ||
-     ary_append(lpeers, udppr) < 0){
+     udppeer_add(rt, lpeers, udppr) < 0){
     error("could not setup udp default socket");
     return -1;
   }
-  info("UDP work on %08X:%u", FADDR(udpbaddr));
+  info("UDP work on %08X:%u, worker %u", FADDR(udpbaddr), wk->id);
 
 
   // Message loop.
-  fd_set rfds, wfds;
-  int maxfd;
+  struct epoll_event evs[REACTOR_MAXEVENTS];
+  time_t lastsweep = time(NULL), lastreport = lastsweep, lastexpire = lastsweep;
+  // Counter of worker is odd while processing, even while waiting, see
+  // route_synchronize(...).
+  route_enter(wk->id);
   while(1){
-    FD_ZERO(&rfds); FD_ZERO(&wfds);
+    route_leave(wk->id);
+    int n = reactor_wait(rt, evs, REACTOR_MAXEVENTS);
+    route_enter(wk->id);
+    if(n < 0){ error("epoll_wait(...) failed"); break; }
+    debug("epoll_wait(...) got %d events", n);
+
+    // Queue objects got events, listening socket is checked below.
+    for(int i=0; i<n; i++){
+      struct evsrc *src = (struct evsrc*) evs[i].data.ptr;
+      if(src->type == EVSRC_TCPPEER)
+	dbp_mark(rt, ((struct tcppeer*) src)->dbp);
+      else if(src->type == EVSRC_UDPPEER)
+	udppeer_mark(rt, (struct udppeer*) src);
+    }
 
-    // TCP, fill fdset.
-    FD_SET(tcpfd, &rfds);  // Always track READ on default socket.
-    maxfd = tcppeer_fillfdset(tcpdbplist, &rfds, &wfds);
-    if(tcpfd > maxfd) maxfd = tcpfd;
+    // TCP, accept new coming con, then move data.
+    if(lsn.ev.events & EPOLLIN) tcppeer_accept(rt, &lsn, tcpdbplist);
+    tcppeer_process(rt, tcpdbplist);
 
-    // UDP, fill fdset.
-    int tmp = udppeer_fillfdset(udppeers, sizeof(udppeers)/sizeof(struct array*),
-				&rfds, &wfds);
-    if(tmp > maxfd) maxfd = tmp;
+    // UDP, read & write, then deliver pkts.
+    udppeer_process(rt);
+    udppeer_deliver(rt, lpeers, rpeers);
 
-    // Select(...)
-    if(select(maxfd + 1, &rfds, &wfds, NULL, NULL) < 0){
-      error("select(...) failed"); break;
+    // Remove timeout UDP peers.
+    time_t currtime = time(NULL);
+    if(currtime - lastsweep >= UDPPEER_SWEEP){
+      udppeer_sweep(udppeers, sizeof(udppeers)/sizeof(struct peerset*));
+      lastsweep = currtime;
     }
-    debug("select(...) done");
-
-    // TCP, check event.
-    // Always check listening socket for new coming con.
-    if(FD_ISSET(tcpfd, &rfds)){
-      struct tcpdbpeer *dbp = accept_con(tcpfd);
-      if(dbp == NULL){ warn("could not accept incoming con"); }
-      else if(ary_append(tcpdbplist, dbp) < 0){
-	error("could not append dbpeer, con lost");
-	dbp_free(&dbp);
-      }else{ debug("new con(lfd: %d, rfd: %d)", dbp->l->fd, dbp->r->fd); }
+
+    // Remove expired learned routes, a batch per second.
+    if(currtime != lastexpire){
+      route_expire(currtime);
+      lastexpire = currtime;
     }
-    tcppeer_checkevent(tcpdbplist, &rfds, &wfds);
 
-    // UDP, check event.
-    udppeer_checkevent(udppeers, sizeof(udppeers)/sizeof(struct array*),
-		       &rfds, &wfds);
-    udppeer_deliver(lpeers, rpeers);
+    // Report counters.
+    if(currtime - lastreport >= STATS_INTERVAL){
+      udpstats_report(wk->id);
+      route_report(wk->id);
+      lastreport = currtime;
+    }
   }
 
   // TODO: Free resources.
+  route_leave(wk->id);
   return -1;
 }
 
 
+/*
+ Entry of worker thread, pin itself on cpu when more than one worker.
+*/
+void*
+worker_main(void *arg)
+{
+  struct worker *wk = (struct worker*) arg;
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  if(opts.workers > 1 && ncpu > 0){
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(wk->id % ncpu, &cpus);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus))
+      warn("could not pin worker %u on cpu %ld", wk->id, wk->id % ncpu);
+  }
+
+  wk->ret = run(wk);
+  info("worker %u quit with code %d", wk->id, wk->ret);
+  __atomic_sub_fetch(&nrunning, 1, __ATOMIC_SEQ_CST);
+  return NULL;
+}
+
+
+void
+usage(const char *prog)
+{
+  fprintf(stderr,
+	  "Usage: %s [-c cfgfile] [-w workers] [-s] [-p poolsize] [-H] [-b batch] [-q depth]\n"
+	  "          [-t ttlmin] [-g grace] [-a answers] [-m] [-r] [-W] [-l journal] [-f names]\n"
+	  "          [-C image]\n"
+	  "  -c  route config file, or rule image compiled of it, default \"route.conf\".\n"
+	  "  -w  count of worker threads, 0 for one per cpu, default 1.\n"
+	  "  -s  relay TCP data via splice(...) without copying.\n"
+	  "  -p  max objects pooled per kind per worker, 0 to disable, default 1024.\n"
+	  "  -H  back pools with huge pages.\n"
+	  "  -b  max UDP pkts per recvmmsg/sendmmsg, 1 ~ %d, default 16.\n"
+	  "  -q  max UDP pkts queued to send per peer, default 64.\n"
+	  "  -t  min seconds to keep a route learned from DNS, default 60.\n"
+	  "  -g  seconds to keep a learned route after its TTL, default 300.\n"
+	  "  -a  max DNS answers of sections cached per worker, 0 to disable, default 0.\n"
+	  "  -m  merge identical DNS queries in flight into one to upstream.\n"
+	  "  -r  race a DNS query to another server of section when one is slow.\n"
+	  "  -W  reload route config when modified, it's reloaded on SIGHUP anyway.\n"
+	  "  -l  file to keep routes learned from DNS, restored at startup.\n"
+	  "  -f  max names resolved ahead of clients, domains of rules and names popular,\n"
+	  "      0 to disable, default 0.\n"
+	  "  -C  compile route config into rule image, which is mapped when given\n"
+	  "      by -c, then quit.\n",
+	  prog, UDPPEER_BATCH_MAX);
+}
+
+
 int
 main(int argc, char **argv)
 {
@@ -88,14 +194,95 @@ main(int argc, char **argv)
   addr2.sin_addr.s_addr = ntohl(0x02020202);
   addr2.sin_port = ntohs(5300);
 
-  const char *cfgfile = "route.conf";
+  const char *cfgfile = "route.conf", *dbfile = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "c:w:sp:Hb:q:t:g:a:mrWl:f:C:h")) != -1){
+    switch(opt){
+    case 'c': cfgfile = optarg; break;
+    case 'w': opts.workers = strtoul(optarg, NULL, 10); break;
+    case 's': opts.splice = 1; break;
+    case 'p': opts.poolsize = strtoul(optarg, NULL, 10); break;
+    case 'H': opts.hugepage = 1; break;
+    case 'b': opts.batch = strtoul(optarg, NULL, 10); break;
+    case 'q': opts.qdepth = strtoul(optarg, NULL, 10); break;
+    case 't': opts.ttlmin = strtoul(optarg, NULL, 10); break;
+    case 'g': opts.ttlgrace = strtoul(optarg, NULL, 10); break;
+    case 'a': opts.dnscache = strtoul(optarg, NULL, 10); break;
+    case 'm': opts.coalesce = 1; break;
+    case 'r': opts.race = 1; break;
+    case 'W': opts.watch = 1; break;
+    case 'l': opts.journal = optarg; break;
+    case 'f': opts.prefetch = strtoul(optarg, NULL, 10); break;
+    case 'C': dbfile = optarg; break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if(opts.workers == 0){
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    opts.workers = (ncpu > 0) ? ncpu : 1;
+  }
+  if(opts.batch == 0 || opts.batch > UDPPEER_BATCH_MAX || opts.qdepth == 0){
+    usage(argv[0]); return 1;
+  }
+
+  // Compile only.
+  if(dbfile != NULL){
+    struct ruleset *rs = genruleset(cfgfile);
+    int r = (rs != NULL) ? ruledb_compile(rs, dbfile) : -1;
+    ruleset_free(&rs);
+    return r < 0;
+  }
+
   //
   debug("generate route rule from config file ...");
-  route_rules = genrulelist(cfgfile);
-  if(route_rules == NULL) return 1;
+  if(route_init(cfgfile) < 0) return 1;
+
+  // SIGHUP is taken by main thread only, workers inherit the mask.
+  sigset_t sigs;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGHUP);
+  if(pthread_sigmask(SIG_BLOCK, &sigs, NULL)){ error("could not block SIGHUP"); return 1; }
+
+  debug("startup %u workers ...", opts.workers);
+  struct worker *wks = (struct worker*) calloc(sizeof(struct worker), opts.workers);
+  if(wks == NULL){ error("could not create workers"); return 1; }
+  for(unsigned i=0; i<opts.workers; i++){
+    wks[i].id = i;
+    wks[i].tcpbaddr = &addr1;
+    wks[i].udpbaddr = &addr2;
+    __atomic_add_fetch(&nrunning, 1, __ATOMIC_SEQ_CST);
+    if(pthread_create(&(wks[i].tid), NULL, worker_main, &(wks[i]))){
+      error("could not start worker %u", i); return 1;
+    }
+  }
 
-  debug("startup message loop ...");
-  int r = run(&addr1, &addr2);
+  // Reload rules on SIGHUP, or when config file modified if watched, keep
+  // journal of learned routes, and resolve names ahead, till all workers
+  // quit.
+  struct stat st;
+  struct timespec mtime = {0, 0};
+  if(stat(cfgfile, &st) == 0) mtime = st.st_mtim;
+  while(__atomic_load_n(&nrunning, __ATOMIC_SEQ_CST) > 0){
+    struct timespec timeout = {1, 0};
+    int reload = (sigtimedwait(&sigs, NULL, &timeout) == SIGHUP);
+    route_persist(time(NULL));
+    route_prefetch(time(NULL));
+    if(opts.watch && stat(cfgfile, &st) == 0 &&
+       (st.st_mtim.tv_sec != mtime.tv_sec || st.st_mtim.tv_nsec != mtime.tv_nsec)){
+      mtime = st.st_mtim;
+      reload = 1;
+    }
+    if(! reload) continue;
+    info("reload rules from \"%s\"", cfgfile);
+    route_reload(cfgfile);
+  }
+
+  int r = 0;
+  for(unsigned i=0; i<opts.workers; i++){
+    pthread_join(wks[i].tid, NULL);
+    if(wks[i].ret) r = wks[i].ret;
+  }
+  free(wks);
   info("program quit with code %d", r);
   return r;
 }
@@ -0,0 +1,98 @@
+#include "pool.h"
+
+
+void
+pool_init(struct pool *pl, size_t objsize, size_t limit, int hugepage)
+{
+  memset(pl, 0, sizeof(struct pool));
+  pl->objsize = (sizeof(struct poolobj) + objsize + 15) & ~((size_t) 15);
+  pl->limit = limit;
+  pl->hugepage = hugepage;
+}
+
+
+/*
+ Map a new chunk for objects not carved yet, touch all pages in advance.
+
+ @Return: 0 when succ, or -1 when fail.
+*/
+static int
+pool_grow(struct pool *pl)
+{
+  // Objects in a chunk, no more than those left to carve.
+  size_t nobj = POOL_CHUNK_SIZE / pl->objsize;
+  if(nobj == 0) nobj = 1;
+  if(nobj > pl->limit - pl->count) nobj = pl->limit - pl->count;
+
+  size_t align = pl->hugepage ? POOL_CHUNK_SIZE : (size_t) sysconf(_SC_PAGESIZE);
+  size_t size = (pl->objsize * nobj + align - 1) / align * align;
+
+  void *chunk = MAP_FAILED;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+  if(pl->hugepage){
+    chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    if(chunk == MAP_FAILED) debug("no huge page reserved, map chunk on normal page");
+  }
+  if(chunk == MAP_FAILED){
+    chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if(chunk == MAP_FAILED) return -1;
+    if(pl->hugepage) madvise(chunk, size, MADV_HUGEPAGE);
+  }
+
+  // Remaining space of old chunk is dropped, less than an object.
+  pl->curr = (unsigned char*) chunk;
+  pl->end = pl->curr + size;
+  return 0;
+}
+
+
+/*
+ Get an object from pool, content of object is NOT initialized.
+*/
+void*
+pool_get(struct pool *pl)
+{
+  struct poolobj *obj = pl->freelist;
+  if(obj != NULL){
+    pl->freelist = obj->next;
+    return obj + 1;
+  }
+
+  // Carve from chunk.
+  if(pl->count < pl->limit){
+    if((size_t) (pl->end - pl->curr) < pl->objsize && pool_grow(pl) < 0){
+      error("could not map chunk of pool, fall back to malloc(...)");
+      goto frommalloc;
+    }
+    obj = (struct poolobj*) pl->curr;
+    pl->curr += pl->objsize;
+    pl->count ++;
+    obj->pl = pl;
+    return obj + 1;
+  }
+
+ frommalloc:
+  obj = (struct poolobj*) malloc(pl->objsize);
+  if(obj == NULL) return NULL;
+  obj->pl = NULL;
+  return obj + 1;
+}
+
+
+/*
+ Put object back to the pool it was got from.
+*/
+void
+pool_put(void *obj)
+{
+  if(obj == NULL) return;
+
+  struct poolobj *hdr = ((struct poolobj*) obj) - 1;
+  if(hdr->pl == NULL){
+    free(hdr);
+    return;
+  }
+
+  hdr->next = hdr->pl->freelist;
+  hdr->pl->freelist = hdr;
+}
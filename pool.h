@@ -0,0 +1,52 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include "common.h"
+
+
+#define POOL_CHUNK_SIZE   (2 << 20)  // 2MB, size of a huge page.
+
+
+/*
+ Header before each object, keep object aligned on 16 bytes.
+
+@next: next free object, valid when on free list.
+@pl: pool which object was carved from, or NULL when from malloc(...).
+*/
+struct poolobj{
+  struct poolobj *next;
+  struct pool *pl;
+};
+
+
+/*
+ Pool of fixed size objects, carved from pre-faulted chunks mapped on demand.
+ NOT thread safe, each worker owns its own pools.
+
+@objsize: size of object, include header.
+@limit: max count of objects carved from chunks, objects beyond it are from
+  malloc(...) and released to system when freed. 0 disables pooling.
+@count: count of objects carved.
+@hugepage: 1 to map chunks on huge pages.
+@freelist: objects freed, reused first.
+@curr, @end: remaining space of current chunk.
+*/
+struct pool{
+  size_t objsize;
+  size_t limit, count;
+  int hugepage;
+  struct poolobj *freelist;
+  unsigned char *curr, *end;
+};
+
+
+void
+pool_init(struct pool *pl, size_t objsize, size_t limit, int hugepage);
+
+void*
+pool_get(struct pool *pl);
+
+void
+pool_put(void *obj);
+
+#endif
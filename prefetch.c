@@ -0,0 +1,64 @@
+#include "prefetch.h"
+
+
+int
+prefetch_init(struct prefetch *p, size_t capa)
+{
+  if(p == NULL || capa == 0){ errno = EINVAL; return -1; }
+
+  memset(p, 0, sizeof(struct prefetch));
+  p->names = (struct pfname*) calloc(sizeof(struct pfname), capa);
+  if(p->names == NULL) return -1;
+  if((p->index = ht_new()) == NULL){
+    free(p->names);
+    p->names = NULL;
+    return -1;
+  }
+  p->capa = capa;
+  return 0;
+}
+
+
+/*
+ @Return: entry of @name, created due now when not yet and @create set, or
+   NULL when none or table full.
+*/
+struct pfname*
+prefetch_get(struct prefetch *p, const char *name, size_t namelen, int create)
+{
+  struct pfname *pf = (struct pfname*) ht_get(p->index, name, namelen);
+  if(pf != NULL || ! create || p->size == p->capa) return pf;
+
+  pf = &(p->names[p->size]);
+  memset(pf, 0, sizeof(struct pfname));
+  if((pf->name = (char*) malloc(namelen + 1)) == NULL) return NULL;
+  memcpy(pf->name, name, namelen);
+  pf->name[namelen] = 0;
+  pf->namelen = namelen;
+  if(ht_put(p->index, pf->name, namelen, pf) < 0){
+    free(pf->name);
+    pf->name = NULL;
+    return NULL;
+  }
+  p->size ++;
+  return pf;
+}
+
+
+/*
+ Remove @pf, the last entry is moved into its slot, which is to check
+ again when removing while iterating.
+*/
+void
+prefetch_del(struct prefetch *p, struct pfname *pf)
+{
+  ht_del(p->index, pf->name, pf->namelen);
+  free(pf->name);
+
+  struct pfname *last = &(p->names[--(p->size)]);
+  if(pf != last){
+    *pf = *last;
+    ht_put(p->index, pf->name, pf->namelen, pf);
+  }
+  last->name = NULL;
+}
@@ -0,0 +1,74 @@
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include "common.h"
+
+
+#define PREFETCH_HITS     2     // responses of a name within TTL to refresh it.
+#define PREFETCH_MIN      30    // seconds, min interval to resolve a name.
+#define PREFETCH_BATCH    64    // max queries sent per second.
+#define PREFETCH_TIMEOUT  3000  // ms, query not answered is given up.
+#define PREFETCH_RETRY    300   // seconds, name not resolved is tried again after.
+#define PREFETCH_NOTICE   1024  // max names noticed by workers per second.
+
+
+/*
+ Name resolved ahead of clients.
+
+@name: lower-case, no trailing dot, key of table.
+@pinned: 1 when a literal name of rules, always kept resolved, or else
+  refreshed only when popular, i.e. @hits reaches PREFETCH_HITS.
+@hits: count of responses to clients since last resolved.
+@due: when to resolve again, shortly before TTL expires.
+@sent: ms when query sent, 0 when none in flight.
+@id: transaction id of query in flight.
+*/
+struct pfname{
+  char *name;
+  size_t namelen;
+  int pinned;
+  unsigned hits;
+  time_t due;
+  long sent;
+  unsigned short id;
+};
+
+
+/*
+ Name of response to client, noticed by worker.
+*/
+struct pfnotice{
+  char name[255 + 1];  // DNSNAME_MAX, not defined yet when included by dns.h.
+  unsigned ttl;
+};
+
+
+/*
+ Names to resolve ahead. NOT thread safe, owned by main thread.
+
+@tag: set by user, e.g. to tell which rules names pinned of.
+@index: struct pfname by name.
+@names: slots, @size used of @capa, packed from the first, see
+  prefetch_del(...).
+@sent, @answered, @dropped: counters of queries sent, answered, and names
+  dropped when not popular any more.
+*/
+struct prefetch{
+  unsigned long tag;
+  struct htable *index;
+  struct pfname *names;
+  size_t capa, size;
+  unsigned long sent, answered, dropped;
+};
+
+
+int
+prefetch_init(struct prefetch *p, size_t capa);
+
+struct pfname*
+prefetch_get(struct prefetch *p, const char *name, size_t namelen, int create);
+
+void
+prefetch_del(struct prefetch *p, struct pfname *pf);
+
+#endif
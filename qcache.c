@@ -0,0 +1,94 @@
+#include "qcache.h"
+
+
+int
+qcache_init(struct qcache *c, size_t capa)
+{
+  if(c == NULL || capa == 0){ errno = EINVAL; return -1; }
+
+  memset(c, 0, sizeof(struct qcache));
+  c->entries = (struct qentry*) calloc(sizeof(struct qentry), capa);
+  if(c->entries == NULL) return -1;
+  if((c->index = ht_new()) == NULL){
+    free(c->entries);
+    c->entries = NULL;
+    return -1;
+  }
+  c->capa = capa;
+  return 0;
+}
+
+
+/*
+ Drop all entries, counters are kept.
+*/
+void
+qcache_clear(struct qcache *c)
+{
+  if(c == NULL || c->entries == NULL) return;
+
+  for(size_t i=0; i<c->capa; i++){
+    struct qentry *i_ent = &(c->entries[i]);
+    if(i_ent->name == NULL) continue;
+    ht_del(c->index, i_ent->name, i_ent->namelen);
+    free(i_ent->name);
+    i_ent->name = NULL;
+  }
+  c->size = 0;
+  c->hand = 0;
+}
+
+
+/*
+ @Return: 0 when hit, with value set to @val, -1 when miss.
+*/
+int
+qcache_get(struct qcache *c, const char *name, size_t namelen, unsigned *val)
+{
+  struct qentry *ent = (struct qentry*) ht_get(c->index, name, namelen);
+  if(ent == NULL){
+    c->misses ++;
+    return -1;
+  }
+  c->hits ++;
+  ent->ref = 1;
+  *val = ent->val;
+  return 0;
+}
+
+
+/*
+ Cache @val of @name, which is NOT cached yet, take the first slot unused
+ or not hit since last pass of clock hand.
+*/
+int
+qcache_put(struct qcache *c, const char *name, size_t namelen, unsigned val)
+{
+  struct qentry *ent;
+  while(1){
+    ent = &(c->entries[c->hand]);
+    c->hand = (c->hand + 1) % c->capa;
+    if(ent->name == NULL) break;
+    if(ent->ref){ ent->ref = 0; continue; }
+
+    // Evict.
+    ht_del(c->index, ent->name, ent->namelen);
+    free(ent->name);
+    ent->name = NULL;
+    c->size --;
+    break;
+  }
+
+  if((ent->name = (char*) malloc(namelen)) == NULL) return -1;
+  memcpy(ent->name, name, namelen);
+  ent->namelen = namelen;
+  ent->val = val;
+  ent->ref = 0;
+  if(ht_put(c->index, ent->name, namelen, ent) < 0){
+    free(ent->name);
+    ent->name = NULL;
+    return -1;
+  }
+  c->size ++;
+  return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef _QCACHE_H_
+#define _QCACHE_H_
+
+#include "common.h"
+
+
+/*
+ Entry of qname cache.
+
+@name: key, copied, NULL when slot unused.
+@val: value cached.
+@ref: 1 when hit since the clock hand passed.
+*/
+struct qentry{
+  char *name;
+  size_t namelen;
+  unsigned val;
+  int ref;
+};
+
+
+/*
+ Cache of name to value, bounded with CLOCK replacement. NOT thread safe,
+ each worker owns its own.
+
+@tag: set by user, e.g. to tell which data cached.
+@index: struct qentry by name.
+@entries: slots, @capa in all, @size used.
+@hand: next slot to check when putting.
+@hits, @misses: counters of lookup.
+*/
+struct qcache{
+  unsigned long tag;
+  struct htable *index;
+  struct qentry *entries;
+  size_t capa, size, hand;
+  unsigned long hits, misses;
+};
+
+
+int
+qcache_init(struct qcache *c, size_t capa);
+
+void
+qcache_clear(struct qcache *c);
+
+int
+qcache_get(struct qcache *c, const char *name, size_t namelen, unsigned *val);
+
+int
+qcache_put(struct qcache *c, const char *name, size_t namelen, unsigned val);
+
+#endif
@@ -0,0 +1,84 @@
+#include "common.h"
+
+
+struct reactor*
+reactor_new(void)
+{
+  struct reactor *rt = (struct reactor*) calloc(sizeof(struct reactor), 1);
+  if(rt == NULL) return NULL;
+
+  rt->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if(rt->epfd < 0){ error("could not create epoll instance"); goto onfail; }
+
+  if((rt->tcpdirty = ary_new()) == NULL ||
+     (rt->udpdirty = ary_new()) == NULL ||
+     (rt->udpheld = ary_new()) == NULL){
+    error("could not create list of reactor"); goto onfail;
+  }
+  return rt;
+
+ onfail:
+  reactor_free(&rt);
+  return NULL;
+}
+
+
+void
+reactor_free(struct reactor **rt)
+{
+  if(rt == NULL || *rt == NULL) return;
+
+  if((*rt)->epfd >= 0) close((*rt)->epfd);
+  ary_free(&((*rt)->tcpdirty));
+  ary_free(&((*rt)->udpdirty));
+  ary_free(&((*rt)->udpheld));
+  free(*rt);
+  *rt = NULL;
+}
+
+
+/*
+ Register @fd on both READ and WRITE in edge-triggered mode, interest never
+ changes afterward, readiness is cached in @src instead.
+
+ No need to unregister, fd would be removed from epoll when closed.
+*/
+int
+reactor_add(struct reactor *rt, int fd, struct evsrc *src)
+{
+  if(rt == NULL || fd < 0 || src == NULL){ errno = EINVAL; return -1; }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  ev.data.ptr = src;
+  src->events = 0;
+  if(epoll_ctl(rt->epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+    error("could not add fd_%d to epoll", fd); return -1;
+  }
+  return 0;
+}
+
+
+/*
+ Wait for events, do not block when any dirty object or con pending left.
+
+ @Return: count of events got, or -1 when error.
+*/
+int
+reactor_wait(struct reactor *rt, struct epoll_event *evs, size_t evlen)
+{
+  int timeout = (rt->tcpdirty->_size || rt->udpdirty->_size || rt->backlog) ?
+    0 : REACTOR_TIMEOUT;
+  int n = epoll_wait(rt->epfd, evs, evlen, timeout);
+  if(n < 0 && errno == EINTR) return 0;
+  if(n < 0) return -1;
+
+  // Cache readiness, error or hangup would be found by handler via READ/WRITE.
+  for(int i=0; i<n; i++){
+    struct evsrc *src = (struct evsrc*) evs[i].data.ptr;
+    unsigned e = evs[i].events;
+    if(e & (EPOLLERR | EPOLLHUP)) e |= EPOLLIN | EPOLLOUT;
+    src->events |= e & (EPOLLIN | EPOLLOUT);
+  }
+  return n;
+}
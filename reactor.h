@@ -0,0 +1,68 @@
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+/*
+ Included by common.h before any peer header, since struct evsrc is embedded
+ by value, so do NOT include common.h here.
+*/
+#include <sys/epoll.h>
+
+struct array;
+
+
+#define REACTOR_MAXEVENTS  256
+#define REACTOR_TIMEOUT    1000  // milliseconds, max time to block when idle.
+
+
+/*
+  Type of event source.
+*/
+#define EVSRC_LISTENER  1
+#define EVSRC_TCPPEER   2
+#define EVSRC_UDPPEER   3
+
+
+/*
+ Event source, embedded as the FIRST member of any object registered on
+ reactor, so pointer to it can be carried as data of epoll event.
+
+@type: one of EVSRC_*.
+@events: readiness(EPOLLIN, EPOLLOUT) cached from edge-triggered
+  notifications, cleared by handler when EAGAIN got.
+*/
+struct evsrc{
+  unsigned type;
+  unsigned events;
+};
+
+
+/*
+ Edge-triggered epoll reactor.
+
+@epfd: epoll instance, every fd registered once on both READ and WRITE.
+@tcpdirty: list of struct tcpdbpeer with cached readiness to be processed.
+@udpdirty: list of struct udppeer with cached readiness to be processed.
+@udpheld: list of struct udppeer holding a pkt not delivered yet.
+@backlog: 1 when listener stopped accepting at batch limit with con still
+  pending, see tcppeer_accept(...).
+*/
+struct reactor{
+  int epfd;
+  struct array *tcpdirty, *udpdirty, *udpheld;
+  int backlog;
+};
+
+
+struct reactor*
+reactor_new(void);
+
+void
+reactor_free(struct reactor **rt);
+
+int
+reactor_add(struct reactor *rt, int fd, struct evsrc *src);
+
+int
+reactor_wait(struct reactor *rt, struct epoll_event *evs, size_t evlen);
+
+#endif
@@ -0,0 +1,688 @@
+#include "redfa.h"
+
+
+#define BITSET(map, c)   ((map)[(unsigned char) (c) >> 3] |= (1 << ((unsigned char) (c) & 7)))
+#define BITTEST(map, c)  ((map)[(unsigned char) (c) >> 3] & (1 << ((unsigned char) (c) & 7)))
+
+// Flags of closure, which assertions hold.
+#define CLOSURE_ATSTART  1
+#define CLOSURE_ATEND    2
+
+
+// Serial of the last automaton created.
+static unsigned long redfa_serial = 0;
+
+
+struct redfa*
+redfa_new(void)
+{
+  struct redfa *dfa = (struct redfa*) calloc(sizeof(struct redfa), 1);
+  if(dfa == NULL) return NULL;
+
+  dfa->starts = ary_new();
+  if(dfa->starts == NULL){
+    free(dfa);
+    return NULL;
+  }
+  dfa->serial = __sync_add_and_fetch(&redfa_serial, 1);
+  dfa->nbyteclass = 1;
+  return dfa;
+}
+
+
+void
+redfa_free(struct redfa **dfa)
+{
+  if(dfa == NULL || *dfa == NULL) return;
+
+  free((*dfa)->states);
+  free((*dfa)->classes);
+  ary_free(&((*dfa)->starts));
+  free(*dfa);
+  *dfa = NULL;
+}
+
+
+/*
+ Fragment of NFA, @e is always a NOP state with @out unset.
+*/
+struct refrag{
+  unsigned s, e;
+};
+
+
+/*
+ Parser of a regex, turns it into NFA states on @dfa.
+
+@pos: next char to parse.
+*/
+struct reparser{
+  struct redfa *dfa;
+  const char *pos;
+};
+
+
+/*
+ @Return: index of new state, or REDFA_NONE when failed.
+*/
+static unsigned
+nfa_state(struct redfa *dfa, unsigned type, unsigned out, unsigned out1, unsigned arg)
+{
+  if(dfa->nstate >= REDFA_NFA_MAX){ errno = E2BIG; return REDFA_NONE; }
+
+  if(dfa->nstate == dfa->capastate){
+    size_t newcapa = dfa->capastate ? dfa->capastate * 2 : 64;
+    void *states = realloc(dfa->states, newcapa * sizeof(struct nfastate));
+    if(states == NULL) return REDFA_NONE;
+    dfa->states = (struct nfastate*) states;
+    dfa->capastate = newcapa;
+  }
+
+  struct nfastate *st = &(dfa->states[dfa->nstate]);
+  st->type = type;
+  st->out = out;
+  st->out1 = out1;
+  st->arg = arg;
+  return dfa->nstate++;
+}
+
+
+/*
+ Create fragment of a single state @type followed by a NOP.
+*/
+static int
+nfa_single(struct redfa *dfa, unsigned type, unsigned arg, struct refrag *f)
+{
+  if((f->e = nfa_state(dfa, NFA_NOP, REDFA_NONE, REDFA_NONE, 0)) == REDFA_NONE ||
+     (f->s = nfa_state(dfa, type, f->e, REDFA_NONE, arg)) == REDFA_NONE) return -1;
+  return 0;
+}
+
+
+/*
+ Create fragment matches one char in @map, which is case folded here.
+*/
+static int
+nfa_class(struct redfa *dfa, const unsigned char *map, int negate, struct refrag *f)
+{
+  if(dfa->nclass == dfa->capaclass){
+    size_t newcapa = dfa->capaclass ? dfa->capaclass * 2 : 64;
+    void *classes = realloc(dfa->classes, newcapa * 32);
+    if(classes == NULL) return -1;
+    dfa->classes = (unsigned char (*)[32]) classes;
+    dfa->capaclass = newcapa;
+  }
+
+  unsigned char *cls = dfa->classes[dfa->nclass];
+  memset(cls, 0, 32);
+  for(int c=1; c<256; c++){
+    if(! BITTEST(map, c)) continue;
+    BITSET(cls, tolower(c));
+    BITSET(cls, toupper(c));
+  }
+  if(negate){
+    for(int i=0; i<32; i++) cls[i] = ~cls[i];
+  }
+  cls[0] &= ~1; // Never NUL.
+
+  if(nfa_single(dfa, NFA_CHAR, dfa->nclass, f) < 0) return -1;
+  dfa->nclass ++;
+  return 0;
+}
+
+
+static int
+nfa_literal(struct redfa *dfa, char c, struct refrag *f)
+{
+  unsigned char map[32];
+  memset(map, 0, 32);
+  BITSET(map, c);
+  return nfa_class(dfa, map, 0, f);
+}
+
+
+/*
+ Append @g to @f.
+*/
+static void
+nfa_cat(struct redfa *dfa, struct refrag *f, const struct refrag *g)
+{
+  dfa->states[f->e].out = g->s;
+  f->e = g->e;
+}
+
+
+/*
+ Apply "*"(@min 0, @max 0), "+"(@min 1, @max 0) or "?"(@min 0, @max 1)
+ on @f.
+*/
+static int
+nfa_repeat(struct redfa *dfa, struct refrag *f, int min, int max)
+{
+  unsigned e = nfa_state(dfa, NFA_NOP, REDFA_NONE, REDFA_NONE, 0);
+  if(e == REDFA_NONE) return -1;
+  unsigned split = nfa_state(dfa, NFA_SPLIT, f->s, e, 0);
+  if(split == REDFA_NONE) return -1;
+
+  dfa->states[f->e].out = (max == 0) ? split : e;
+  if(min == 0) f->s = split;
+  f->e = e;
+  return 0;
+}
+
+
+static int parse_alt(struct reparser *p, struct refrag *f);
+
+
+/*
+ Parse bracket expression like "[^a-z[:digit:]_]", @pos is after "[".
+*/
+static int
+parse_bracket(struct reparser *p, struct refrag *f)
+{
+  const struct{ const char *name; int (*fn)(int); } named[] = {
+    {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum},
+    {"upper", isupper}, {"lower", islower}, {"space", isspace},
+    {"blank", isblank}, {"punct", ispunct}, {"print", isprint},
+    {"graph", isgraph}, {"cntrl", iscntrl}, {"xdigit", isxdigit},
+  };
+  unsigned char map[32];
+  memset(map, 0, 32);
+  int negate = 0;
+
+  if(*(p->pos) == '^'){ negate = 1; p->pos ++; }
+
+  for(int first=1; ; first=0){
+    unsigned char lo = *(p->pos);
+    if(lo == 0) return -1;
+    if(lo == ']' && ! first){ p->pos ++; break; }
+
+    // Named class like "[:alpha:]".
+    if(lo == '[' && p->pos[1] == ':'){
+      const char *name = p->pos + 2, *end = strstr(name, ":]");
+      if(end == NULL) return -1;
+      size_t i = 0, n = sizeof(named) / sizeof(named[0]);
+      for(; i<n; i++){
+	if(strlen(named[i].name) == (size_t) (end - name) &&
+	   strncmp(named[i].name, name, end - name) == 0) break;
+      }
+      if(i == n) return -1;
+      for(int c=1; c<256; c++) if(named[i].fn(c)) BITSET(map, c);
+      p->pos = end + 2;
+      continue;
+    }
+    // Collating element or equivalence class, not supported.
+    if(lo == '[' && (p->pos[1] == '.' || p->pos[1] == '=')) return -1;
+
+    // Single char or range.
+    p->pos ++;
+    unsigned char hi = lo;
+    if(*(p->pos) == '-' && p->pos[1] != ']' && p->pos[1] != 0){
+      hi = p->pos[1];
+      if(hi == '[' || hi < lo) return -1;
+      p->pos += 2;
+    }
+    for(int c=lo; c<=hi; c++) BITSET(map, c);
+  }
+  return nfa_class(p->dfa, map, negate, f);
+}
+
+
+static int
+parse_atom(struct reparser *p, struct refrag *f)
+{
+  char c = *(p->pos)++;
+  switch(c){
+  case '(':
+    if(parse_alt(p, f) < 0 || *(p->pos) != ')') return -1;
+    p->pos ++;
+    return 0;
+
+  case '[': return parse_bracket(p, f);
+
+  case '.':{
+    unsigned char map[32];
+    memset(map, 0xFF, 32);
+    return nfa_class(p->dfa, map, 0, f);
+  }
+
+  case '^': return nfa_single(p->dfa, NFA_BOL, 0, f);
+  case '$': return nfa_single(p->dfa, NFA_EOL, 0, f);
+
+  case '\\':
+    // Only escaped punctuation, no "\w", "\b", back reference...
+    c = *(p->pos)++;
+    if(c == 0 || isalnum((unsigned char) c)) return -1;
+    return nfa_literal(p->dfa, c, f);
+
+  case 0: case ')': case '|':
+  case '*': case '+': case '?': case '{':
+    return -1;
+
+  default: return nfa_literal(p->dfa, c, f);
+  }
+}
+
+
+/*
+ Parse bound like "{m}", "{m,}" or "{m,n}", @pos is after "{".
+
+ @max: -1 when no upper bound.
+*/
+static int
+parse_bound(struct reparser *p, int *min, int *max)
+{
+  char *end;
+  if(! isdigit((unsigned char) *(p->pos))) return -1;
+  *min = strtol(p->pos, &end, 10);
+  *max = *min;
+  if(*end == ','){
+    if(isdigit((unsigned char) end[1])) *max = strtol(end + 1, &end, 10);
+    else{ *max = -1; end ++; }
+  }
+  if(*end != '}' || *min > REDFA_DUP_MAX || *max > REDFA_DUP_MAX ||
+     (*max >= 0 && *max < *min)) return -1;
+  p->pos = end + 1;
+  return 0;
+}
+
+
+/*
+ Parse an atom with its repetition, bound is expanded to copies of atom
+ by parsing it again.
+*/
+static int
+parse_rep(struct reparser *p, struct refrag *f)
+{
+  const char *atom = p->pos;
+  if(parse_atom(p, f) < 0) return -1;
+
+  for(int repeated=0; ; repeated=1){
+    switch(*(p->pos)){
+    case '*': p->pos ++; if(nfa_repeat(p->dfa, f, 0, 0) < 0) return -1; continue;
+    case '+': p->pos ++; if(nfa_repeat(p->dfa, f, 1, 0) < 0) return -1; continue;
+    case '?': p->pos ++; if(nfa_repeat(p->dfa, f, 0, 1) < 0) return -1; continue;
+    case '{': break;
+    default: return 0;
+    }
+
+    int min, max;
+    p->pos ++;
+    if(repeated || parse_bound(p, &min, &max) < 0) return -1;
+    const char *next = p->pos;
+
+    // Copies after the first one, "x{2,4}" as "xxx?x?", "x{2,}" as "xxx*".
+    struct refrag all = *f;
+    int ncopy = (max < 0) ? (min > 0 ? min : 1) : (max > 0 ? max : 1);
+    for(int i=1; i<ncopy; i++){
+      struct refrag i_f;
+      p->pos = atom;
+      if(parse_atom(p, &i_f) < 0) return -1;
+      if(max >= 0 && i >= min && nfa_repeat(p->dfa, &i_f, 0, 1) < 0) return -1;
+      nfa_cat(p->dfa, &all, &i_f);
+    }
+    p->pos = next;
+
+    if(max < 0){
+      // Last copy repeats.
+      struct refrag last = *f;
+      if(ncopy > 1){
+	p->pos = atom;
+	if(parse_atom(p, &last) < 0) return -1;
+	p->pos = next;
+	if(nfa_repeat(p->dfa, &last, 0, 0) < 0) return -1;
+	nfa_cat(p->dfa, &all, &last);
+      }else if(nfa_repeat(p->dfa, &all, min, 0) < 0) return -1;
+    }else if(min == 0 && nfa_repeat(p->dfa, &all, 0, 1) < 0) return -1;
+
+    // "x{0}" matches empty, the first copy is never entered.
+    if(max == 0){
+      unsigned e = nfa_state(p->dfa, NFA_NOP, REDFA_NONE, REDFA_NONE, 0);
+      if(e == REDFA_NONE) return -1;
+      all.s = all.e = e;
+    }
+    *f = all;
+  }
+}
+
+
+static int
+parse_cat(struct reparser *p, struct refrag *f)
+{
+  unsigned e = nfa_state(p->dfa, NFA_NOP, REDFA_NONE, REDFA_NONE, 0);
+  if(e == REDFA_NONE) return -1;
+  f->s = f->e = e;
+
+  while(*(p->pos) != 0 && *(p->pos) != '|' && *(p->pos) != ')'){
+    struct refrag g;
+    if(parse_rep(p, &g) < 0) return -1;
+    nfa_cat(p->dfa, f, &g);
+  }
+  return 0;
+}
+
+
+static int
+parse_alt(struct reparser *p, struct refrag *f)
+{
+  if(parse_cat(p, f) < 0) return -1;
+
+  while(*(p->pos) == '|'){
+    p->pos ++;
+    struct refrag g;
+    if(parse_cat(p, &g) < 0) return -1;
+
+    unsigned s = nfa_state(p->dfa, NFA_SPLIT, f->s, g.s, 0),
+      e = nfa_state(p->dfa, NFA_NOP, REDFA_NONE, REDFA_NONE, 0);
+    if(s == REDFA_NONE || e == REDFA_NONE) return -1;
+    p->dfa->states[f->e].out = e;
+    p->dfa->states[g.e].out = e;
+    f->s = s;
+    f->e = e;
+  }
+  return 0;
+}
+
+
+/*
+ Split byte classes of @dfa by char classes since @from.
+*/
+static void
+redfa_splitbytes(struct redfa *dfa, size_t from)
+{
+  for(size_t i=from; i<dfa->nclass; i++){
+    int remap[2 * 256];
+    size_t n = 0;
+    for(int j=0; j<2*256; j++) remap[j] = -1;
+
+    for(int c=0; c<256; c++){
+      int key = dfa->bytemap[c] * 2 + (BITTEST(dfa->classes[i], c) ? 1 : 0);
+      if(remap[key] < 0) remap[key] = n++;
+      dfa->bytemap[c] = remap[key];
+    }
+    dfa->nbyteclass = n;
+  }
+}
+
+
+/*
+ Add pattern @expr as @id, which is reported by redfa_match(...) when
+ matches. States of a failed pattern are discarded, @dfa is kept usable.
+
+ @Return: 0 when succ, -1 when @expr is invalid or uses unsupported
+   syntax(e.g. back reference), so should be left to regexec(...).
+*/
+int
+redfa_add(struct redfa *dfa, const char *expr, unsigned id)
+{
+  if(dfa == NULL || expr == NULL || id == REDFA_NONE){ errno = EINVAL; return -1; }
+
+  size_t nstate = dfa->nstate, nclass = dfa->nclass;
+  struct reparser p = {dfa, expr};
+  struct refrag f;
+  unsigned match;
+
+  if(parse_alt(&p, &f) < 0 || *(p.pos) != 0 ||
+     (match = nfa_state(dfa, NFA_MATCH, REDFA_NONE, REDFA_NONE, id)) == REDFA_NONE)
+    goto onfail;
+  dfa->states[f.e].out = match;
+
+  if(ary_append(dfa->starts, (void*) (size_t) f.s) < 0) goto onfail;
+  redfa_splitbytes(dfa, nclass);
+  return 0;
+
+ onfail:
+  dfa->nstate = nstate;
+  dfa->nclass = nclass;
+  if(errno != ENOMEM && errno != E2BIG) errno = EINVAL;
+  return -1;
+}
+
+
+/*
+ State of DFA, a set of NFA states.
+
+@acc: least id of pattern matched when got this state.
+@eacc: least id of pattern matched when text ends at this state.
+@set: sorted NFA states, CHAR, MATCH and EOL only.
+@next: next state by byte class, NULL when not built yet.
+*/
+struct dfastate{
+  unsigned acc, eacc;
+  size_t nset;
+  unsigned *set;
+  struct dfastate *next[];
+};
+
+
+/*
+ Cache of DFA states of a thread.
+
+@serial: serial of automaton cached, 0 when none.
+@index: DFA states by set of NFA states, start state not included.
+@list: all DFA states.
+@mark: generation of NFA states visited by closure.
+@stack, @buf, @tmp: scratch space, each of nstate.
+*/
+struct dfacache{
+  unsigned long serial;
+  struct htable *index;
+  struct array *list;
+  struct dfastate *start;
+
+  unsigned gen, *mark, *stack, *buf, *tmp;
+  size_t capa;
+};
+
+static __thread struct dfacache dfacache;
+
+
+static int
+unsigned_cmp(const void *a, const void *b)
+{
+  unsigned x = *(const unsigned*) a, y = *(const unsigned*) b;
+  return (x > y) - (x < y);
+}
+
+
+static void
+dfa_newgen(struct dfacache *c)
+{
+  if(++(c->gen) != 0) return;
+  memset(c->mark, 0, c->capa * sizeof(unsigned));
+  c->gen = 1;
+}
+
+
+/*
+ Add states reached from @s without consuming char to @out, which holds
+ @nout states already.
+
+ @Return: count of states in @out.
+*/
+static size_t
+dfa_closure(const struct redfa *dfa, struct dfacache *c, unsigned s, int flags,
+	    unsigned *out, size_t nout)
+{
+  if(c->mark[s] == c->gen) return nout;
+
+  size_t top = 0;
+  c->mark[s] = c->gen;
+  c->stack[top++] = s;
+  while(top > 0){
+    unsigned id = c->stack[--top];
+    const struct nfastate *st = &(dfa->states[id]);
+    unsigned next[2];
+    int nnext = 0;
+
+    switch(st->type){
+    case NFA_NOP: next[nnext++] = st->out; break;
+    case NFA_SPLIT: next[nnext++] = st->out1; next[nnext++] = st->out; break;
+    case NFA_BOL: if(flags & CLOSURE_ATSTART) next[nnext++] = st->out; break;
+    case NFA_EOL:
+      if(flags & CLOSURE_ATEND) next[nnext++] = st->out;
+      else out[nout++] = id;
+      break;
+    default: out[nout++] = id; break;
+    }
+
+    for(int i=nnext-1; i>=0; i--){
+      if(c->mark[next[i]] == c->gen) continue;
+      c->mark[next[i]] = c->gen;
+      c->stack[top++] = next[i];
+    }
+  }
+  return nout;
+}
+
+
+/*
+ Get DFA state of the @nset NFA states in @buf of cache, create it when
+ not cached.
+*/
+static struct dfastate*
+dfa_state(const struct redfa *dfa, struct dfacache *c, size_t nset, int flags)
+{
+  qsort(c->buf, nset, sizeof(unsigned), unsigned_cmp);
+  size_t keylen = nset * sizeof(unsigned);
+
+  struct dfastate *st;
+  if(! (flags & CLOSURE_ATSTART) &&
+     (st = (struct dfastate*) ht_get(c->index, c->buf, keylen)) != NULL) return st;
+
+  size_t nextlen = dfa->nbyteclass * sizeof(struct dfastate*);
+  st = (struct dfastate*) calloc(sizeof(struct dfastate) + nextlen + keylen, 1);
+  if(st == NULL) return NULL;
+  st->nset = nset;
+  st->set = (unsigned*) (((unsigned char*) st->next) + nextlen);
+  memcpy(st->set, c->buf, keylen);
+
+  // Patterns matched here, or by following "$" when text ends here.
+  st->acc = st->eacc = REDFA_NONE;
+  size_t ntmp = 0;
+  dfa_newgen(c);
+  for(size_t i=0; i<nset; i++){
+    const struct nfastate *i_st = &(dfa->states[st->set[i]]);
+    if(i_st->type == NFA_MATCH && i_st->arg < st->acc) st->acc = i_st->arg;
+    if(i_st->type == NFA_EOL)
+      ntmp = dfa_closure(dfa, c, i_st->out, flags | CLOSURE_ATEND, c->tmp, ntmp);
+  }
+  st->eacc = st->acc;
+  for(size_t i=0; i<ntmp; i++){
+    const struct nfastate *i_st = &(dfa->states[c->tmp[i]]);
+    if(i_st->type == NFA_MATCH && i_st->arg < st->eacc) st->eacc = i_st->arg;
+  }
+
+  if(ary_append(c->list, st) < 0) goto onfail;
+  if(! (flags & CLOSURE_ATSTART) && ht_put(c->index, st->set, keylen, st) < 0){
+    c->list->_size --;
+    goto onfail;
+  }
+  return st;
+
+ onfail:
+  free(st);
+  return NULL;
+}
+
+
+/*
+ Drop all cached states, then bind cache to @dfa.
+*/
+static int
+dfa_reset(const struct redfa *dfa, struct dfacache *c)
+{
+  if(c->list != NULL){
+    for(size_t i=0; i<c->list->_size; i++) free(c->list->_warehouse[i]);
+    c->list->_size = 0;
+  }else if((c->list = ary_new()) == NULL) return -1;
+
+  ht_free(&(c->index));
+  if((c->index = ht_new()) == NULL) return -1;
+  c->serial = 0;
+  c->start = NULL;
+
+  if(c->capa < dfa->nstate){
+    free(c->mark); free(c->stack); free(c->buf); free(c->tmp);
+    c->mark = (unsigned*) calloc(sizeof(unsigned), dfa->nstate);
+    c->stack = (unsigned*) malloc(sizeof(unsigned) * dfa->nstate);
+    c->buf = (unsigned*) malloc(sizeof(unsigned) * dfa->nstate);
+    c->tmp = (unsigned*) malloc(sizeof(unsigned) * dfa->nstate);
+    c->capa = dfa->nstate;
+    c->gen = 0;
+    if(c->mark == NULL || c->stack == NULL || c->buf == NULL || c->tmp == NULL){
+      free(c->mark); free(c->stack); free(c->buf); free(c->tmp);
+      c->mark = c->stack = c->buf = c->tmp = NULL;
+      c->capa = 0;
+      return -1;
+    }
+  }
+
+  // Start state, where "^" holds.
+  size_t nset = 0;
+  dfa_newgen(c);
+  for(size_t i=0; i<dfa->starts->_size; i++)
+    nset = dfa_closure(dfa, c, (size_t) dfa->starts->_warehouse[i], CLOSURE_ATSTART, c->buf, nset);
+  if((c->start = dfa_state(dfa, c, nset, CLOSURE_ATSTART)) == NULL) return -1;
+
+  c->serial = dfa->serial;
+  return 0;
+}
+
+
+/*
+ Get next state of @from on @ch, patterns restart at every char, since
+ regex matches any part of text.
+*/
+static struct dfastate*
+dfa_step(const struct redfa *dfa, struct dfacache *c, struct dfastate *from, unsigned char ch)
+{
+  size_t nset = 0;
+  dfa_newgen(c);
+  for(size_t i=0; i<from->nset; i++){
+    const struct nfastate *i_st = &(dfa->states[from->set[i]]);
+    if(i_st->type != NFA_CHAR || ! BITTEST(dfa->classes[i_st->arg], ch)) continue;
+    nset = dfa_closure(dfa, c, i_st->out, 0, c->buf, nset);
+  }
+  for(size_t i=0; i<dfa->starts->_size; i++)
+    nset = dfa_closure(dfa, c, (size_t) dfa->starts->_warehouse[i], 0, c->buf, nset);
+
+  struct dfastate *st = dfa_state(dfa, c, nset, 0);
+  if(st != NULL) from->next[dfa->bytemap[ch]] = st;
+  return st;
+}
+
+
+/*
+ Search @text, case-insensitive.
+
+ @Return: least id of patterns matched, or REDFA_NONE when none.
+*/
+unsigned
+redfa_match(const struct redfa *dfa, const char *text)
+{
+  if(dfa == NULL || text == NULL || dfa->starts->_size == 0) return REDFA_NONE;
+
+  // Rebuild cache when of other automaton, or grows too large.
+  struct dfacache *c = &dfacache;
+  if(c->serial != dfa->serial || c->list->_size > REDFA_CACHE_MAX){
+    if(dfa_reset(dfa, c) < 0){
+      error("could not reset DFA cache, text \"%s\" unmatched", text);
+      return REDFA_NONE;
+    }
+  }
+
+  struct dfastate *st = c->start;
+  unsigned best = st->acc;
+  for(const char *p=text; *p != 0 && best != 0; p++){
+    unsigned char ch = tolower((unsigned char) *p);
+    struct dfastate *next = st->next[dfa->bytemap[ch]];
+    if(next == NULL && (next = dfa_step(dfa, c, st, ch)) == NULL){
+      error("could not build DFA state, text \"%s\" unmatched", text);
+      return REDFA_NONE;
+    }
+    st = next;
+    if(st->acc < best) best = st->acc;
+  }
+  return (st->eacc < best) ? st->eacc : best;
+}
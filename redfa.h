@@ -0,0 +1,78 @@
+#ifndef _REDFA_H_
+#define _REDFA_H_
+
+#include "common.h"
+
+
+#define REDFA_NFA_MAX     65536  // max NFA states of all patterns.
+#define REDFA_CACHE_MAX   1024   // max DFA states cached per thread.
+#define REDFA_DUP_MAX     255    // max count in bound like "{m,n}".
+#define REDFA_NONE        ((unsigned) -1)
+
+// Type of NFA state.
+#define NFA_NOP    0
+#define NFA_SPLIT  1
+#define NFA_CHAR   2
+#define NFA_BOL    3
+#define NFA_EOL    4
+#define NFA_MATCH  5
+
+
+/*
+ State of NFA.
+
+@out: next state, [SPLIT takes @out1 too].
+@arg: index of char class [CHAR], id of pattern [MATCH].
+*/
+struct nfastate{
+  unsigned type;
+  unsigned out, out1;
+  unsigned arg;
+};
+
+
+/*
+ Automaton of many case-insensitive POSIX extended regexes, searched in
+ one pass over the text, reports the least id of patterns matched.
+
+ NFA is built by redfa_add(...) before any search, and read-only then.
+ DFA states are built lazily from it by each thread, in a cache of its own
+ flushed when more than REDFA_CACHE_MAX states.
+
+@serial: unique among all automatons, to tell cache of which one.
+@states: NFA states.
+@classes: char classes, bitmap of 256 bits each.
+@starts: start state of each pattern.
+@bytemap: class of bytes, bytes of same class are in or out of every char
+  class together, so share transitions of DFA.
+@nbyteclass: count of byte classes.
+*/
+struct redfa{
+  unsigned long serial;
+
+  struct nfastate *states;
+  size_t nstate, capastate;
+
+  unsigned char (*classes)[32];
+  size_t nclass, capaclass;
+
+  struct array *starts;
+
+  unsigned char bytemap[256];
+  size_t nbyteclass;
+};
+
+
+struct redfa*
+redfa_new(void);
+
+void
+redfa_free(struct redfa **dfa);
+
+int
+redfa_add(struct redfa *dfa, const char *expr, unsigned id);
+
+unsigned
+redfa_match(const struct redfa *dfa, const char *text);
+
+#endif
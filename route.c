@@ -1,13 +1,443 @@
 #include "route.h"
 
-// List of struct hostrule, see hostrule.h
-struct array *route_rules = NULL;
+// Rules of all sections, see hostrule.h, swapped by route_reload(...).
+struct ruleset *route_rules = NULL;
 
+// Rules in use by current worker, taken by route_enter(...), so never
+// changes while processing.
+static __thread struct ruleset *route_cur;
 
+// Counter of each worker, odd when it may refer to rules, increased by
+// route_enter(...) and route_leave(...).
+struct routeepoch{
+  unsigned long n;
+} __attribute__((aligned(64)));
+static struct routeepoch *route_epochs;
+
+// Routes learned from DNS responses, expire by TTL.
+struct lroutes *route_learned = NULL;
+
+// Copy of lookup of learned route, valid while generation of @ip is @gen,
+// see route_learnt(...).
+struct lcopy{
+  unsigned ip, idx;
+  time_t expire;
+  unsigned long gen;
+};
+
+// Learned routes looked up by each worker, in slots by address, so
+// @route_lock is taken only when missed, of rules whose serial is
+// @route_lctag.
+static __thread struct lcopy *route_lcache;
+static __thread unsigned long route_lctag;
+
+// Routing decision by qname, of each worker.
+static __thread struct qcache route_qcache;
+
+// DNS queries routed, waiting for response, of each worker.
+static __thread struct dnsqueries route_queries;
+
+// Answers of DNS queries routed, of each worker, see opts.dnscache.
+static __thread struct dnscache route_dnscache;
+
+// DNS queries sent to upstream, waiting for response, of each worker, see
+// opts.coalesce.
+static __thread struct dnsflights route_flights;
+
+// Upstream DNS servers of sections observed, of each worker.
+static __thread struct upstats route_upstats;
+
+// Names resolved ahead by main thread, see opts.prefetch, and sockets to
+// resolve them, by source address of section.
+static struct prefetch route_prefetched;
+static struct htable *route_pfsocks;
+
+// Names of responses to clients noticed by workers, taken by main thread
+// every second, more than PREFETCH_NOTICE are dropped.
+static struct pfnotice route_notices[PREFETCH_NOTICE];
+static size_t route_nnotice;
+static pthread_mutex_t route_noticelock = PTHREAD_MUTEX_INITIALIZER;
+
+// Journal of routes learned, see opts.journal, records are added under
+// @route_lock, and written by main thread.
+static struct ljournal route_journal;
+
+// Protect @route_learned, which changes when routes learned by any worker,
+// and the swap of rules, whose sections it refers to.
+pthread_rwlock_t route_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+/*
+ @Return: index of the first section of source @src in @rs, or LPM_NONE.
+*/
+static unsigned
+srcsection(const struct ruleset *rs, unsigned src)
+{
+  for(size_t i=0; i<rs->rules->_size; i++){
+    if(((struct hostrule*) rs->rules->_warehouse[i])->src == src) return i;
+  }
+  return LPM_NONE;
+}
+
+
+/*
+ Rewrite journal with routes learned alive at @now.
+*/
+static int
+route_snapshot(time_t now)
+{
+  pthread_rwlock_rdlock(&route_lock);
+  struct ruleset *rs = route_rules;
+  struct array *heap = route_learned->heap;
+  struct ljrecord *recs = (struct ljrecord*) malloc(sizeof(struct ljrecord) * (heap->_size + 1));
+  size_t n = 0;
+  for(size_t i=0; recs != NULL && i<heap->_size; i++){
+    struct lroute *i_lr = (struct lroute*) heap->_warehouse[i];
+    if(i_lr->expire <= now) continue;
+    recs[n].ip = i_lr->ip;
+    recs[n].src = ((struct hostrule*) rs->rules->_warehouse[i_lr->idx])->src;
+    recs[n].expire = i_lr->expire;
+    n ++;
+  }
+  pthread_rwlock_unlock(&route_lock);
+  if(recs == NULL) return -1;
+
+  int r = ljournal_rewrite(&route_journal, recs, n);
+  free(recs);
+  return r;
+}
+
+
+/*
+ Replay journal of learned routes, called before any worker starts, then
+ rewrite it with the routes alive. Routes of sections no longer exist, or
+ covered by config, are dropped.
+*/
+static int
+route_restore(time_t now)
+{
+  if(ljournal_init(&route_journal, opts.journal) < 0){
+    error("could not create journal of learned routes"); return -1;
+  }
+
+  struct ljrecord *recs;
+  size_t n, restored = 0;
+  if(ljournal_load(opts.journal, &recs, &n) < 0){
+    warn("could not read journal \"%s\" of learned routes, start over", opts.journal);
+    n = 0;
+  }
+  struct ruleset *rs = route_rules;
+  for(size_t i=0; i<n; i++){
+    unsigned i_idx = srcsection(rs, recs[i].src);
+    if(recs[i].expire <= now || i_idx == LPM_NONE || ruleset_dst(rs, recs[i].ip) <= i_idx)
+      continue;
+    if(lroutes_put(route_learned, recs[i].ip, i_idx, recs[i].expire) == 0) restored ++;
+  }
+  free(recs);
+  info("%lu learned routes restored of %lu records in journal \"%s\"",
+       restored, n, opts.journal);
+
+  if(route_snapshot(now) < 0){
+    error("could not rewrite journal \"%s\" of learned routes", opts.journal); return -1;
+  }
+  return 0;
+}
+
+
+/*
+ Load rules from @cfgfile, called before any worker starts.
+*/
+int
+route_init(const char *cfgfile)
+{
+  if((route_rules = genruleset(cfgfile)) == NULL) return -1;
+  if((route_learned = lroutes_new()) == NULL ||
+     (route_epochs = (struct routeepoch*) calloc(sizeof(struct routeepoch),
+						 opts.workers)) == NULL){
+    error("could not create table of learned routes");
+    lroutes_free(&route_learned);
+    ruleset_free(&route_rules);
+    return -1;
+  }
+  route_learned->tag = route_rules->serial;
+  if(opts.journal != NULL) route_restore(time(NULL));
+  return 0;
+}
+
+
+/*
+ Append routes learned since last call to journal, or rewrite it when
+ records in it are more than twice of routes alive, called by main thread
+ every ROUTE_JOURNAL_INTERVAL.
+*/
+void
+route_persist(time_t now)
+{
+  static time_t last = 0;
+  if(opts.journal == NULL || now - last < ROUTE_JOURNAL_INTERVAL) return;
+  last = now;
+
+  struct ljrecord *recs;
+  size_t n;
+  pthread_rwlock_wrlock(&route_lock);
+  ljournal_take(&route_journal, &recs, &n);
+  size_t alive = route_learned->heap->_size;
+  pthread_rwlock_unlock(&route_lock);
+
+  struct ljournal *j = &route_journal;
+  int r;
+  if(j->fd < 0 || (j->nrecord + n > LJOURNAL_COMPACT_MIN && j->nrecord + n > alive * 2))
+    r = route_snapshot(now);
+  else r = ljournal_append(j, recs, n);
+  free(recs);
+  if(r < 0) error("could not write journal \"%s\" of learned routes", opts.journal);
+}
+
+
+/*
+ Rules in use by current worker, or the latest ones out of workers.
+*/
+static struct ruleset*
+currules(void)
+{
+  return (route_cur != NULL) ? route_cur : __atomic_load_n(&route_rules, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ Called by worker @id before processing, take the latest rules to use till
+ route_leave(...). Queries tracked on sections of old rules are forgotten.
+*/
+void
+route_enter(unsigned id)
+{
+  if(route_epochs != NULL) __atomic_add_fetch(&(route_epochs[id].n), 1, __ATOMIC_SEQ_CST);
+  struct ruleset *rs = __atomic_load_n(&route_rules, __ATOMIC_SEQ_CST);
+  if(route_cur != NULL && rs != route_cur) dnsqueries_clear(&route_queries);
+  route_cur = rs;
+}
+
+
+/*
+ Called by worker @id before waiting for events, it refers to no rules
+ till route_enter(...).
+*/
+void
+route_leave(unsigned id)
+{
+  if(route_epochs != NULL) __atomic_add_fetch(&(route_epochs[id].n), 1, __ATOMIC_SEQ_CST);
+}
+
+
+/*
+ Wait till every worker left once, or is not processing.
+*/
+static void
+route_synchronize(void)
+{
+  for(unsigned i=0; route_epochs != NULL && i<opts.workers; i++){
+    unsigned long n = __atomic_load_n(&(route_epochs[i].n), __ATOMIC_SEQ_CST);
+    if(n % 2 == 0) continue;
+    while(__atomic_load_n(&(route_epochs[i].n), __ATOMIC_SEQ_CST) == n) usleep(1000);
+  }
+}
+
+
+/*
+ Reload rules from @cfgfile, called by main thread only. Rules are parsed
+ and compiled aside, then swapped in, routes learned of sections still
+ exist, by source as in journal, are kept, DNS servers of which may
+ change. Old rules are freed once no worker refers to them.
+*/
+int
+route_reload(const char *cfgfile)
+{
+  struct ruleset *rs = genruleset(cfgfile), *old = route_rules;
+  if(rs == NULL){ error("could not reload rules, old ones kept"); return -1; }
+
+  // Index of each old section in new rules, the first one of its source,
+  // which is all a learned route affects.
+  size_t nmap = old->rules->_size;
+  unsigned *map = (unsigned*) malloc(sizeof(unsigned) * (nmap + 1));
+  if(map == NULL){
+    error("could not map sections, old rules kept");
+    ruleset_free(&rs);
+    return -1;
+  }
+  for(size_t i=0; i<nmap; i++)
+    map[i] = srcsection(rs, ((struct hostrule*) old->rules->_warehouse[i])->src);
+
+  pthread_rwlock_wrlock(&route_lock);
+  size_t dropped = lroutes_remap(route_learned, map, nmap);
+  route_learned->tag = rs->serial;
+  __atomic_store_n(&route_rules, rs, __ATOMIC_SEQ_CST);
+  pthread_rwlock_unlock(&route_lock);
+  free(map);
+
+  route_synchronize();
+  ruleset_free(&old);
+  info("rules reloaded, %lu sections, %lu learned routes dropped",
+       rs->rules->_size, dropped);
+  return 0;
+}
+
+
+/*
+ Remove learned routes expired at @now, at most ROUTE_EXPIRE_BATCH once,
+ skipped when any worker holds the lock, try again on next call.
+*/
+void
+route_expire(time_t now)
+{
+  if(pthread_rwlock_trywrlock(&route_lock)) return;
+  lroutes_expire(route_learned, now, ROUTE_EXPIRE_BATCH);
+  pthread_rwlock_unlock(&route_lock);
+}
+
+
+/*
+ Print counters of qname and answer cache, queries in flight and upstreams
+ of current worker, and of learned routes by
+ worker 0.
+*/
+void
+route_report(unsigned id)
+{
+  info("worker %u: qname cache %lu hits, %lu misses, %lu cached", id,
+       route_qcache.hits, route_qcache.misses, route_qcache.size);
+  if(opts.dnscache)
+    info("worker %u: answer cache %lu hits, %lu misses, %lu cached", id,
+	 route_dnscache.hits, route_dnscache.misses, route_dnscache.size);
+  if(opts.coalesce)
+    info("worker %u: DNS queries %lu joined in flight, %lu responses fanned out", id,
+	 route_flights.joined, route_flights.fanned);
+  for(size_t i=0; route_upstats.list != NULL && i<route_upstats.list->_size; i++){
+    struct upstat *i_st = (struct upstat*) route_upstats.list->_warehouse[i];
+    info("worker %u: upstream %08X rtt %ldms, %lu sent, %lu answered, %lu failed%s", id,
+	 i_st->ip, i_st->srtt / 8, i_st->sent, i_st->answered, i_st->failed,
+	 i_st->failtime ? ", failing" : "");
+  }
+  if(id != 0) return;
+
+  pthread_rwlock_rdlock(&route_lock);
+  size_t size = route_learned->heap->_size;
+  unsigned long expired = route_learned->expired, dropped = route_journal.dropped;
+  pthread_rwlock_unlock(&route_lock);
+  info("routes %lu learned, %lu expired", size, expired);
+  if(opts.journal != NULL && dropped) warn("routes %lu not journaled, too many pending", dropped);
+}
+
+
+/*
+ Upstreams observed by current worker.
+
+ @Return: NULL when failed to create.
+*/
+static struct upstats*
+route_upstreams(void)
+{
+  struct upstats *s = &route_upstats;
+  if(s->index == NULL && upstats_init(s) < 0){
+    error("could not create table of upstreams");
+    return NULL;
+  }
+  return s;
+}
+
+
+/*
+ Find the first section matches @name, by cache of current worker first,
+ which is dropped as a whole when rules changed. Names are case-insensitive
+ and with no trailing dot here.
+
+ @Return: rule of the section, or NULL when none.
+*/
+static struct hostrule*
+route_match(const char *name)
+{
+  struct ruleset *rs = currules();
+  struct qcache *c = &route_qcache;
+  if(c->entries == NULL && qcache_init(c, ROUTE_QCACHE_SIZE) < 0){
+    error("could not create qname cache");
+    return ruleset_match(rs, name);
+  }
+  if(c->tag != rs->serial){
+    qcache_clear(c);
+    c->tag = rs->serial;
+  }
+
+  // Normalize name.
+  char lname[DNSNAMEBUFLEN];
+  size_t namelen = strlen(name);
+  if(namelen > 0 && name[namelen - 1] == '.') namelen --;
+  if(namelen >= DNSNAMEBUFLEN) return ruleset_match(rs, name);
+  for(size_t i=0; i<namelen; i++) lname[i] = tolower((unsigned char) name[i]);
+  lname[namelen] = 0;
+
+  unsigned idx;
+  if(qcache_get(c, lname, namelen, &idx) < 0){
+    struct hostrule *hr = ruleset_match(rs, lname);
+    idx = (hr != NULL) ? hr->idx : LPM_NONE;
+    if(qcache_put(c, lname, namelen, idx) < 0) debug("could not cache \"%s\"", lname);
+  }
+  return (idx != LPM_NONE) ? (struct hostrule*) rs->rules->_warehouse[idx] : NULL;
+}
+
+
+/*
+ @Return: section learned of @ip(host order) alive at @now, of rules @rs,
+   or LPM_NONE. Lookup is copied in cache of worker till generation of
+   @ip changes, the lock is taken only when missed.
+*/
+static unsigned
+route_learnt(const struct ruleset *rs, unsigned ip, time_t now)
+{
+  struct lcopy *c = route_lcache;
+  if(c == NULL &&
+     (c = route_lcache = (struct lcopy*) calloc(sizeof(struct lcopy), ROUTE_LCACHE_SIZE)) == NULL){
+    error("could not create cache of learned routes");
+    unsigned idx = LPM_NONE;
+    pthread_rwlock_rdlock(&route_lock);
+    if(route_learned->tag == rs->serial) idx = lroutes_get(route_learned, ip, now);
+    pthread_rwlock_unlock(&route_lock);
+    return idx;
+  }
+  if(route_lctag != rs->serial){
+    memset(c, 0, sizeof(struct lcopy) * ROUTE_LCACHE_SIZE);
+    route_lctag = rs->serial;
+  }
+
+  c = &(c[(ip ^ (ip >> 12)) & (ROUTE_LCACHE_SIZE - 1)]);
+  if(c->gen == lroutes_gen(route_learned, ip) && c->ip == ip &&
+     (c->idx == LPM_NONE || c->expire > now)) return c->idx;
+
+  // Missed, copy lookup with generation read under lock, so the copy is
+  // stale once the route changes after.
+  time_t expire = 0;
+  unsigned long gen;
+  unsigned idx = LPM_NONE;
+  pthread_rwlock_rdlock(&route_lock);
+  gen = lroutes_gen(route_learned, ip);
+  if(route_learned->tag == rs->serial) idx = lroutes_peek(route_learned, ip, &expire);
+  pthread_rwlock_unlock(&route_lock);
+  // Expired, not copied since refreshing it changes no generation.
+  if(idx != LPM_NONE && expire <= now) return LPM_NONE;
+
+  c->ip = ip;
+  c->idx = idx;
+  c->expire = expire;
+  c->gen = gen;
+  return idx;
+}
+
+
+/*
+ Route by @dst, then by rule @hr matched by qname when not NULL.
+*/
 int
 route_default(const struct sockaddr_in *src, const struct sockaddr_in *dst,
 	      struct sockaddr_in *nxtsrc, struct sockaddr_in *nxtdst,
-	      const char *qname)
+	      const struct hostrule *hr)
 {
   // Default route.
   nxtsrc->sin_family = AF_INET;
@@ -18,36 +448,26 @@ route_default(const struct sockaddr_in *src, const struct sockaddr_in *dst,
   nxtdst->sin_addr.s_addr = dst->sin_addr.s_addr;
   nxtdst->sin_port = dst->sin_port;
 
-  int ipmatch = 0;
-  for(size_t i=0; i<route_rules->_size; i++){
-    struct hostrule *i_hr = (struct hostrule*) route_rules->_warehouse[i];
-    for(size_t j=0; j<i_hr->ips->_size; j++){
-      unsigned ij_ip = (size_t) (i_hr->ips->_warehouse[j]);
-      if(ij_ip != ntohl(dst->sin_addr.s_addr)) continue;
-      // Match.
-      info("rule on section(src: %08X, dns: %08X) match [IP]", i_hr->src, i_hr->dns);
-      nxtsrc->sin_addr.s_addr = ntohl(i_hr->src);
-      ipmatch = 1; break;
-    }
-
-    if(ipmatch) break;
-  }
-
-  if(qname == NULL) return 0;
-  // Route again when @qname not NULL.
-  for(size_t i=0; i<route_rules->_size; i++){
-    struct hostrule *i_hr = (struct hostrule*) route_rules->_warehouse[i];
-    for(size_t j=0; j<i_hr->regs->_size; j++){
-      regex_t *ij_reg = (regex_t*) (i_hr->regs->_warehouse[j]);
-      if(regexec(ij_reg, qname, 0, NULL, 0)) continue;
-      // Match.
-      info("rule on section(src: %08X, dns: %08X) match [HOST]",
-	   i_hr->src, i_hr->dns);
-      nxtsrc->sin_addr.s_addr = ntohl(i_hr->src);
-      nxtdst->sin_addr.s_addr = ntohl(i_hr->dns);
-      return 0;
-    }
+  // Section learned of @dst, or of the longest prefix covering it. Routes
+  // learned refer to sections of the latest rules, which may be newer.
+  struct ruleset *rs = currules();
+  unsigned ip = ntohl(dst->sin_addr.s_addr), idx = route_learnt(rs, ip, time(NULL));
+  if(idx == LPM_NONE) idx = ruleset_dst(rs, ip);
+  if(idx != LPM_NONE){
+    struct hostrule *i_hr = (struct hostrule*) rs->rules->_warehouse[idx];
+    // Match.
+    info("rule on section(src: %08X, dns: %08X) match [IP]", i_hr->src, i_hr->dns[0]);
+    nxtsrc->sin_addr.s_addr = ntohl(i_hr->src);
   }
+
+  // Route again when qname matched, to the best DNS server of section.
+  if(hr == NULL) return 0;
+  struct upstats *s = route_upstreams();
+  unsigned dns = (s != NULL) ? upstream_pick(s, hr->dns, hr->ndns, mstime()) : hr->dns[0];
+  // Match.
+  info("rule on section(src: %08X, dns: %08X) match [HOST]", hr->src, dns);
+  nxtsrc->sin_addr.s_addr = ntohl(hr->src);
+  nxtdst->sin_addr.s_addr = ntohl(dns);
   return 0;
 }
 
@@ -68,15 +488,78 @@ tcp_route(const struct sockaddr_in *src, const struct sockaddr_in *dst,
 
 
 /*
- Route udp packet.
+ Signature of query @data, whose question ends at @start: RD and CD bits,
+ OPT present and DO bit in bits 0-3, then UDP payload size accepted in
+ bits 16-31, responses to queries of different ones may differ.
+
+ @Return: 0 when read, or -1 when records of query malformed.
+*/
+static int
+querysig(const void *data, size_t datalen, size_t start, unsigned *sig)
+{
+  const struct dnshdr *dns = (const struct dnshdr*) data;
+  struct dnsedns edns;
+  if(readdnsedns(data, datalen, start, &edns) < 0) return -1;
+  *sig = dns->rd | (((dns->z & DNS_Z_CD) != 0) << 1) | (edns.opt << 2) |
+    (edns.dnssec << 3) | ((unsigned) edns.size << 16);
+  return 0;
+}
+
+
+/*
+ Key of query in flight sent by clients to @origdst, question of @data ends
+ at @start. Not of upstream, since a raced query is answered by either one.
+
+ @Return: length of key written in @key, at most DNSFLIGHT_KEYLEN.
+*/
+static size_t
+flightkey(unsigned char *key, const struct sockaddr_in *origdst,
+	  const void *data, size_t start)
+{
+  size_t len = 0, queslen = start - sizeof(struct dnshdr);
+  memcpy(key + len, &(origdst->sin_addr.s_addr), 4); len += 4;
+  memcpy(key + len, &(origdst->sin_port), 2); len += 2;
+  memcpy(key + len, ((const unsigned char*) data) + sizeof(struct dnshdr), queslen);
+  return len + queslen;
+}
+
+
+/*
+ Flights of current worker.
+
+ @Return: NULL when disabled or failed to create.
+*/
+static struct dnsflights*
+route_inflight(void)
+{
+  struct dnsflights *f = &route_flights;
+  if(opts.coalesce == 0) return NULL;
+  if(f->ring == NULL && dnsflights_init(f, DNSFLIGHT_MAX) < 0){
+    error("could not create table of DNS queries in flight");
+    return NULL;
+  }
+  return f;
+}
+
+
+/*
+ Route udp packet, DNS query identical to one in flight to the same
+ dst is joined to it, when opts.coalesce set.
+
+ @altdst: set to another DNS server of section to race the query, when
+   opts.race set and @nxtdst is slow, port is zero when not.
+ @Return: 0 when routed, 1 when joined, pkt should NOT be sent, -1 when
+   failed.
 */
 int
 udp_route(const void *data, size_t datalen,
 	  const struct sockaddr_in *src, const struct sockaddr_in *dst,
-	  struct sockaddr_in *nxtsrc, struct sockaddr_in *nxtdst)
+	  struct sockaddr_in *nxtsrc, struct sockaddr_in *nxtdst,
+	  struct sockaddr_in *altdst)
 {
   if(data == NULL || datalen == 0 || src == NULL || dst == NULL ||
-     nxtsrc == NULL || nxtdst == NULL){ errno = EINVAL; return -1; }
+     nxtsrc == NULL || nxtdst == NULL || altdst == NULL){ errno = EINVAL; return -1; }
+  memset(altdst, 0, ADDRSIZE);
 
   // Go route without QNAME when not a DNS pkt.
   if(ntohs(dst->sin_port) != 53) goto passit;
@@ -98,10 +581,60 @@ udp_route(const void *data, size_t datalen,
   // Read question section.
   size_t start = sizeof(struct dnshdr);
   struct dnsques ques;
-  if(readdnsques(data, datalen, &start, &ques) < 0){
+  char qname[DNSNAMEBUFLEN];
+  if(readdnsques(data, datalen, &start, &ques) < 0 ||
+     dnsname_copy(&(ques.name), qname, DNSNAMEBUFLEN) < 0){
     error("can not read question section"); return -1;
   }
-  return route_default(src, dst, nxtsrc, nxtdst, ques.name);
+  unsigned sig;
+  if(querysig(data, datalen, start, &sig) < 0){
+    error("can not read records of query"); return -1;
+  }
+  struct hostrule *hr = route_match(qname);
+  if(route_default(src, dst, nxtsrc, nxtdst, hr) < 0) return -1;
+  time_t now = time(NULL);
+
+  // Wait for response of the identical query in flight, question of which
+  // is of DNSFLIGHT_KEYLEN at most, since name read is valid, and of the
+  // same flags and EDNS state, see querysig(...).
+  struct dnsflights *f = route_inflight();
+  if(f != NULL){
+    unsigned char key[DNSFLIGHT_KEYLEN];
+    size_t keylen = flightkey(key, dst, data, start);
+    int r = dnsflights_join(f, key, keylen, sig, src, dst, dns->id, now);
+    if(r > 0){
+      debug("query of \"%s\" joined in flight", qname);
+      return 1;
+    }
+    if(r < 0) debug("could not track query of \"%s\" in flight", qname);
+  }
+
+  // Count query sent to DNS server of section, race another one when it
+  // does not answer in time.
+  long sent = mstime();
+  struct upstats *s;
+  if(hr != NULL && (s = route_upstreams()) != NULL){
+    unsigned ip = ntohl(nxtdst->sin_addr.s_addr),
+      alt = opts.race ? upstream_race(s, hr->dns, hr->ndns, ip, sent) : 0;
+    struct upstat *st = upstats_get(s, ip, 1);
+    if(st != NULL) upstream_sent(st, sent);
+    if(alt && (st = upstats_get(s, alt, 1)) != NULL){
+      upstream_sent(st, sent);
+      altdst->sin_family = AF_INET;
+      altdst->sin_addr.s_addr = htonl(alt);
+      altdst->sin_port = nxtdst->sin_port;
+      debug("race query of \"%s\" to %08X", qname, alt);
+    }
+  }
+
+  // Track query, so its response is learned on the same section.
+  if(route_queries.ring == NULL && dnsqueries_init(&route_queries, DNSQUERY_MAX) < 0)
+    error("could not create table of DNS queries");
+  if(route_queries.ring != NULL &&
+     dnsqueries_add(&route_queries, src, dns->id, qname,
+		    (hr != NULL) ? hr->idx : LPM_NONE, sig, now, sent) < 0)
+    debug("could not track query of \"%s\"", qname);
+  return 0;
 
  passit:
   return route_default(src, dst, nxtsrc, nxtdst, NULL);
@@ -109,7 +642,199 @@ udp_route(const void *data, size_t datalen,
 
 
 /*
- Called when pkt deliver from r to l(response pkt).
+ Add @ip learned of @name to rule @hr, which expires after @ttl, at least
+ opts.ttlmin, plus opts.ttlgrace for connections made before that.
+*/
+static int
+addroute(struct hostrule *hr, const char *name, unsigned ip, unsigned ttl)
+{
+  // No need when covered by config of this or a prior section, which
+  // never expires.
+  struct ruleset *rs = currules();
+  if(ruleset_dst(rs, ip) <= hr->idx) return 0;
+
+  if(ttl < opts.ttlmin) ttl = opts.ttlmin;
+  time_t expire = time(NULL) + ttl + opts.ttlgrace;
+
+  // Skipped when rules swapped, learned again on next response.
+  pthread_rwlock_wrlock(&route_lock);
+  int r = 1;
+  if(route_learned->tag == rs->serial){
+    r = lroutes_put(route_learned, ip, hr->idx, expire);
+    if(r >= 0 && opts.journal != NULL && ljournal_add(&route_journal, ip, hr->src, expire) < 0)
+      debug("could not journal route %08X", ip);
+  }
+  pthread_rwlock_unlock(&route_lock);
+  if(r < 0){
+    error("could not update route for \"%s\" ~ %08X", name, ip);
+    return -1;
+  }
+  if(r == 0) info("new route \"%s\" ~ %08X added, ttl %u", name, ip, ttl);
+  return 0;
+}
+
+
+/*
+ @Return: 1 when @name is one of @chain, case-insensitive.
+*/
+static int
+inchain(const struct dnsname *chain, size_t nchain, const struct dnsname *name)
+{
+  for(size_t i=0; i<nchain; i++){
+    if(dnsname_eq(&(chain[i]), name)) return 1;
+  }
+  return 0;
+}
+
+
+/*
+ Learn routes to section of @hr, from A records of qname and names of its
+ CNAME chain in response @data, whose question @ques ends at @start.
+
+ @Return: min TTL of records(OPT excluded), at most DNSCACHE_TTLMAX, or -1
+   when pkt malformed.
+*/
+static long
+learnroutes(const void *data, size_t datalen, size_t start,
+	    const struct dnsques *ques, const char *qname, struct hostrule *hr)
+{
+  const struct dnshdr *dns = (const struct dnshdr*) data;
+  size_t nrr = ntohs(dns->an_count) + ntohs(dns->ns_count) + ntohs(dns->ar_count);
+
+  // Follow CNAME chain from qname, records may be in any order, in
+  // Answer, Authority records, and Additional records section. Names
+  // are compared in pkt, not copied.
+  struct dnsname chain[DNSCHAIN_MAX];
+  chain[0] = ques->name;
+  size_t nchain = 1, rrstart = start;
+  struct dnsrr rr;
+  for(int grown=1; grown && nchain<DNSCHAIN_MAX; ){
+    grown = 0;
+    start = rrstart;
+    for(size_t i=0; i<nrr && nchain<DNSCHAIN_MAX; i++){
+      if(readdnsrr(data, datalen, &start, &rr) < 0){
+	error("read dns record %ld failed", i); return -1;
+      }
+      // CNAME of IN class.
+      if(rr.class != 1 || rr.type != 5 || ! inchain(chain, nchain, &(rr.name))) continue;
+
+      size_t tmpstart = ((unsigned char*) rr.rdat) - ((unsigned char*) data);
+      if(readdnsname(data, datalen, &tmpstart, &(chain[nchain])) < 0){
+	warn("could not read CNAME %ld of \"%s\"", i, qname);
+	continue;
+      }
+      if(inchain(chain, nchain, &(chain[nchain]))) continue;
+      debug("CNAME %ld of \"%s\" followed", i, qname);
+      nchain ++;
+      grown = 1;
+    }
+  }
+
+  // Learn A records of names in chain.
+  long minttl = DNSCACHE_TTLMAX;
+  start = rrstart;
+  for(size_t i=0; i<nrr; i++){
+    if(readdnsrr(data, datalen, &start, &rr) < 0){
+      error("read dns record %ld failed", i); return -1;
+    }
+    debug("Record %ld: type(%u), class(%u), ttl(%u), rdatlen(%u)",
+	  i, rr.type, rr.class, rr.ttl, rr.rdatlen);
+    if(rr.type != DNS_TYPE_OPT && rr.ttl < minttl) minttl = rr.ttl;
+
+    // A record of IN class.
+    if(rr.class != 1 || rr.type != 1) continue;
+    if(rr.rdatlen != 4){  // IPv4.
+      warn("unexpected rdatalen in A record %ld of \"%s\", rdatlen: %u",
+	   i, qname, rr.rdatlen);
+      continue;
+    }
+    unsigned i_ip = ntohl(*((unsigned*) rr.rdat));
+    if(! inchain(chain, nchain, &(rr.name))){
+      char name[DNSNAMEBUFLEN];
+      if(dnsname_copy(&(rr.name), name, DNSNAMEBUFLEN) < 0) name[0] = 0;
+      warn("A record \"%s\" ~ %08X info lost", name, i_ip);
+      continue;
+    }
+    if(addroute(hr, qname, i_ip, rr.ttl) < 0) warn("update route failed");
+  }
+  return minttl;
+}
+
+
+/*
+ Notice main thread of response of @qname to client, valid for @ttl, to
+ resolve it ahead when popular. Dropped when main thread is taking them,
+ workers never wait.
+*/
+static void
+route_notice(const char *qname, long ttl)
+{
+  size_t namelen = strlen(qname);
+  if(namelen > 0 && qname[namelen - 1] == '.') namelen --;
+  if(opts.prefetch == 0 || ttl <= 0 || namelen == 0 || namelen >= sizeof(route_notices[0].name))
+    return;
+  if(pthread_mutex_trylock(&route_noticelock)) return;
+
+  if(route_nnotice < PREFETCH_NOTICE){
+    struct pfnotice *n = &(route_notices[route_nnotice++]);
+    for(size_t i=0; i<namelen; i++) n->name[i] = tolower((unsigned char) qname[i]);
+    n->name[namelen] = 0;
+    n->ttl = ttl;
+  }
+  pthread_mutex_unlock(&route_noticelock);
+}
+
+
+/*
+ Answer cache of current worker, dropped as a whole when rules changed.
+
+ @Return: NULL when disabled or failed to create.
+*/
+static struct dnscache*
+route_answers(void)
+{
+  struct dnscache *c = &route_dnscache;
+  if(opts.dnscache == 0) return NULL;
+  if(c->entries == NULL && dnscache_init(c, opts.dnscache) < 0){
+    error("could not create DNS answer cache");
+    return NULL;
+  }
+  struct ruleset *rs = currules();
+  if(c->tag != rs->serial){
+    dnscache_clear(c);
+    c->tag = rs->serial;
+  }
+  return c;
+}
+
+
+/*
+ Key of answer to question @ques of @qname, on section @idx, to query of
+ signature @sig, see querysig(...), whose UDP payload size is bucketed by
+ DNS_UDP_MAX, answers longer than that of requester are refused anyway.
+
+ @Return: length of key written in @key, ANSWERKEY_LEN plus length of qname.
+*/
+static size_t
+answerkey(unsigned char *key, unsigned idx, const struct dnsques *ques, unsigned sig,
+	  const char *qname)
+{
+  size_t len = 0, size = sig >> 16;
+  if(size > 4096) size = 4096;
+  memcpy(key + len, &idx, sizeof(idx)); len += sizeof(idx);
+  memcpy(key + len, &(ques->type), sizeof(ques->type)); len += sizeof(ques->type);
+  memcpy(key + len, &(ques->class), sizeof(ques->class)); len += sizeof(ques->class);
+  key[len++] = sig & 0x0F;
+  key[len++] = (size + DNS_UDP_MAX - 1) / DNS_UDP_MAX;
+  for(; *qname != 0; qname++) key[len++] = tolower((unsigned char) *qname);
+  return len;
+}
+
+
+/*
+ Called when pkt deliver from r to l(response pkt), learn routes from A
+ records of qname and names of its CNAME chain, to section matched by the
+ query, then cache the answer when enabled.
 */
 void
 udp_route2(const void *data, size_t datalen,
@@ -122,105 +847,398 @@ udp_route2(const void *data, size_t datalen,
   if(ntohs(src->sin_port) != 53) return;
 
   struct dnshdr *dns = (struct dnshdr*) data;
-  unsigned short qdlen = ntohs(dns->qd_count),
-    anlen = ntohs(dns->an_count),
-    nslen = ntohs(dns->ns_count),
-    arlen = ntohs(dns->ar_count);
+  unsigned short qdlen = ntohs(dns->qd_count), anlen = ntohs(dns->an_count);
   debug("got DNS RES(src: %08X, qd: %u, an: %u, ns: %u, ar: %u)",
-	ntohl(src->sin_addr.s_addr), qdlen, anlen, nslen, arlen);
+	ntohl(src->sin_addr.s_addr), qdlen, anlen,
+	ntohs(dns->ns_count), ntohs(dns->ar_count));
 
-  // Question section.
-  char qname[DNSNAMEBUFLEN], cname[DNSNAMEBUFLEN];
-  qname[0] = 0; cname[0] = 0;
+  // Question section, single question only, see udp_route(...).
+  if(qdlen != 1) return;
   size_t start = sizeof(struct dnshdr);
   struct dnsques ques;
-  for(size_t i=0; i<qdlen; i++){
-    if(readdnsques(data, datalen, &start, &ques) < 0){
-      error("read dns question %ld failed", i); return;
-    }
-    info("Question %ld: \"%s\", type(%u), class(%u)",
-	 i, ques.name, ques.type, ques.class);
-    // TODO: fix me, support multi-qname.
-    strncpy(qname, ques.name, DNSNAMEBUFLEN - 1);
+  char qname[DNSNAMEBUFLEN];
+  if(readdnsques(data, datalen, &start, &ques) < 0 ||
+     dnsname_copy(&(ques.name), qname, DNSNAMEBUFLEN) < 0){
+    error("read dns question failed"); return;
   }
-  
-  // Answer, Authority records, and Additional records section.
+  debug("Question: \"%s\", type(%u), class(%u)", qname, ques.type, ques.class);
+
+  // Section matched by the query, or match again when query not tracked.
+  struct hostrule *hr;
+  unsigned idx, sig;
+  long sent = -1;
+  time_t now = time(NULL);
+  int tracked = (dnsqueries_take(&route_queries, dst, dns->id, qname, now,
+				 &idx, &sig, &sent) == 0);
+  if(tracked)
+    hr = (idx != LPM_NONE) ? (struct hostrule*) currules()->rules->_warehouse[idx] : NULL;
+  else hr = route_match(qname);
+
+  // Upstream answered, measure its RTT when query tracked, i.e. not the
+  // later one of DNS servers raced.
+  struct upstat *st;
+  if(route_upstats.index != NULL &&
+     (st = upstats_get(&route_upstats, ntohl(src->sin_addr.s_addr), 0)) != NULL)
+    upstream_answered(st, (sent >= 0) ? mstime() - sent : -1);
+  if(hr == NULL) return;
+
+  long ttl = learnroutes(data, datalen, start, &ques, qname, hr);
+  if(dns->rcode == 0 && anlen > 0) route_notice(qname, ttl);
+
+  // Cache answer found, which fits buffer of query to be answered in, when
+  // query tracked, since answer depends on its flags and EDNS state.
+  struct dnscache *c;
+  if(! tracked || ttl <= 0 || dns->rcode != 0 || dns->tc || anlen == 0 ||
+     datalen > UDPPEER_BUF_MTU || (c = route_answers()) == NULL) return;
+  unsigned char key[ANSWERKEY_LEN + DNSNAMEBUFLEN];
+  size_t keylen = answerkey(key, hr->idx, &ques, sig, qname);
+  if(dnscache_put(c, key, keylen, data, datalen, now, ttl) < 0)
+    debug("could not cache answer of \"%s\"", qname);
+}
+
+
+/*
+ Answer DNS query in @data from cache, when it's of a section and answered
+ before within TTL to query of the same signature, see querysig(...), and
+ fits payload size of requester. Response is written in place, with id and
+ question of the query, TTLs aged, and routes are learned from it as from
+ upstream. @data is intact when not answered.
+
+ @size: size of buffer of @data.
+ @Return: length of response in @data, or 0 when not answered.
+*/
+size_t
+udp_answer(void *data, size_t datalen, size_t size,
+	   const struct sockaddr_in *src, const struct sockaddr_in *dst)
+{
+  if(opts.dnscache == 0 || data == NULL || datalen < sizeof(struct dnshdr) ||
+     src == NULL || dst == NULL || ntohs(dst->sin_port) != 53) return 0;
+
+  struct dnshdr *dns = (struct dnshdr*) data;
+  if(dns->opcode != 0 || dns->qr != 0 || ntohs(dns->qd_count) != 1) return 0;
+
+  size_t start = sizeof(struct dnshdr);
+  struct dnsques ques;
+  char qname[DNSNAMEBUFLEN];
+  unsigned sig;
+  if(readdnsques(data, datalen, &start, &ques) < 0 ||
+     dnsname_copy(&(ques.name), qname, DNSNAMEBUFLEN) < 0 ||
+     querysig(data, datalen, start, &sig) < 0) return 0;
+  struct hostrule *hr = route_match(qname);
+  struct dnscache *c;
+  if(hr == NULL || (c = route_answers()) == NULL) return 0;
+
+  unsigned char key[ANSWERKEY_LEN + DNSNAMEBUFLEN];
+  size_t keylen = answerkey(key, hr->idx, &ques, sig, qname);
+  time_t now = time(NULL);
+  const struct dnsanswer *ans = dnscache_get(c, key, keylen, now);
+  if(ans == NULL || ans->pktlen > size || ans->pktlen > (sig >> 16)) return 0;
+
+  // Same qname in same length, question of cached pkt ends at @start too,
+  // as name in question is never compressed. Records are read before
+  // written, so they are read the same in @data.
+  size_t ansstart = sizeof(struct dnshdr);
+  struct dnsques ansques;
+  if(readdnsques(ans->pkt, ans->pktlen, &ansstart, &ansques) < 0 || ansstart != start)
+    return 0;
+  const struct dnshdr *anshdr = (const struct dnshdr*) ans->pkt;
+  size_t nrr = ntohs(anshdr->an_count) + ntohs(anshdr->ns_count) + ntohs(anshdr->ar_count);
   struct dnsrr rr;
-  const char *descs[] = {"Answer", "Authority records", "Additional records"};
-  size_t lens[] = {anlen, nslen, arlen};
-  for(size_t i=0; i<sizeof(descs)/sizeof(const char*); i++){
-    for(size_t j=0; j<lens[i]; j++){
-      // Read a dns resource record.
-      if(readdnsrr(data, datalen, &start, &rr) < 0){
-	error("read %s section %ld failed", descs[i], j); return;
-      }
-      info("%s %ld: \"%s\", type(%u), class(%u), ttl(%u), rdatlen(%u)",
-	   descs[i], j, rr.name, rr.type, rr.class, rr.ttl, rr.rdatlen);
-
-      // Just IN class.
-      if(rr.class != 1) continue;
-
-      // A type.
-      if(rr.type == 1){
-	if(rr.rdatlen != 4){  // IPv4.
-	  warn("unexpected rdatalen in A record(name: \"%s\", rdatlen: %u)",
-	       rr.name, rr.rdatlen);
-	  continue;
-	}
-	unsigned ij_ip = ntohl(*((unsigned*) rr.rdat));
-
-	// TODO: fixe me, support multi-qname.
-	if(strncmp(rr.name, qname, DNSNAMEBUFLEN) == 0 ||
-	   strncmp(rr.name, cname, DNSNAMEBUFLEN) == 0){
-	  if(updateroute(qname, ij_ip) < 0){ warn("update route failed"); }
-	}else warn("A record \"%s\" ~ %08X info lost", rr.name, ij_ip);
-	continue;
-      }// else: not A type.
-
-      // CNAME type.
-      if(rr.type == 5){
-	// TODO: fixe me, support multi-qname.
-	size_t tmpstart = ((unsigned char*) rr.rdat) - ((unsigned char*) data);
-	if(readdnsname(data, datalen, &tmpstart, cname, DNSNAMEBUFLEN - 1) < 0){
-	  warn("could not read CNAME");
-	  cname[0] = 0;
-	}
-	continue;
-      }// else: not CNAME type.
+  for(size_t i=0, rrstart=start; i<nrr; i++){
+    if(readdnsrr(ans->pkt, ans->pktlen, &rrstart, &rr) < 0) return 0;
+  }
 
-    } // end of single section.
-  } // end of all sections.
+  unsigned short id = dns->id;
+  memcpy(data, ans->pkt, sizeof(struct dnshdr));
+  dns->id = id;
+  memcpy(((unsigned char*) data) + start, ((unsigned char*) ans->pkt) + start,
+	 ans->pktlen - start);
+  datalen = ans->pktlen;
+
+  // Age TTLs of records, all outlive the answer.
+  unsigned age = now - ans->time;
+  for(size_t i=0, rrstart=start; i<nrr; i++){
+    if(readdnsrr(data, datalen, &rrstart, &rr) < 0) break;
+    if(rr.type == DNS_TYPE_OPT) continue;
+    unsigned ttl = htonl(rr.ttl - age);
+    memcpy(((unsigned char*) rr.rdat) - 6, &ttl, sizeof(ttl));
+  }
+
+  // Routes learned expire later than the answer, refresh them anyway.
+  route_notice(qname, learnroutes(data, datalen, start, &ques, qname, hr));
+  debug("answer \"%s\" from cache, age %u", qname, age);
+  return datalen;
 }
 
 
 /*
- Find regex who match @name, then add @ip.
+ Take clients waiting for response @data to leader @client, who sent the
+ query to @origdst, see udp_route(...). Only the first response of a raced
+ query finds them.
+
+ @waiters: at least DNSFLIGHT_WAITERS, to copy clients waiting into.
+ @Return: count of clients waiting, each gets a copy of response with id
+   of its own.
 */
-int
-updateroute(const char *name, unsigned ip)
-{
-  for(size_t i=0; i<route_rules->_size; i++){
-    struct hostrule *i_hr = (struct hostrule*) route_rules->_warehouse[i];
-    for(size_t j=0; j<i_hr->regs->_size; j++){
-      regex_t *j_reg = (regex_t*) (i_hr->regs->_warehouse[j]);
-      if(regexec(j_reg, name, 0, NULL, 0)) continue;
-
-      // Regex match, check if same ip exists before adding.
-      for(size_t k=0; k<i_hr->ips->_size; k++){
-	unsigned ijk_ip = (size_t) (i_hr->ips->_warehouse[k]);
-	if(ijk_ip == ip) return 0; // Same ip found.
-      }
+size_t
+udp_waiters(const void *data, size_t datalen,
+	    const struct sockaddr_in *origdst, const struct sockaddr_in *client,
+	    struct dnswaiter *waiters)
+{
+  struct dnsflights *f = route_inflight();
+  if(f == NULL || data == NULL || datalen < sizeof(struct dnshdr) ||
+     origdst == NULL || client == NULL || waiters == NULL) return 0;
+
+  const struct dnshdr *dns = (const struct dnshdr*) data;
+  if(dns->qr != 1 || ntohs(dns->qd_count) != 1) return 0;
+  size_t start = sizeof(struct dnshdr);
+  struct dnsques ques;
+  if(readdnsques(data, datalen, &start, &ques) < 0) return 0;
+
+  unsigned char key[DNSFLIGHT_KEYLEN];
+  size_t keylen = flightkey(key, origdst, data, start);
+  return dnsflights_take(f, key, keylen, client, dns->id, waiters);
+}
 
-      // No same ip found, add it.
-      if(ary_append(i_hr->ips, (void*) (size_t) ip) < 0){
-	error("could not update route for \"%s\" ~ %08X", name, ip);
-	return -1;
+
+/*
+ @Return: seconds to resolve a name again, shortly before @ttl expires.
+*/
+static long
+prefetch_delay(long ttl)
+{
+  long delay = ttl - ttl / 10;
+  return (delay < PREFETCH_MIN) ? PREFETCH_MIN : delay;
+}
+
+
+/*
+ Pin literal domains of rules @rs to resolve, half of table at most, those
+ of rules before are unpinned, and dropped when not popular.
+*/
+static void
+pinnames(struct prefetch *p, const struct ruleset *rs)
+{
+  for(size_t i=0; i<p->size; i++) p->names[i].pinned = 0;
+
+  size_t npin = 0, maxpin = p->capa / 2;
+  struct pfname *pf;
+  if(rs->db != NULL){
+    size_t len;
+    const char *name;
+    for(size_t i=0; npin<maxpin && i<rs->db->head->domcapa; i++){
+      if((name = ruledb_domainat(rs->db, i, &len)) == NULL) continue;
+      if((pf = prefetch_get(p, name, len, 1)) == NULL) break;
+      pf->pinned = 1;
+      npin ++;
+    }
+  }
+  for(size_t i=0; npin<maxpin && i<rs->rules->_size; i++){
+    struct htable *i_doms = ((struct hostrule*) rs->rules->_warehouse[i])->domains;
+    for(size_t j=0; npin<maxpin && j<i_doms->_capa; j++){
+      for(struct hnode *j_node=i_doms->_buckets[j]; npin<maxpin && j_node; j_node=j_node->next){
+	if((pf = prefetch_get(p, (const char*) j_node->key, j_node->keylen, 1)) == NULL) break;
+	pf->pinned = 1;
+	npin ++;
       }
-      info("new route \"%s\" ~ %08X added", name, ip);
-      return 0;
     }
   }
+  info("%lu literal names of rules pinned to resolve ahead", npin);
+}
+
+
+/*
+ Take names noticed by workers, each is a hit, and due shortly before TTL
+ of the response expires.
+*/
+static void
+takenotices(struct prefetch *p, time_t now)
+{
+  pthread_mutex_lock(&route_noticelock);
+  for(size_t i=0; i<route_nnotice; i++){
+    struct pfnotice *i_n = &(route_notices[i]);
+    struct pfname *pf = prefetch_get(p, i_n->name, strlen(i_n->name), 1);
+    if(pf == NULL) continue;
+    pf->hits ++;
+    if(pf->sent == 0) pf->due = now + prefetch_delay(i_n->ttl);
+  }
+  route_nnotice = 0;
+  pthread_mutex_unlock(&route_noticelock);
+}
+
 
-  // No regex match.
+/*
+ @Return: socket bound on source address @src of section, to send queries
+   of names resolved ahead, or -1 when failed.
+*/
+static int
+prefetch_socket(unsigned src)
+{
+  size_t fd = (size_t) ht_get(route_pfsocks, &src, sizeof(src));
+  if(fd != 0) return fd - 1;
+
+  struct sockaddr_in baddr;
+  memset(&baddr, 0, ADDRSIZE);
+  baddr.sin_family = AF_INET;
+  baddr.sin_addr.s_addr = htonl(src);
+  int sock = tsocket(SOCK_DGRAM, &baddr);
+  if(sock < 0) return -1;
+  if(ht_put(route_pfsocks, &src, sizeof(src), (void*) ((size_t) sock + 1)) < 0){
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+
+/*
+ Send query of A record of @pf to the best DNS server of section @hr, from
+ source of the section, as queries of clients are routed.
+*/
+static int
+sendprefetch(struct prefetch *p, struct pfname *pf, const struct hostrule *hr, long nowms)
+{
+  struct upstats *s = route_upstreams();
+  if(s == NULL) return -1;
+  int fd = prefetch_socket(hr->src);
+  if(fd < 0){ error("could not create socket on %08X to resolve ahead", hr->src); return -1; }
+
+  unsigned char pkt[sizeof(struct dnshdr) + DNSNAME_MAX + 2*2];
+  unsigned short id = random();
+  ssize_t len = writednsquery(pkt, sizeof(pkt), id, pf->name, 1);
+  if(len < 0) return -1;
+
+  struct sockaddr_in dst;
+  memset(&dst, 0, ADDRSIZE);
+  dst.sin_family = AF_INET;
+  dst.sin_addr.s_addr = htonl(upstream_pick(s, hr->dns, hr->ndns, nowms));
+  dst.sin_port = htons(53);
+  if(sendto(fd, pkt, len, 0, (struct sockaddr*) &dst, ADDRSIZE) < 0) return -1;
+
+  struct upstat *st = upstats_get(s, ntohl(dst.sin_addr.s_addr), 1);
+  if(st != NULL) upstream_sent(st, nowms);
+  pf->id = id;
+  pf->sent = nowms;
+  p->sent ++;
   return 0;
 }
+
+
+/*
+ Learn routes from response @data to query of a name resolved ahead, from
+ @upstream, it's due again shortly before TTL expires.
+*/
+static void
+recvprefetch(struct prefetch *p, const void *data, size_t datalen,
+	     const struct sockaddr_in *upstream, time_t now)
+{
+  const struct dnshdr *dns = (const struct dnshdr*) data;
+  if(datalen < sizeof(struct dnshdr) || ntohs(upstream->sin_port) != 53 ||
+     dns->qr != 1 || ntohs(dns->qd_count) != 1) return;
+
+  size_t start = sizeof(struct dnshdr);
+  struct dnsques ques;
+  char qname[DNSNAMEBUFLEN];
+  ssize_t namelen;
+  if(readdnsques(data, datalen, &start, &ques) < 0 ||
+     (namelen = dnsname_copy(&(ques.name), qname, DNSNAMEBUFLEN)) <= 1) return;
+  namelen --;
+  if(qname[namelen - 1] == '.') qname[--namelen] = 0;
+  for(ssize_t i=0; i<namelen; i++) qname[i] = tolower((unsigned char) qname[i]);
+
+  struct pfname *pf = prefetch_get(p, qname, namelen, 0);
+  if(pf == NULL || pf->sent == 0 || pf->id != dns->id) return;
+
+  // Read only once a second, no RTT measured but upstream is alive.
+  struct upstats *s = route_upstreams();
+  struct upstat *st;
+  if(s != NULL && (st = upstats_get(s, ntohl(upstream->sin_addr.s_addr), 0)) != NULL)
+    upstream_answered(st, -1);
+  pf->sent = 0;
+  p->answered ++;
+
+  struct hostrule *hr = route_match(qname);
+  long ttl = (hr != NULL && dns->rcode == 0 && ntohs(dns->an_count) > 0) ?
+    learnroutes(data, datalen, start, &ques, qname, hr) : -1;
+  pf->due = now + ((ttl > 0) ? prefetch_delay(ttl) : PREFETCH_RETRY);
+}
+
+
+/*
+ Resolve names ahead of clients, called by main thread every second: pin
+ literal domains of rules when rules changed, take names noticed by
+ workers, learn routes from responses, then send queries of names due,
+ PREFETCH_BATCH at most. Names not popular are dropped when due.
+*/
+void
+route_prefetch(time_t now)
+{
+  struct prefetch *p = &route_prefetched;
+  if(opts.prefetch == 0) return;
+  if(p->names == NULL){
+    if(prefetch_init(p, opts.prefetch) < 0 || (route_pfsocks = ht_new()) == NULL){
+      error("could not create table of names to resolve ahead");
+      ht_free(&(route_pfsocks));
+      free(p->names);
+      p->names = NULL;
+      return;
+    }
+    srandom(mstime() ^ getpid());
+  }
+
+  struct ruleset *rs = currules();
+  if(p->tag != rs->serial){
+    pinnames(p, rs);
+    p->tag = rs->serial;
+  }
+  takenotices(p, now);
+
+  // Responses.
+  long nowms = mstime();
+  unsigned char buf[UDPPEER_BUF_MTU];
+  for(size_t i=0; i<route_pfsocks->_capa; i++){
+    for(struct hnode *i_node=route_pfsocks->_buckets[i]; i_node; i_node=i_node->next){
+      int fd = (size_t) i_node->data - 1;
+      struct sockaddr_in upstream;
+      socklen_t addrlen = ADDRSIZE;
+      ssize_t n;
+      while((n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr*) &upstream, &addrlen)) >= 0){
+	recvprefetch(p, buf, n, &upstream, now);
+	addrlen = ADDRSIZE;
+      }
+    }
+  }
+
+  // Queries, entry removed is replaced by the last one, check it again.
+  size_t budget = PREFETCH_BATCH;
+  for(size_t i=0; i<p->size; ){
+    struct pfname *i_pf = &(p->names[i]);
+    if(i_pf->sent && nowms - i_pf->sent > PREFETCH_TIMEOUT){
+      i_pf->sent = 0;
+      i_pf->due = now + PREFETCH_MIN;
+    }
+    if(i_pf->sent || i_pf->due > now || (budget == 0 && i_pf->pinned)){ i++; continue; }
+
+    struct hostrule *hr = NULL;
+    if((! i_pf->pinned && i_pf->hits < PREFETCH_HITS) || (hr = route_match(i_pf->name)) == NULL){
+      prefetch_del(p, i_pf);
+      p->dropped ++;
+      continue;
+    }
+    if(budget == 0){ i++; continue; }
+    budget --;
+    if(sendprefetch(p, i_pf, hr, nowms) < 0){
+      debug("could not resolve \"%s\" ahead", i_pf->name);
+      i_pf->due = now + PREFETCH_MIN;
+    }
+    i_pf->hits = 0;
+    i++;
+  }
+
+  static time_t lastreport = 0;
+  if(now - lastreport >= STATS_INTERVAL){
+    info("names resolved ahead %lu, %lu queries sent, %lu answered, %lu dropped",
+	 p->size, p->sent, p->answered, p->dropped);
+    lastreport = now;
+  }
+}
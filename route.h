@@ -3,11 +3,47 @@
 
 #include "common.h"
 
+struct hostrule;
+struct dnswaiter;
+
+
+#define ROUTE_EXPIRE_BATCH  1024  // max learned routes removed once.
+#define ROUTE_QCACHE_SIZE   8192  // max qnames cached per worker.
+#define ROUTE_LCACHE_SIZE   4096  // learned routes looked up cached per worker, power of 2.
+#define DNSCHAIN_MAX        8     // max names of CNAME chain followed.
+#define ANSWERKEY_LEN       10    // length of key of answer cached, qname excluded.
+#define ROUTE_JOURNAL_INTERVAL  5  // seconds, learned routes appended to journal every.
+
+
+int
+route_init(const char *cfgfile);
+
+int
+route_reload(const char *cfgfile);
+
+void
+route_enter(unsigned id);
+
+void
+route_leave(unsigned id);
+
+void
+route_expire(time_t now);
+
+void
+route_persist(time_t now);
+
+void
+route_prefetch(time_t now);
+
+void
+route_report(unsigned id);
+
 
 int
 route_default(const struct sockaddr_in *src, const struct sockaddr_in *dst,
 	      struct sockaddr_in *nxtsrc, struct sockaddr_in *nxtdst,
-	      const char *qname);
+	      const struct hostrule *hr);
 
 int
 tcp_route(const struct sockaddr_in *src, const struct sockaddr_in *dst,
@@ -16,13 +52,20 @@ tcp_route(const struct sockaddr_in *src, const struct sockaddr_in *dst,
 int
 udp_route(const void *data, size_t datalen,
 	  const struct sockaddr_in *src, const struct sockaddr_in *dst,
-	  struct sockaddr_in *nxtsrc, struct sockaddr_in *nxtdst);
+	  struct sockaddr_in *nxtsrc, struct sockaddr_in *nxtdst,
+	  struct sockaddr_in *altdst);
 
 void
 udp_route2(const void *data, size_t datalen,
 	   const struct sockaddr_in *src, const struct sockaddr_in *dst);
 
-int
-updateroute(const char *name, unsigned ip);
+size_t
+udp_waiters(const void *data, size_t datalen,
+	    const struct sockaddr_in *origdst, const struct sockaddr_in *client,
+	    struct dnswaiter *waiters);
+
+size_t
+udp_answer(void *data, size_t datalen, size_t size,
+	   const struct sockaddr_in *src, const struct sockaddr_in *dst);
 
 #endif
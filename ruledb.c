@@ -0,0 +1,425 @@
+#include "ruledb.h"
+
+
+// FNV-1a, fixed here since it is part of image layout.
+static uint32_t
+ruledb_hash(const void *key, size_t keylen)
+{
+  const unsigned char *p = (const unsigned char*) key;
+  uint32_t h = 2166136261U;
+  for(size_t i=0; i<keylen; i++){
+    h ^= p[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+
+static uint32_t
+ruledb_iphash(uint32_t ip)
+{
+  ip ^= ip >> 16;
+  ip *= 0x45d9f3bU;
+  ip ^= ip >> 16;
+  return ip;
+}
+
+
+/*
+ @Return: 1 when @dbfile is a rule image, by its head, 0 when not, -1
+   when failed to read.
+*/
+int
+ruledb_probe(const char *dbfile)
+{
+  if(dbfile == NULL){ errno = EINVAL; return -1; }
+
+  int fd = open(dbfile, O_RDONLY);
+  if(fd < 0) return -1;
+  char magic[sizeof(RULEDB_MAGIC)];
+  ssize_t n = read(fd, magic, sizeof(magic));
+  close(fd);
+  if(n < 0) return -1;
+  return n == sizeof(magic) && memcmp(magic, RULEDB_MAGIC, sizeof(magic)) == 0;
+}
+
+
+// Check table of @n elements of @elemsize at @off fits in image of @size.
+static int
+table_ok(size_t size, uint64_t off, uint64_t n, size_t elemsize)
+{
+  return off % 8 == 0 && off <= size && n <= (size - off) / elemsize;
+}
+
+
+/*
+ Map rule image @dbfile read-only. Only the head is checked here, entries
+ are checked when looked up, so it costs the same no matter how many rules.
+*/
+struct ruledb*
+ruledb_open(const char *dbfile)
+{
+  if(dbfile == NULL){ errno = EINVAL; return NULL; }
+
+  struct ruledb *db = NULL;
+  void *addr = MAP_FAILED;
+  struct stat st;
+  int fd = open(dbfile, O_RDONLY);
+  if(fd < 0){ error("could not open rule image \"%s\"", dbfile); return NULL; }
+  if(fstat(fd, &st) < 0){ error("could not stat rule image"); goto onfail; }
+  if(st.st_size < (off_t) sizeof(struct ruledb_head)){
+    errno = EINVAL;
+    error("rule image too short"); goto onfail;
+  }
+
+  addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if(addr == MAP_FAILED){ error("could not map rule image"); goto onfail; }
+  close(fd);
+  fd = -1;
+  // Tables are probed at random.
+  madvise(addr, st.st_size, MADV_RANDOM);
+
+  const struct ruledb_head *head = (const struct ruledb_head*) addr;
+  size_t size = st.st_size;
+  errno = EINVAL;
+  if(memcmp(head->magic, RULEDB_MAGIC, sizeof(head->magic)) || head->version != RULEDB_VERSION){
+    error("unknown version of rule image, compile it again"); goto onfail;
+  }
+  if(head->size != size ||
+     ! table_ok(size, head->sects, head->nsect, sizeof(struct ruledb_sect)) ||
+     ! table_ok(size, head->doms, head->domcapa, sizeof(struct ruledb_dom)) ||
+     ! table_ok(size, head->hosts, head->hostcapa, sizeof(struct ruledb_host)) ||
+     ! table_ok(size, head->nodes, head->nnode, sizeof(struct ruledb_node)) ||
+     ! table_ok(size, head->exprs, head->nexpr, sizeof(struct ruledb_expr)) ||
+     ! table_ok(size, head->strs, head->strsize, 1) ||
+     head->domcapa == 0 || (head->domcapa & (head->domcapa - 1)) ||
+     head->hostcapa == 0 || (head->hostcapa & (head->hostcapa - 1)) || head->nnode == 0){
+    error("corrupted rule image"); goto onfail;
+  }
+
+  if((db = (struct ruledb*) calloc(sizeof(struct ruledb), 1)) == NULL){
+    error("could not create rule image"); goto onfail;
+  }
+  db->head = head;
+  db->size = size;
+  return db;
+
+ onfail:
+  if(addr != MAP_FAILED) munmap(addr, st.st_size);
+  if(fd >= 0) close(fd);
+  return NULL;
+}
+
+
+void
+ruledb_close(struct ruledb **db)
+{
+  if(db == NULL || *db == NULL) return;
+
+  munmap((void*) (*db)->head, (*db)->size);
+  free(*db);
+  *db = NULL;
+}
+
+
+#define RULEDB_TABLE(db, type, field)					\
+  ((const type*) ((const unsigned char*) (db)->head + (db)->head->field))
+
+
+/*
+ @Return: section @idx, or NULL when none.
+*/
+const struct ruledb_sect*
+ruledb_sect(const struct ruledb *db, unsigned idx)
+{
+  if(idx >= db->head->nsect) return NULL;
+  return RULEDB_TABLE(db, struct ruledb_sect, sects) + idx;
+}
+
+
+/*
+ @Return: text of regex @i, and its section in @sect, or NULL when none.
+*/
+const char*
+ruledb_expr(const struct ruledb *db, size_t i, unsigned *sect)
+{
+  const struct ruledb_head *head = db->head;
+  if(i >= head->nexpr) return NULL;
+
+  const struct ruledb_expr *expr = RULEDB_TABLE(db, struct ruledb_expr, exprs) + i;
+  const char *strs = RULEDB_TABLE(db, char, strs);
+  if(expr->off >= head->strsize || memchr(strs + expr->off, 0, head->strsize - expr->off) == NULL)
+    return NULL;
+  *sect = expr->sect;
+  return strs + expr->off;
+}
+
+
+/*
+ @Return: lower-case domain in slot @i of domain table, @len bytes, not
+   NUL-terminated, or NULL when slot unused.
+*/
+const char*
+ruledb_domainat(const struct ruledb *db, size_t i, size_t *len)
+{
+  const struct ruledb_head *head = db->head;
+  if(i >= head->domcapa) return NULL;
+
+  const struct ruledb_dom *dom = RULEDB_TABLE(db, struct ruledb_dom, doms) + i;
+  if(dom->len == 0 || (uint64_t) dom->off + dom->len > head->strsize) return NULL;
+  *len = dom->len;
+  return RULEDB_TABLE(db, char, strs) + dom->off;
+}
+
+
+/*
+ Lookup lower-case host name @lname and each of its parent domains.
+
+ @Return: index of the first section of any domain found, or LPM_NONE when
+   none.
+*/
+unsigned
+ruledb_domain(const struct ruledb *db, const char *lname, size_t namelen)
+{
+  const struct ruledb_head *head = db->head;
+  const struct ruledb_dom *doms = RULEDB_TABLE(db, struct ruledb_dom, doms);
+  const char *strs = RULEDB_TABLE(db, char, strs);
+  uint64_t mask = head->domcapa - 1;
+  unsigned best = LPM_NONE;
+
+  for(size_t i=0; i<namelen; ){
+    const char *name = lname + i;
+    size_t len = namelen - i;
+    uint32_t h = ruledb_hash(name, len);
+    for(uint64_t j=h & mask, n=0; n<=mask; j=(j + 1) & mask, n++){
+      const struct ruledb_dom *dom = &(doms[j]);
+      if(dom->len == 0) break;
+      if(dom->hash != h || dom->len != len || (uint64_t) dom->off + len > head->strsize ||
+	 memcmp(strs + dom->off, name, len)) continue;
+      if(dom->idx < best && dom->idx < head->nsect) best = dom->idx;
+      break;
+    }
+    const char *dot = memchr(name, '.', len);
+    if(dot == NULL) break;
+    i = dot - lname + 1;
+  }
+  return best;
+}
+
+
+/*
+ @Return: index of section of the longest prefix covering @ip(host order),
+   or LPM_NONE when none, same as lpm_get(...).
+*/
+unsigned
+ruledb_dst(const struct ruledb *db, unsigned ip)
+{
+  const struct ruledb_head *head = db->head;
+  const struct ruledb_host *hosts = RULEDB_TABLE(db, struct ruledb_host, hosts);
+  uint32_t key = htonl(ip);
+  uint64_t mask = head->hostcapa - 1;
+  for(uint64_t j=ruledb_iphash(key) & mask, n=0; n<=mask; j=(j + 1) & mask, n++){
+    if(hosts[j].idx == 0) break;
+    if(hosts[j].ip != key) continue;
+    if(hosts[j].idx <= head->nsect) return hosts[j].idx - 1;
+    break;
+  }
+
+  const struct ruledb_node *nodes = RULEDB_TABLE(db, struct ruledb_node, nodes);
+  unsigned val = LPM_NONE;
+  uint32_t node = 0;
+  for(unsigned level=0; level<4; level++){
+    unsigned char idx = ip >> (24 - level * 8);
+    if(nodes[node].val[idx] < head->nsect) val = nodes[node].val[idx];
+    node = nodes[node].child[idx];
+    if(node == 0 || node >= head->nnode) break;
+  }
+  return val;
+}
+
+
+static size_t
+count_nodes(const struct lpmnode *node)
+{
+  size_t n = 1;
+  for(int i=0; i<256; i++) if(node->child[i] != NULL) n += count_nodes(node->child[i]);
+  return n;
+}
+
+
+// Copy trie of @node in pre-order from *@next, @Return: index of @node.
+static uint32_t
+compile_node(struct ruledb_node *nodes, uint32_t *next, const struct lpmnode *node)
+{
+  uint32_t idx = (*next)++;
+  struct ruledb_node *out = &(nodes[idx]);
+  for(int i=0; i<256; i++){
+    out->val[i] = node->val[i];
+    out->plen[i] = node->plen[i];
+    out->child[i] = (node->child[i] != NULL) ? compile_node(nodes, next, node->child[i]) : 0;
+  }
+  return idx;
+}
+
+
+static uint64_t
+table_capa(size_t n)
+{
+  uint64_t capa = 16;
+  while(capa < n * 2) capa <<= 1;
+  return capa;
+}
+
+
+static uint64_t
+align8(uint64_t off)
+{
+  return (off + 7) & ~((uint64_t) 7);
+}
+
+
+/*
+ Compile rule set @rs generated from config into image @dbfile, which is
+ written aside then renamed, processes mapped the old one keep it intact.
+*/
+int
+ruledb_compile(const struct ruleset *rs, const char *dbfile)
+{
+  if(rs == NULL || rs->db != NULL || dbfile == NULL || HOSTRULE_DNS_MAX > RULEDB_DNS_MAX){
+    errno = EINVAL; return -1;
+  }
+
+  // Size tables.
+  struct array *rules = rs->rules;
+  size_t ndom = 0, nexpr = 0;
+  uint64_t strsize = 0;
+  for(size_t i=0; i<rules->_size; i++){
+    struct hostrule *i_hr = (struct hostrule*) rules->_warehouse[i];
+    struct htable *i_doms = i_hr->domains;
+    ndom += i_doms->_size;
+    for(size_t j=0; j<i_doms->_capa; j++){
+      for(struct hnode *j_node=i_doms->_buckets[j]; j_node; j_node=j_node->next)
+	strsize += j_node->keylen + 1;
+    }
+    nexpr += i_hr->exprs->_size;
+    for(size_t j=0; j<i_hr->exprs->_size; j++)
+      strsize += strlen((const char*) i_hr->exprs->_warehouse[j]) + 1;
+  }
+  if(strsize > UINT32_MAX){ errno = EFBIG; error("too many rules to compile"); return -1; }
+
+  struct ruledb_head head;
+  memset(&head, 0, sizeof(head));
+  memcpy(head.magic, RULEDB_MAGIC, sizeof(head.magic));
+  head.version = RULEDB_VERSION;
+  head.nsect = rules->_size;
+  head.domcapa = table_capa(ndom);
+  head.hostcapa = table_capa(rs->dsts->hosts->_size);
+  head.nnode = count_nodes(rs->dsts->root);
+  head.nexpr = nexpr;
+  head.strsize = strsize;
+
+  head.sects = align8(sizeof(head));
+  head.doms = align8(head.sects + head.nsect * sizeof(struct ruledb_sect));
+  head.hosts = align8(head.doms + head.domcapa * sizeof(struct ruledb_dom));
+  head.nodes = align8(head.hosts + head.hostcapa * sizeof(struct ruledb_host));
+  head.exprs = align8(head.nodes + head.nnode * sizeof(struct ruledb_node));
+  head.strs = align8(head.exprs + head.nexpr * sizeof(struct ruledb_expr));
+  head.size = align8(head.strs + head.strsize);
+
+  unsigned char *img = (unsigned char*) calloc(head.size, 1);
+  if(img == NULL){ error("could not create rule image"); return -1; }
+  memcpy(img, &head, sizeof(head));
+  struct ruledb_sect *sects = (struct ruledb_sect*) (img + head.sects);
+  struct ruledb_dom *doms = (struct ruledb_dom*) (img + head.doms);
+  struct ruledb_host *hosts = (struct ruledb_host*) (img + head.hosts);
+  struct ruledb_node *nodes = (struct ruledb_node*) (img + head.nodes);
+  struct ruledb_expr *exprs = (struct ruledb_expr*) (img + head.exprs);
+  char *strs = (char*) (img + head.strs);
+  uint32_t stroff = 0;
+
+  // Sections, their domains and regexes, a domain in more than one section
+  // is of the first one.
+  uint64_t dommask = head.domcapa - 1;
+  size_t iexpr = 0;
+  for(size_t i=0; i<rules->_size; i++){
+    struct hostrule *i_hr = (struct hostrule*) rules->_warehouse[i];
+    sects[i].src = i_hr->src;
+    sects[i].ndns = i_hr->ndns;
+    memcpy(sects[i].dns, i_hr->dns, i_hr->ndns * sizeof(uint32_t));
+
+    struct htable *i_doms = i_hr->domains;
+    for(size_t j=0; j<i_doms->_capa; j++){
+      for(struct hnode *j_node=i_doms->_buckets[j]; j_node; j_node=j_node->next){
+	uint32_t h = ruledb_hash(j_node->key, j_node->keylen);
+	uint64_t k = h & dommask;
+	for(; doms[k].len; k=(k + 1) & dommask){
+	  if(doms[k].hash == h && doms[k].len == j_node->keylen &&
+	     memcmp(strs + doms[k].off, j_node->key, j_node->keylen) == 0) break;
+	}
+	if(doms[k].len) continue;
+
+	memcpy(strs + stroff, j_node->key, j_node->keylen);
+	doms[k].hash = h;
+	doms[k].off = stroff;
+	doms[k].len = j_node->keylen;
+	doms[k].idx = i;
+	stroff += j_node->keylen + 1;
+      }
+    }
+
+    for(size_t j=0; j<i_hr->exprs->_size; j++, iexpr++){
+      const char *j_expr = (const char*) i_hr->exprs->_warehouse[j];
+      size_t j_len = strlen(j_expr);
+      memcpy(strs + stroff, j_expr, j_len);
+      exprs[iexpr].sect = i;
+      exprs[iexpr].off = stroff;
+      stroff += j_len + 1;
+    }
+  }
+
+  // Destinations.
+  struct htable *rhosts = rs->dsts->hosts;
+  uint64_t hostmask = head.hostcapa - 1;
+  for(size_t i=0; i<rhosts->_capa; i++){
+    for(struct hnode *i_node=rhosts->_buckets[i]; i_node; i_node=i_node->next){
+      uint32_t ip;
+      memcpy(&ip, i_node->key, sizeof(ip));
+      uint64_t k = ruledb_iphash(ip) & hostmask;
+      while(hosts[k].idx) k = (k + 1) & hostmask;
+      hosts[k].ip = ip;
+      hosts[k].idx = (size_t) i_node->data;
+    }
+  }
+  uint32_t next = 0;
+  compile_node(nodes, &next, rs->dsts->root);
+
+  // Write aside, then replace.
+  size_t pathlen = strlen(dbfile) + 5;
+  char *tmpfile = (char*) malloc(pathlen);
+  FILE *f = NULL;
+  if(tmpfile == NULL){ error("could not write rule image"); goto onfail; }
+  snprintf(tmpfile, pathlen, "%s.tmp", dbfile);
+  if((f = fopen(tmpfile, "wb")) == NULL){ error("could not create \"%s\"", tmpfile); goto onfail; }
+  if(fwrite(img, head.size, 1, f) != 1 || fflush(f) || fsync(fileno(f))){
+    error("could not write \"%s\"", tmpfile); goto onfail;
+  }
+  fclose(f);
+  f = NULL;
+  if(rename(tmpfile, dbfile) < 0){ error("could not rename to \"%s\"", dbfile); goto onfail; }
+
+  info("compiled %u sections, %ld domains, %ld regexes, %ld prefixes into \"%s\", %lu bytes",
+       head.nsect, ndom, nexpr, rs->dsts->nprefix + rhosts->_size, dbfile,
+       (unsigned long) head.size);
+  free(tmpfile);
+  free(img);
+  return 0;
+
+ onfail:
+  if(f != NULL){
+    fclose(f);
+    unlink(tmpfile);
+  }
+  free(tmpfile);
+  free(img);
+  return -1;
+}
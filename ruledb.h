@@ -0,0 +1,133 @@
+#ifndef _RULEDB_H_
+#define _RULEDB_H_
+
+#include "common.h"
+
+
+#define RULEDB_MAGIC    "XNATRDB"  // 8 bytes with NUL, head of rule image.
+#define RULEDB_VERSION  1          // bumped when layout changes.
+#define RULEDB_DNS_MAX  4          // DNS servers of section, HOSTRULE_DNS_MAX at most.
+
+struct ruleset;
+
+
+/*
+ Head of rule image, compiled from config by ruledb_compile(...) and mapped
+ read-only by ruledb_open(...), so it is shared by all processes using it.
+ Fields are in byte order of the host compiled it, an image of another byte
+ order is refused as of unknown version. Tables are at offsets from start
+ of image, aligned to 8 bytes.
+
+@size: of the whole image.
+@sects: struct ruledb_sect, @nsect in all, in order of sections.
+@doms: hash table of domains, struct ruledb_dom, @domcapa slots, power of 2.
+@hosts: hash table of host addresses(/32), struct ruledb_host, @hostcapa
+  slots, power of 2.
+@nodes: prefix trie of shorter prefixes, struct ruledb_node, @nnode in all,
+  root is the first one.
+@exprs: regexes, struct ruledb_expr, @nexpr in all, in order of config.
+@strs: text of domains and regexes, @strsize bytes.
+*/
+struct ruledb_head{
+  char magic[8];
+  uint32_t version, nsect;
+  uint64_t size;
+  uint64_t sects;
+  uint64_t doms, domcapa;
+  uint64_t hosts, hostcapa;
+  uint64_t nodes, nnode;
+  uint64_t exprs, nexpr;
+  uint64_t strs, strsize;
+};
+
+
+/*
+ Section, see struct hostrule.
+*/
+struct ruledb_sect{
+  uint32_t src, ndns;
+  uint32_t dns[RULEDB_DNS_MAX];
+};
+
+
+/*
+ Slot of domain table, probed linearly from hash of domain.
+
+@hash: ruledb_hash(...) of domain.
+@off, @len: text of lower-case domain in @strs, slot unused when @len is 0.
+@idx: index of the first section of domain.
+*/
+struct ruledb_dom{
+  uint32_t hash, off, len, idx;
+};
+
+
+/*
+ Slot of host table, probed linearly from hash of address.
+
+@ip: address, in network order.
+@idx: index of section + 1, slot unused when 0.
+*/
+struct ruledb_host{
+  uint32_t ip, idx;
+};
+
+
+/*
+ Node of prefix trie, same as struct lpmnode, with index of node in place
+ of pointer, 0 when none.
+*/
+struct ruledb_node{
+  uint32_t child[256];
+  uint32_t val[256];
+  uint8_t plen[256];
+};
+
+
+/*
+ Regex of section @sect, text at @off in @strs.
+*/
+struct ruledb_expr{
+  uint32_t sect, off;
+};
+
+
+/*
+ Rule image mapped.
+
+@head: start of mapping, @size bytes.
+*/
+struct ruledb{
+  const struct ruledb_head *head;
+  size_t size;
+};
+
+
+int
+ruledb_probe(const char *dbfile);
+
+struct ruledb*
+ruledb_open(const char *dbfile);
+
+void
+ruledb_close(struct ruledb **db);
+
+const struct ruledb_sect*
+ruledb_sect(const struct ruledb *db, unsigned idx);
+
+const char*
+ruledb_expr(const struct ruledb *db, size_t i, unsigned *sect);
+
+const char*
+ruledb_domainat(const struct ruledb *db, size_t i, size_t *len);
+
+unsigned
+ruledb_domain(const struct ruledb *db, const char *lname, size_t namelen);
+
+unsigned
+ruledb_dst(const struct ruledb *db, unsigned ip);
+
+int
+ruledb_compile(const struct ruleset *rs, const char *dbfile);
+
+#endif
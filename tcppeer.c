@@ -1,13 +1,62 @@
 #include "tcppeer.h"
 
 
+// Pools of dbpeer per worker, for buffer and splice mode respectively.
+static __thread struct pool dbppools[2];
+
+
+/*
+ Create pipe for splice mode.
+
+ @Return: capacity of pipe, or -1 when failed.
+*/
+static ssize_t
+pipe_new(int pfd[2])
+{
+  if(pipe2(pfd, O_NONBLOCK | O_CLOEXEC) < 0) return -1;
+
+  // Enlarge pipe, keep default capacity when failed.
+  fcntl(pfd[1], F_SETPIPE_SZ, TCPPEER_PIPE_SIZE);
+  int size = fcntl(pfd[1], F_GETPIPE_SZ);
+  if(size <= 0){
+    close(pfd[0]); close(pfd[1]);
+    pfd[0] = pfd[1] = -1;
+    return -1;
+  }
+  return size;
+}
+
+
+/*
+ Create dbpeer, move data via pipes between both sides when @splice, fall back
+ to memory buffer when pipes could not be created.
+*/
 struct tcpdbpeer*
-dbp_new(void)
+dbp_new(int splice)
 {
+  int pfds[2][2] = {{-1, -1}, {-1, -1}};
+  ssize_t psizes[2];
+  if(splice){
+    if((psizes[0] = pipe_new(pfds[0])) < 0 || (psizes[1] = pipe_new(pfds[1])) < 0){
+      warn("could not create pipe, fall back to buffer");
+      if(pfds[0][0] != -1){ close(pfds[0][0]); close(pfds[0][1]); }
+      pfds[0][0] = pfds[0][1] = -1;
+      splice = 0;
+    }
+  }
+
+  // Get from pool, only headers are zeroed, not the data buffers.
+  size_t bufsize = splice ? 0 : TCPPEER_BUF_SIZE;
   size_t totalsize = sizeof(struct tcpdbpeer) +
-    (sizeof(struct tcppeer) + sizeof(struct tcpbuffer) + TCPPEER_BUF_SIZE) * 2;
-  struct tcpdbpeer *dbp = (struct tcpdbpeer*) calloc(totalsize, 1);
-  if(dbp == NULL) return NULL;
+    (sizeof(struct tcppeer) + sizeof(struct tcpbuffer) + bufsize) * 2;
+  struct pool *pl = &(dbppools[splice ? 1 : 0]);
+  if(pl->objsize == 0) pool_init(pl, totalsize, opts.poolsize, opts.hugepage);
+  struct tcpdbpeer *dbp = (struct tcpdbpeer*) pool_get(pl);
+  if(dbp == NULL){
+    for(size_t i=0; splice && i<2; i++){ close(pfds[i][0]); close(pfds[i][1]); }
+    return NULL;
+  }
+  memset(dbp, 0, sizeof(struct tcpdbpeer));
 
   unsigned char *curr = (unsigned char*) dbp;
   curr += sizeof(struct tcpdbpeer);
@@ -15,15 +64,20 @@ dbp_new(void)
   for(size_t i=0; i<sizeof(ps)/sizeof(struct tcppeer**); i++){
     struct tcppeer **i_p = ps[i];
     *i_p = (struct tcppeer*) curr;
+    memset(curr, 0, sizeof(struct tcppeer) + sizeof(struct tcpbuffer));
     
     curr += sizeof(struct tcppeer);
     (*i_p)->w_buf = (struct tcpbuffer*) curr;
 
     curr += sizeof(struct tcpbuffer);
-    (*i_p)->w_buf->dat = curr;
-    (*i_p)->w_buf->size = TCPPEER_BUF_SIZE;
-
-    curr += TCPPEER_BUF_SIZE;
+    (*i_p)->w_buf->dat = splice ? NULL : curr;
+    (*i_p)->w_buf->size = splice ? psizes[i] : TCPPEER_BUF_SIZE;
+    (*i_p)->w_buf->pfd[0] = pfds[i][0];
+    (*i_p)->w_buf->pfd[1] = pfds[i][1];
+    (*i_p)->ev.type = EVSRC_TCPPEER;
+    (*i_p)->dbp = dbp;
+
+    curr += bufsize;
   }
   return dbp;
 }
@@ -35,7 +89,13 @@ dbp_free(struct tcpdbpeer **dbp)
   if(dbp == NULL || *dbp == NULL) return;
   close((*dbp)->l->fd);
   close((*dbp)->r->fd);
-  free(*dbp);
+  struct tcpbuffer *bufs[] = {(*dbp)->l->w_buf, (*dbp)->r->w_buf};
+  for(size_t i=0; i<sizeof(bufs)/sizeof(struct tcpbuffer*); i++){
+    if(bufs[i]->pfd[0] == -1) continue;
+    close(bufs[i]->pfd[0]);
+    close(bufs[i]->pfd[1]);
+  }
+  pool_put(*dbp);
   *dbp = NULL;
 }
 
@@ -101,7 +161,7 @@ accept_con(int fd)
   }
   
   // Both side had been setup.
-  struct tcpdbpeer *dbp = dbp_new();
+  struct tcpdbpeer *dbp = dbp_new(opts.splice);
   if(dbp == NULL){ error("failed to create dbpeer"); goto giveup; }
   dbp->l->fd = lfd;
   dbp->l->status = TCPPEER_UP;
@@ -114,67 +174,142 @@ accept_con(int fd)
  giveup:
   if(lfd != -1) close(lfd);
   if(rfd != -1) close(rfd);
+  errno = ECONNABORTED;
   return NULL;
 }
 
 
+/*
+ Fill @vec with free space of circular buffer @buf.
+
+ @Return: count of segments, 1 or 2.
+*/
+static int
+tcpbuffer_freevec(struct tcpbuffer *buf, struct iovec vec[2])
+{
+  unsigned char *dat = (unsigned char*) buf->dat;
+  size_t tail = buf->head + buf->datlen;
+
+  // Data wrapped, free space is between tail and head.
+  if(tail >= buf->size){
+    vec[0].iov_base = dat + (tail - buf->size);
+    vec[0].iov_len = buf->size - buf->datlen;
+    return 1;
+  }
+
+  vec[0].iov_base = dat + tail;
+  vec[0].iov_len = buf->size - tail;
+  vec[1].iov_base = dat;
+  vec[1].iov_len = buf->head;
+  return buf->head ? 2 : 1;
+}
+
+
+/*
+ Fill @vec with data of circular buffer @buf.
+
+ @Return: count of segments, 1 or 2.
+*/
+static int
+tcpbuffer_datavec(struct tcpbuffer *buf, struct iovec vec[2])
+{
+  unsigned char *dat = (unsigned char*) buf->dat;
+  size_t tail = buf->head + buf->datlen;
+
+  vec[0].iov_base = dat + buf->head;
+  if(tail <= buf->size){
+    vec[0].iov_len = buf->datlen;
+    return 1;
+  }
+
+  // Data wrapped.
+  vec[0].iov_len = buf->size - buf->head;
+  vec[1].iov_base = dat;
+  vec[1].iov_len = tail - buf->size;
+  return 2;
+}
+
+
 /*
  @pa: Peer had been ready to read.
  @buf: Buffer to store data read.
+
+ @Return: 1 when any progress made(data read or status changed), or 0.
 */
-void
+int
 tcppeer_rready(struct tcppeer *pa, struct tcpbuffer *buf)
 {
   size_t freesize = buf->size - buf->datlen;
-  if(freesize){
-    ssize_t brecv = recv(pa->fd, buf->dat + buf->datlen, freesize, MSG_DONTWAIT);
+  if(freesize && ! buf->full){
+    struct iovec vec[2];
+    ssize_t brecv = (buf->pfd[1] != -1) ?
+      splice(pa->fd, NULL, buf->pfd[1], NULL, freesize,
+	     SPLICE_F_MOVE | SPLICE_F_NONBLOCK) :
+      readv(pa->fd, vec, tcpbuffer_freevec(buf, vec));
     if(brecv < 0){
-      if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+      if(errno == EAGAIN || errno == EWOULDBLOCK){
+	// Not empty pipe may be full, the socket is empty only when not.
+	if(buf->pfd[1] != -1 && buf->datlen) buf->full = 1;
+	else pa->ev.events &= ~EPOLLIN;
+	return 0;
+      }
       error("recv from fd_%d failed", pa->fd);
       pa->status = TCPPEER_DOWN;
-      return;
+      return 1;
     }
 
     if(brecv == 0){
       debug("peer(fd: %d) down", pa->fd);
       pa->status = TCPPEER_DOWN;
-      return;
+      return 1;
     }
 
     debug("recv %ld bytes from peer(fd: %d)", brecv, pa->fd);
     buf->datlen += brecv;
-    return;
+    return 1;
   }
 
   debug("no free buffer while fd_%d ready to read", pa->fd);
+  return 0;
 }
 
 
 /*
  @pa: Peer had been ready to write.
  @buf: Data to be sent.
+
+ @Return: 1 when any progress made(data sent or status changed), or 0.
 */
-void
+int
 tcppeer_wready(struct tcppeer *pa, struct tcpbuffer *buf)
 {
   if(pa->status == TCPPEER_UP){
     if(buf->datlen != 0){
-      ssize_t bsent = send(pa->fd, buf->dat, buf->datlen, MSG_DONTWAIT);
+      struct iovec vec[2];
+      ssize_t bsent = (buf->pfd[0] != -1) ?
+	splice(buf->pfd[0], NULL, pa->fd, NULL, buf->datlen,
+	       SPLICE_F_MOVE | SPLICE_F_NONBLOCK) :
+	writev(pa->fd, vec, tcpbuffer_datavec(buf, vec));
       if(bsent < 0){
-	if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+	if(errno == EAGAIN || errno == EWOULDBLOCK){
+	  pa->ev.events &= ~EPOLLOUT;
+	  return 0;
+	}
 	error("send on fd_%d failed", pa->fd);
 	pa->status = TCPPEER_DOWN;
-	return;
+	return 1;
       }
 
       debug("send %ld bytes on fd_%d", bsent, pa->fd);
-      memcpy(buf->dat, buf->dat + bsent, buf->datlen - bsent);
+      buf->head = (buf->head + bsent) % buf->size;
       buf->datlen -= bsent;
-      return;
+      if(buf->datlen == 0) buf->head = 0;  // Keep free space contiguous.
+      buf->full = 0;
+      return 1;
     }
 
     debug("no data to send on fd_%d while ready on W", pa->fd);
-    return;
+    return 0;
   }
   
   if(pa->status & TCPPEER_NREADY){
@@ -183,97 +318,157 @@ tcppeer_wready(struct tcppeer *pa, struct tcpbuffer *buf)
     if(getsockopt(pa->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0){
       error("failed to check if fd_%d connect(...) succ", pa->fd);
       pa->status = TCPPEER_DOWN;
-      return;
+      return 1;
     }
 
     if(err){
       errno = err;
       error("connect(...) failed at fd_%d", pa->fd);
       pa->status = TCPPEER_DOWN;
-      return;
+      return 1;
     }
 
     debug("fd_%d connect(...) succ", pa->fd);
     pa->status = TCPPEER_UP;
-    return;
+    return 1;
   }
+  return 0;
 }
 
 
-int
-tcppeer_fillfdset(struct array *dbplist, fd_set *rfds, fd_set *wfds)
-{
-  int maxfd = 0;
-  
-  // Decide which event to be tracked on which peer.
-  size_t i = -1;
-  while(++i < dbplist->_size){
-    struct tcpdbpeer *i_dbp = (struct tcpdbpeer*) dbplist->_warehouse[i];
-    struct tcppeer *pa = i_dbp->l, *pb = i_dbp->r;
+/*
+ Move data between both sides of @dbp as far as cached readiness allows,
+ then shutdown any side which could not make progress anymore.
 
-    // Clean up closed peer, try to flush buffer before closing any open peer.
-    if((pb->status & TCPPEER_DOWN) && (! (pa->status & TCPPEER_DOWN)) &&
-       (pa->w_buf->datlen == 0)){
-      debug("close l-peer(fd: %d, status: %d) forcely", pa->fd, pa->status);
-      pa->status = TCPPEER_DOWN;
+ @Return: 1 when more work may remain(round limit reached), or 0.
+*/
+static int
+dbp_pump(struct tcpdbpeer *dbp)
+{
+  struct tcppeer *pa = dbp->l, *pb = dbp->r;
+  struct tcppeer *peers[][2] = {{pa, pb}, {pb, pa}};
+  int progress = 1;
+
+  for(size_t round=0; progress && round<TCPPEER_PUMP_ROUNDS; round++){
+    progress = 0;
+    for(size_t i=0; i<sizeof(peers)/sizeof(peers[0]); i++){
+      struct tcppeer *p = peers[i][0], *q = peers[i][1];
+
+      // For W:
+      // 1). TCPPEER_NREADY, to check if connected.
+      // 2). TCPPEER_UP, with not empty buffer in self side.
+      if((p->ev.events & EPOLLOUT) &&
+	 ((p->status & TCPPEER_NREADY) ||
+	  ((p->status & TCPPEER_UP) && p->w_buf->datlen != 0)))
+	progress |= tcppeer_wready(p, p->w_buf);
+
+      // For R:
+      // 1). when both TCPPEER_UP, with free buffer in other side.
+      if((p->ev.events & EPOLLIN) &&
+	 (p->status & TCPPEER_UP) && (q->status & TCPPEER_UP) &&
+	 q->w_buf->datlen < q->w_buf->size && ! q->w_buf->full)
+	progress |= tcppeer_rready(p, q->w_buf);
     }
+  }
+
+  // Close peer, try to flush buffer before closing any open peer.
+  if((pb->status & TCPPEER_DOWN) && (! (pa->status & TCPPEER_DOWN)) &&
+     (pa->w_buf->datlen == 0)){
+    debug("close l-peer(fd: %d, status: %d) forcely", pa->fd, pa->status);
+    pa->status = TCPPEER_DOWN;
+  }
+
+  if((pa->status & TCPPEER_DOWN) && (! (pb->status & TCPPEER_DOWN)) &&
+     (pb->w_buf->datlen == 0)){
+    debug("close r-peer(fd: %d, status: %d) forcely", pb->fd, pb->status);
+    pb->status = TCPPEER_DOWN;
+  }
+
+  return progress;
+}
 
-    if((pa->status & TCPPEER_DOWN) && (! (pb->status & TCPPEER_DOWN)) &&
-       (pb->w_buf->datlen == 0)){
-      debug("close r-peer(fd: %d, status: %d) forcely", pb->fd, pb->status);
-      pb->status = TCPPEER_DOWN;
+
+/*
+ Queue @dbp on dirty list of reactor, when not yet.
+*/
+void
+dbp_mark(struct reactor *rt, struct tcpdbpeer *dbp)
+{
+  if(dbp->pending) return;
+  if(ary_append(rt->tcpdirty, dbp) < 0){
+    error("could not queue dbpeer(lfd: %d, rfd: %d)", dbp->l->fd, dbp->r->fd);
+    return;
+  }
+  dbp->pending = 1;
+}
+
+
+/*
+ Accept con on @lsn, register both sides on reactor, TCPPEER_ACCEPT_BATCH
+ at most, the rest left pending are accepted on next loop, which does not
+ block then.
+*/
+void
+tcppeer_accept(struct reactor *rt, struct tcplistener *lsn, struct array *dbplist)
+{
+  size_t i;
+  for(i=0; i<TCPPEER_ACCEPT_BATCH && (lsn->ev.events & EPOLLIN); i++){
+    struct tcpdbpeer *dbp = accept_con(lsn->fd);
+    if(dbp == NULL){
+      if(errno == EAGAIN || errno == EWOULDBLOCK){
+	lsn->ev.events &= ~EPOLLIN;
+	break;
+      }
+      warn("could not accept incoming con");
+      if(errno == ECONNABORTED) continue;
+      break;  // Retry on next loop, e.g. EMFILE.
     }
-      
-    // Remove dbpeer when both side had been shutdown.
-    if((pa->status & TCPPEER_DOWN) && (pb->status && TCPPEER_DOWN)){
-      debug("remove closed dbpeer(lfd: %d, rfd: %d)", pa->fd, pb->fd);
-      ary_del(dbplist, i_dbp);
-      dbp_free(&i_dbp);
-      --i;
+
+    if(ary_append(dbplist, dbp) < 0){
+      error("could not append dbpeer, con lost");
+      dbp_free(&dbp);
       continue;
     }
-
-    // For R:
-    // 1). when both TCPPEER_UP, with free buffer in other side.
-    if((pa->status & TCPPEER_UP) && (pb->status & TCPPEER_UP)){
-      if(pb->w_buf->datlen < pb->w_buf->size) FD_SET(pa->fd, rfds);
-      if(pa->w_buf->datlen < pa->w_buf->size) FD_SET(pb->fd, rfds);
+    if(reactor_add(rt, dbp->l->fd, &(dbp->l->ev)) < 0 ||
+       reactor_add(rt, dbp->r->fd, &(dbp->r->ev)) < 0){
+      error("could not register dbpeer, con lost");
+      ary_del(dbplist, dbp);
+      dbp_free(&dbp);
+      continue;
     }
-
-    // For W:
-    // 1). TCPPEER_NREADY.
-    // 2). TCPPEER_UP, with not empty buffer in self side.
-    if((pa->status & TCPPEER_NREADY) ||
-       ((pa->status & TCPPEER_UP) && pa->w_buf->datlen != 0)) FD_SET(pa->fd, wfds);
-    if((pb->status & TCPPEER_NREADY) ||
-       ((pb->status & TCPPEER_UP) && pb->w_buf->datlen != 0)) FD_SET(pb->fd, wfds);
-
-    // Update the max fd.
-    unsigned tr = FD_ISSET(pa->fd, rfds), tw = FD_ISSET(pa->fd, wfds);
-    debug("track l-peer(fd: %d, status: %d) on R(%d), W(%d)",
-	  pa->fd, pa->status, tr, tw);
-    if((tr || tw) && pa->fd > maxfd) maxfd = pa->fd;
-
-    tr = FD_ISSET(pb->fd, rfds), tw = FD_ISSET(pb->fd, wfds);
-    debug("track r-peer(fd: %d, status: %d) on R(%d), W(%d)",
-	  pb->fd, pb->status, tr, tw);
-    if((tr || tw) && pb->fd > maxfd) maxfd = pb->fd;
+    debug("new con(lfd: %d, rfd: %d)", dbp->l->fd, dbp->r->fd);
   }
-
-  return maxfd;
+  // Not when failed, e.g. EMFILE, which would spin.
+  rt->backlog = (i == TCPPEER_ACCEPT_BATCH && (lsn->ev.events & EPOLLIN));
 }
 
 
+/*
+ Process dbpeers on dirty list, remove dbpeer when both side had been shutdown.
+ dbpeer which still has work would be queued again for next loop.
+*/
 void
-tcppeer_checkevent(struct array *dbplist, fd_set *rfds, fd_set *wfds)
+tcppeer_process(struct reactor *rt, struct array *dbplist)
 {
-  // Check any RW fd.
-  for(size_t i=0; i<dbplist->_size; i++){
-    struct tcpdbpeer *i_dbp = (struct tcpdbpeer*) dbplist->_warehouse[i];
-    if(FD_ISSET(i_dbp->l->fd, rfds)) tcppeer_rready(i_dbp->l, i_dbp->r->w_buf);
-    if(FD_ISSET(i_dbp->l->fd, wfds)) tcppeer_wready(i_dbp->l, i_dbp->l->w_buf);
-
-    if(FD_ISSET(i_dbp->r->fd, rfds)) tcppeer_rready(i_dbp->r, i_dbp->l->w_buf);
-    if(FD_ISSET(i_dbp->r->fd, wfds)) tcppeer_wready(i_dbp->r, i_dbp->r->w_buf);
+  struct array *dirty = rt->tcpdirty;
+  size_t size = dirty->_size, left = 0;
+
+  for(size_t i=0; i<size; i++){
+    struct tcpdbpeer *i_dbp = (struct tcpdbpeer*) dirty->_warehouse[i];
+    struct tcppeer *pa = i_dbp->l, *pb = i_dbp->r;
+    int more = dbp_pump(i_dbp);
+
+    // Remove dbpeer when both side had been shutdown.
+    if((pa->status & TCPPEER_DOWN) && (pb->status & TCPPEER_DOWN)){
+      debug("remove closed dbpeer(lfd: %d, rfd: %d)", pa->fd, pb->fd);
+      ary_del(dbplist, i_dbp);
+      dbp_free(&i_dbp);
+      continue;
+    }
+
+    // Keep it on dirty list when work left.
+    if(more) dirty->_warehouse[left++] = i_dbp;
+    else i_dbp->pending = 0;
   }
+  dirty->_size = left;
 }
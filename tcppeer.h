@@ -18,27 +18,64 @@ Description:
 
 
 #define TCPPEER_BUF_SIZE   20480
+#define TCPPEER_PIPE_SIZE  65536  // capacity of pipe in splice mode.
+#define TCPPEER_PUMP_ROUNDS  16  // max rounds to move data on a dbpeer per loop.
+#define TCPPEER_ACCEPT_BATCH 64  // max con accepted per loop.
 
+/*
+ Buffer of data to be sent, either real memory or a pipe in splice mode.
+
+@dat: circular memory to store data, NULL in splice mode.
+@head: offset of the first byte of data in @dat, wraps at @size.
+@datlen: bytes of data stored, in pipe or memory.
+@size: capacity of memory or pipe.
+@pfd: pipe to move data in kernel via splice(...), -1 when not in splice mode.
+@full: 1 when pipe could not accept more, which could happen before @size
+  reached since pipe is counted in pages. Cleared once any data drained.
+*/
 struct tcpbuffer{
   void *dat;
-  size_t datlen, size;
+  size_t head, datlen, size;
+  int pfd[2];
+  unsigned full;
 };
 
 
+/*
+@ev: event source registered on reactor, MUST be the first member.
+@dbp: dbpeer which the peer belongs to.
+*/
 struct tcppeer{
+  struct evsrc ev;
   int fd;
   unsigned status;
   struct tcpbuffer *w_buf;
+  struct tcpdbpeer *dbp;
 };
 
 
+/*
+@pending: 1 when queued on dirty list of reactor.
+*/
 struct tcpdbpeer{
   struct tcppeer *l, *r;
+  unsigned pending;
+};
+
+
+/*
+ Listening socket for TCP.
+
+@ev: event source registered on reactor, MUST be the first member.
+*/
+struct tcplistener{
+  struct evsrc ev;
+  int fd;
 };
 
 
 struct tcpdbpeer*
-dbp_new(void);
+dbp_new(int splice);
 
 void
 dbp_free(struct tcpdbpeer **dbp);
@@ -46,17 +83,20 @@ dbp_free(struct tcpdbpeer **dbp);
 struct tcpdbpeer*
 accept_con(int fd);
 
-void
+int
 tcppeer_rready(struct tcppeer *pa, struct tcpbuffer *buf);
 
-void
+int
 tcppeer_wready(struct tcppeer *pa, struct tcpbuffer *buf);
 
-int
-tcppeer_fillfdset(struct array *dbplist, fd_set *rfds, fd_set *wfds);
+void
+dbp_mark(struct reactor *rt, struct tcpdbpeer *dbp);
+
+void
+tcppeer_accept(struct reactor *rt, struct tcplistener *lsn, struct array *dbplist);
 
 void
-tcppeer_checkevent(struct array *dbplist, fd_set *rfds, fd_set *wfds);
+tcppeer_process(struct reactor *rt, struct array *dbplist);
 
 #endif
 
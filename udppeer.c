@@ -1,31 +1,66 @@
 #include "udppeer.h"
 
 
+// Pool of udppeer and pools of buffer in each size class, per worker.
+static __thread struct pool udppool, udpbufpools[2];
+
+// Overflow of pkts larger than buffer of small class, one slot per pkt of
+// a batch, allocated on first read.
+static __thread unsigned char *udpscratch;
+
+#define UDPPEER_OVERFLOW   (UDPPEER_BUF_SIZE - UDPPEER_BUF_MTU)
+#define UDPPEER_CTLBUF     0xFF
+
+
 /*
+ Copy origin dst out of control msg of @msg.
+
+ @Return: 1 when found, 0 when not, -1 when malformed.
+*/
+static int
+msg_origdst(struct msghdr *msg, struct sockaddr_in *origdst)
+{
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+  while(cmsg != NULL){
+    if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVORIGDSTADDR){
+      if(cmsg->cmsg_len - sizeof(struct cmsghdr) != ADDRSIZE){
+	error("unexpected len of origin dst, cmsg len %ld", cmsg->cmsg_len);
+	return -1;
+      }
+
+      memcpy(origdst, CMSG_DATA(cmsg), ADDRSIZE);
+      return 1;
+    }
+
+    // Loop.
+    cmsg = CMSG_NXTHDR(msg, cmsg);
+  }
+  return 0;
+}
+
+
+/*
+@vec, @veclen: buffers to scatter pkt into.
 @hasorigdst: set to NULL when don't want origin dst info.
 */
 ssize_t
 socket_recvmsg(int fd,
-	       void *buf, size_t buflen, struct sockaddr_in *src,
+	       struct iovec *vec, size_t veclen, struct sockaddr_in *src,
 	       int *hasorigdst, struct sockaddr_in *origdst)
 {
-  if(buf == NULL || buflen == 0 || src == NULL ||
+  if(vec == NULL || veclen == 0 || src == NULL ||
      (hasorigdst != NULL && origdst == NULL)){ errno = EINVAL; return -1; }
-  
+
   struct msghdr msg;
   msg.msg_name = src;
   msg.msg_namelen = ADDRSIZE;
 
-  struct iovec vec;
-  vec.iov_base = buf;
-  vec.iov_len = buflen;
-  msg.msg_iov = &vec;
-  msg.msg_iovlen = 1;
+  msg.msg_iov = vec;
+  msg.msg_iovlen = veclen;
 
-  const size_t ctlbuflen = 0xFF;
-  unsigned char ctlbuf[ctlbuflen];
+  unsigned char ctlbuf[UDPPEER_CTLBUF];
   msg.msg_control = ctlbuf;
-  msg.msg_controllen = ctlbuflen;
+  msg.msg_controllen = UDPPEER_CTLBUF;
 
   msg.msg_flags = 0;
 
@@ -40,54 +75,184 @@ socket_recvmsg(int fd,
   if(hasorigdst == NULL) return brecv;
 
   // Check if origin dst exists.
-  *hasorigdst = 0;
-  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-  while(cmsg != NULL){
-    if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVORIGDSTADDR){
-      if(cmsg->cmsg_len - sizeof(struct cmsghdr) != ADDRSIZE){
-	error("unexpected len of origin dst, cmsg len %ld", cmsg->cmsg_len);
-	return -1;
-      }
+  if((*hasorigdst = msg_origdst(&msg, origdst)) < 0) return -1;
+  return brecv;
+}
 
-      *hasorigdst = 1;
-      memcpy(origdst, CMSG_DATA(cmsg), ADDRSIZE);
+
+// Counters of UDP path, per worker.
+static __thread struct udpstats udpstats;
+
+
+struct routemap*
+routemap_new(void)
+{
+  struct routemap *map = (struct routemap*) calloc(sizeof(struct routemap), 1);
+  if(map == NULL) return NULL;
+
+  map->nset = 1;
+  map->infos = (struct routeinfo*) calloc(sizeof(struct routeinfo), ROUTEMAP_WAYS);
+  if(map->infos == NULL){
+    free(map);
+    return NULL;
+  }
+  return map;
+}
+
+
+void
+routemap_free(struct routemap **map)
+{
+  if(map == NULL || *map == NULL) return;
+
+  free((*map)->infos);
+  free(*map);
+  *map = NULL;
+}
+
+
+static size_t
+routemap_setidx(size_t nset, const struct sockaddr_in *taddr)
+{
+  // Finalizer of MurmurHash3.
+  uint64_t h = ((uint64_t) taddr->sin_addr.s_addr << 16) | taddr->sin_port;
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  return (size_t) h & (nset - 1);
+}
+
+
+/*
+ Double sets of @map, entries of a set are split into two sets, so never
+ overflow.
+*/
+static int
+routemap_grow(struct routemap *map)
+{
+  size_t nset = map->nset * 2;
+  struct routeinfo *infos = (struct routeinfo*) calloc(sizeof(struct routeinfo),
+						       nset * ROUTEMAP_WAYS);
+  if(infos == NULL) return -1;
+
+  for(size_t i=0; i<map->nset * ROUTEMAP_WAYS; i++){
+    struct routeinfo *i_info = &(map->infos[i]);
+    if(! i_info->lact) continue;
+    struct routeinfo *set = &(infos[routemap_setidx(nset, &(i_info->taddr)) * ROUTEMAP_WAYS]);
+    for(size_t w=0; w<ROUTEMAP_WAYS; w++){
+      if(set[w].lact) continue;
+      memcpy(&(set[w]), i_info, sizeof(struct routeinfo));
       break;
     }
-    
-    // Loop.
-    cmsg = CMSG_NXTHDR(&msg, cmsg);
   }
-
-  return brecv;
+  free(map->infos);
+  map->infos = infos;
+  map->nset = nset;
+  return 0;
 }
 
 
-struct routeinfo*
-routeinfo_new(const struct sockaddr_in *addr, const struct sockaddr_in *taddr)
+/*
+ Print counters of UDP path of current worker, when changed.
+*/
+void
+udpstats_report(unsigned id)
 {
-  if(addr == NULL || taddr == NULL){errno = EINVAL; return NULL; }
-  
-  struct routeinfo *info = (struct routeinfo*) calloc(sizeof(struct routeinfo), 1);
-  if(info == NULL) return NULL;
+  static __thread struct udpstats last;
+  if(memcmp(&last, &udpstats, sizeof(struct udpstats)) == 0) return;
+
+  info("worker %u: route info %lu evicted, %lu expired, pkts %lu dropped on full queue",
+       id, udpstats.evicted, udpstats.expired, udpstats.dropped);
+  memcpy(&last, &udpstats, sizeof(struct udpstats));
+}
 
-  memcpy(&(info->addr), addr, ADDRSIZE);
-  memcpy(&(info->taddr), taddr, ADDRSIZE);
-  return info;
+/*
+ Borrow a buffer of class fitting @size, from pool of current worker.
+*/
+struct udpbuffer*
+udpbuffer_new(size_t size)
+{
+  size_t cls = (size <= UDPPEER_BUF_MTU) ? 0 : 1;
+  size_t clssize = cls ? UDPPEER_BUF_SIZE : UDPPEER_BUF_MTU;
+  struct pool *pl = &(udpbufpools[cls]);
+  if(pl->objsize == 0)
+    pool_init(pl, sizeof(struct udpbuffer) + clssize, opts.poolsize, opts.hugepage);
+
+  struct udpbuffer *buf = (struct udpbuffer*) pool_get(pl);
+  if(buf == NULL) return NULL;
+  memset(buf, 0, sizeof(struct udpbuffer));
+  buf->dat = ((unsigned char*) buf) + sizeof(struct udpbuffer);
+  buf->size = clssize;
+  return buf;
 }
 
 
 void
-routeinfo_free(struct routeinfo **info)
+udpbuffer_free(struct udpbuffer **buf)
 {
-  if(info == NULL || *info == NULL) return;
+  if(buf == NULL || *buf == NULL) return;
+  pool_put(*buf);
+  *buf = NULL;
+}
 
-  free(*info);
-  *info = NULL;
+
+static void
+pktqueue_init(struct pktqueue *q, struct udpbuffer **bufs, size_t capa)
+{
+  q->bufs = bufs;
+  q->head = q->len = 0;
+  q->capa = capa;
 }
 
 
 /*
-  Create new udppeer, without init member @routes and @w_buf.
+ @Return: 0 when queued, -1 when full.
+*/
+static int
+pktqueue_push(struct pktqueue *q, struct udpbuffer *buf)
+{
+  if(q->len == q->capa) return -1;
+  q->bufs[(q->head + q->len) % q->capa] = buf;
+  q->len ++;
+  return 0;
+}
+
+
+/*
+ Get the @i-th pkt from head, without removing it.
+*/
+static struct udpbuffer*
+pktqueue_peek(const struct pktqueue *q, size_t i)
+{
+  if(i >= q->len) return NULL;
+  return q->bufs[(q->head + i) % q->capa];
+}
+
+
+static struct udpbuffer*
+pktqueue_pop(struct pktqueue *q)
+{
+  if(q->len == 0) return NULL;
+  struct udpbuffer *buf = q->bufs[q->head];
+  q->head = (q->head + 1) % q->capa;
+  q->len --;
+  return buf;
+}
+
+
+/*
+ Drop all pkts in @q.
+*/
+static void
+pktqueue_clear(struct pktqueue *q)
+{
+  struct udpbuffer *buf;
+  while((buf = pktqueue_pop(q)) != NULL) udpbuffer_free(&buf);
+}
+
+
+/*
+  Create new udppeer, without init member @routes.
 */
 struct udppeer*
 udppeer_new(const struct sockaddr_in *baddr, const struct sockaddr_in *addr)
@@ -99,16 +264,23 @@ udppeer_new(const struct sockaddr_in *baddr, const struct sockaddr_in *addr)
   int fd = tsocket(SOCK_DGRAM, baddr);
   if(fd < 0) return NULL;
 
-  // Create udp peer, DO NOT initialize @routes and @w_buf.
-  pr = (struct udppeer*)
-    calloc(sizeof(struct udppeer) + sizeof(struct udpbuffer) + UDPPEER_BUF_SIZE, 1);
+  // Create udp peer along with slots of its queues, DO NOT initialize @routes.
+  // Buffer is borrowed only when a pkt recv, see udppeer_rready(...).
+  size_t nslot = opts.batch + opts.qdepth;
+  if(udppool.objsize == 0)
+    pool_init(&udppool, sizeof(struct udppeer) + nslot * sizeof(struct udpbuffer*),
+	      opts.poolsize, opts.hugepage);
+  pr = (struct udppeer*) pool_get(&udppool);
   if(pr == NULL){ error("create udppeer failed"); goto onfail; }
+  memset(pr, 0, sizeof(struct udppeer));
+
+  struct udpbuffer **slots = (struct udpbuffer**) (pr + 1);
+  pktqueue_init(&(pr->r_q), slots, opts.batch);
+  pktqueue_init(&(pr->w_q), slots + opts.batch, opts.qdepth);
 
+  pr->ev.type = EVSRC_UDPPEER;
   pr->socket = fd;
   pr->lact = time(NULL);
-  pr->r_buf = (struct udpbuffer*) (((unsigned char*) pr) + sizeof(struct udppeer));
-  pr->r_buf->dat = ((unsigned char*) (pr->r_buf)) + sizeof(struct udpbuffer);
-  pr->r_buf->size = UDPPEER_BUF_SIZE;
 
   // Get binded address via getsockname, useful when port is zero.
   socklen_t baddrlen = ADDRSIZE;
@@ -121,7 +293,7 @@ udppeer_new(const struct sockaddr_in *baddr, const struct sockaddr_in *addr)
 
  onfail:
   close(fd);
-  if(pr != NULL) free(pr);  
+  if(pr != NULL) pool_put(pr);
   return NULL;
 }
 
@@ -132,303 +304,648 @@ udppeer_free(struct udppeer **pr)
   if(pr == NULL || *pr == NULL) return;
 
   close((*pr)->socket);
-  if((*pr)->routes != NULL){
-    for(size_t i=0; i<(*pr)->routes->_size; i++){
-      struct routeinfo *i_info = (struct routeinfo*) (*pr)->routes->_warehouse[i];
-      routeinfo_free(&i_info);
-    }
-    ary_free(&((*pr)->routes));
-  }
+  routemap_free(&((*pr)->routes));
 
-  free(*pr);
+  pktqueue_clear(&((*pr)->r_q));
+  pktqueue_clear(&((*pr)->w_q));
+  pool_put(*pr);
   *pr = NULL;
 }
 
 
-/* Called when udppeer recv READ event. */
-void
+/*
+ Called when udppeer recv READ event, read pkts into free slots of r_q by
+ one recvmmsg(...), at most opts.batch pkts.
+
+ @Return: count of pkts accepted in r_q.
+*/
+int
 udppeer_rready(struct udppeer *pr)
 {
-  // No action when buffer not empty.
-  if(pr->r_buf->datlen) return;
+  size_t nbuf = pr->r_q.capa - pr->r_q.len;
+  if(nbuf == 0) return 0;
+
+  if(udpscratch == NULL &&
+     (udpscratch = (unsigned char*) malloc(opts.batch * UDPPEER_OVERFLOW)) == NULL){
+    error("no scratch to read udppeer(fd: %d)", pr->socket);
+    return 0;
+  }
 
-  int hasorigdst;
-  ssize_t brecv = socket_recvmsg(pr->socket, pr->r_buf->dat, pr->r_buf->size,
-				 &(pr->r_buf->src), &hasorigdst, &(pr->r_buf->dst));
-  if(brecv < 0){
-    if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+  // Borrow buffers of small class, pkt larger than it overflows into scratch.
+  struct udpbuffer *bufs[UDPPEER_BATCH_MAX];
+  struct mmsghdr msgs[UDPPEER_BATCH_MAX];
+  struct iovec vecs[UDPPEER_BATCH_MAX][2];
+  unsigned char ctlbufs[UDPPEER_BATCH_MAX][UDPPEER_CTLBUF];
+  for(size_t i=0; i<nbuf; i++){
+    if((bufs[i] = udpbuffer_new(UDPPEER_BUF_MTU)) == NULL){ nbuf = i; break; }
+    vecs[i][0].iov_base = bufs[i]->dat;
+    vecs[i][0].iov_len = bufs[i]->size;
+    vecs[i][1].iov_base = udpscratch + i * UDPPEER_OVERFLOW;
+    vecs[i][1].iov_len = UDPPEER_OVERFLOW;
+
+    struct msghdr *i_msg = &(msgs[i].msg_hdr);
+    i_msg->msg_name = &(bufs[i]->src);
+    i_msg->msg_namelen = ADDRSIZE;
+    i_msg->msg_iov = vecs[i];
+    i_msg->msg_iovlen = 2;
+    i_msg->msg_control = ctlbufs[i];
+    i_msg->msg_controllen = UDPPEER_CTLBUF;
+    i_msg->msg_flags = 0;
+  }
+  if(nbuf == 0){ error("no buffer to read udppeer(fd: %d)", pr->socket); return 0; }
+
+  int nrecv = recvmmsg(pr->socket, msgs, nbuf, MSG_DONTWAIT, NULL);
+  if(nrecv <= 0){
+    for(size_t i=0; i<nbuf; i++) udpbuffer_free(&(bufs[i]));
+    if(nrecv == 0) return 0;
+    if(errno == EAGAIN || errno == EWOULDBLOCK){
+      pr->ev.events &= ~EPOLLIN;
+      return 0;
+    }
     error("read udppeer(fd: %d) failed", pr->socket);
-    return;
+    return 0;
   }
+  // Fewer pkts than asked, socket is drained, a new pkt triggers event again.
+  if((size_t) nrecv < nbuf) pr->ev.events &= ~EPOLLIN;
+
+  int accepted = 0;
+  for(size_t i=0; i<nbuf; i++){
+    struct udpbuffer *buf = bufs[i];
+    if(i >= (size_t) nrecv){ udpbuffer_free(&buf); continue; }
+
+    size_t brecv = msgs[i].msg_len;
+    if(msgs[i].msg_hdr.msg_namelen != ADDRSIZE){
+      error("unexpected len of msg_name %d on fd_%d",
+	    msgs[i].msg_hdr.msg_namelen, pr->socket);
+      udpbuffer_free(&buf);
+      continue;
+    }
+    debug("recv %ld bytes on fd_%d, src %x:%u", brecv, pr->socket, FADDR(&(buf->src)));
+
+    // Use current @baddr as @dst when no origin dst found.
+    int hasorigdst = msg_origdst(&(msgs[i].msg_hdr), &(buf->dst));
+    if(hasorigdst < 0){ udpbuffer_free(&buf); continue; }
+    if(! hasorigdst) memcpy(&(buf->dst), &(pr->baddr), ADDRSIZE);
+
+    // Move large pkt into buffer of large class, rarely happen.
+    if(brecv > buf->size){
+      struct udpbuffer *large = udpbuffer_new(brecv);
+      if(large == NULL){
+	error("no buffer for pkt(size: %ld) on fd_%d, data lost", brecv, pr->socket);
+	udpbuffer_free(&buf);
+	continue;
+      }
+      memcpy(&(large->src), &(buf->src), ADDRSIZE);
+      memcpy(&(large->dst), &(buf->dst), ADDRSIZE);
+      memcpy(large->dat, buf->dat, buf->size);
+      memcpy(((unsigned char*) large->dat) + buf->size, vecs[i][1].iov_base, brecv - buf->size);
+      udpbuffer_free(&buf);
+      buf = large;
+    }
 
-  // Use current @baddr as @dst when no origin dst found.
-  if(! hasorigdst) memcpy(&(pr->r_buf->dst), &(pr->baddr), ADDRSIZE);
+    // Accept it, never full since at most free slots read.
+    buf->datlen = brecv;
+    pktqueue_push(&(pr->r_q), buf);
+    accepted ++;
+  }
 
-  // Accept it.
-  pr->r_buf->datlen = brecv;
-  return;
+  if(accepted) pr->lact = time(NULL);
+  return accepted;
 }
 
 
 /*
-  Write data on @w_buf to @dst.
+  Send pkts in w_q to their @dst by one sendmmsg(...), at most opts.batch
+  pkts.
+
+  @Return: count of pkts released from w_q(sent or lost).
 */
-void
+int
 udppeer_wready(struct udppeer *pr)
 {
-  if(pr->w_buf == NULL) return;
+  size_t nbuf = pr->w_q.len;
+  if(nbuf == 0) return 0;
+  if(nbuf > opts.batch) nbuf = opts.batch;
+
+  struct mmsghdr msgs[UDPPEER_BATCH_MAX];
+  struct iovec vecs[UDPPEER_BATCH_MAX];
+  for(size_t i=0; i<nbuf; i++){
+    struct udpbuffer *i_buf = pktqueue_peek(&(pr->w_q), i);
+    vecs[i].iov_base = i_buf->dat;
+    vecs[i].iov_len = i_buf->datlen;
+
+    struct msghdr *i_msg = &(msgs[i].msg_hdr);
+    i_msg->msg_name = &(i_buf->dst);
+    i_msg->msg_namelen = ADDRSIZE;
+    i_msg->msg_iov = &(vecs[i]);
+    i_msg->msg_iovlen = 1;
+    i_msg->msg_control = NULL;
+    i_msg->msg_controllen = 0;
+    i_msg->msg_flags = 0;
+  }
 
-  ssize_t bsent = sendto(pr->socket, pr->w_buf->dat, pr->w_buf->datlen,
-			 MSG_DONTWAIT, &(pr->w_buf->dst), ADDRSIZE);
-  if(bsent < 0){
-    if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+  int nsent = sendmmsg(pr->socket, msgs, nbuf, MSG_DONTWAIT);
+  if(nsent < 0){
+    if(errno == EAGAIN || errno == EWOULDBLOCK){
+      pr->ev.events &= ~EPOLLOUT;
+      return 0;
+    }
+    // Failed on the first pkt, drop it.
+    struct udpbuffer *buf = pktqueue_pop(&(pr->w_q));
     error("send pkt(src: %x:%u, dst: %x:%u) on fd_%d failed, data lost",
-	  FADDR(&(pr->w_buf->src)), FADDR(&(pr->w_buf->dst)), pr->socket);
-    pr->w_buf->datlen = 0;
-    pr->w_buf = NULL;
-    return;
+	  FADDR(&(buf->src)), FADDR(&(buf->dst)), pr->socket);
+    udpbuffer_free(&buf);
+    return 1;
   }
-  debug("pkt(dst: %x:%u, fd: %d, size: %ld, sent: %ld) sent",
-	FADDR(&(pr->w_buf->dst)), pr->socket, pr->w_buf->datlen, bsent);
 
-  // Warn when bytes sent not expected.
-  if(bsent != pr->w_buf->datlen)
-    warn("data lost at pkt(dst: %x:%u, fd: %d, size: %ld, sent: %ld) sent",
-	 FADDR(&(pr->w_buf->dst)), pr->socket, pr->w_buf->datlen, bsent);
+  for(int i=0; i<nsent; i++){
+    struct udpbuffer *buf = pktqueue_pop(&(pr->w_q));
+    debug("pkt(dst: %x:%u, fd: %d, size: %ld, sent: %u) sent",
+	  FADDR(&(buf->dst)), pr->socket, buf->datlen, msgs[i].msg_len);
 
-  pr->w_buf->datlen = 0;
-  pr->w_buf = NULL;
-  return;
+    // Warn when bytes sent not expected.
+    if(msgs[i].msg_len != buf->datlen)
+      warn("data lost at pkt(dst: %x:%u, fd: %d, size: %ld, sent: %u) sent",
+	   FADDR(&(buf->dst)), pr->socket, buf->datlen, msgs[i].msg_len);
+    udpbuffer_free(&buf);
+  }
+
+  if(nsent) pr->lact = time(NULL);
+  return nsent;
 }
 
+
+/*
+ Record that pkt to @addr had been sent to @taddr, refresh the record of
+ @taddr when exists. Idle or least recently used record would be evicted
+ when set of @taddr is full and map reached ROUTEMAP_MAX.
+*/
 int
-addrouteinfo(struct array *routes,
+addrouteinfo(struct routemap *routes,
 	     const struct sockaddr_in *addr,
 	     const struct sockaddr_in *taddr)
 {
   if(routes == NULL || addr == NULL || taddr == NULL){ errno = EINVAL; return -1; }
 
-  // Check if same record exists.
-  for(size_t i=0; i<routes->_size; i++){
-    struct routeinfo *i_info = (struct routeinfo*) routes->_warehouse[i];
-    if(ISSAMEADDR(&(i_info->addr), addr) && ISSAMEADDR(&(i_info->taddr), taddr))
-      return 0;  // record exists.
-  }
+  time_t now = time(NULL);
+  while(1){
+    struct routeinfo *set = &(routes->infos[routemap_setidx(routes->nset, taddr) *
+					    ROUTEMAP_WAYS]);
+    struct routeinfo *empty = NULL, *lru = NULL;
+    for(size_t w=0; w<ROUTEMAP_WAYS; w++){
+      struct routeinfo *w_info = &(set[w]);
+      if(w_info->lact && now - w_info->lact > ROUTEINFO_TIMEOUT){
+	w_info->lact = 0;
+	udpstats.expired ++;
+      }
+      if(! w_info->lact){
+	if(empty == NULL) empty = w_info;
+	continue;
+      }
 
-  struct routeinfo *info = routeinfo_new(addr, taddr);
-  if(info == NULL) return -1;
+      if(ISSAMEADDR(&(w_info->taddr), taddr)){
+	// record exists.
+	memcpy(&(w_info->addr), addr, ADDRSIZE);
+	w_info->lact = now;
+	return 0;
+      }
+      if(lru == NULL || w_info->lact < lru->lact) lru = w_info;
+    }
 
-  if(ary_append(routes, info) < 0) return -1;
-  return 0;
+    if(empty == NULL){
+      // Set is full, grow the map until capped.
+      if(routes->nset * ROUTEMAP_WAYS < ROUTEMAP_MAX && routemap_grow(routes) == 0)
+	continue;
+      debug("evict route info %x:%u ~ %x:%u", FADDR(&(lru->addr)), FADDR(&(lru->taddr)));
+      udpstats.evicted ++;
+      empty = lru;
+    }
+
+    memcpy(&(empty->addr), addr, ADDRSIZE);
+    memcpy(&(empty->taddr), taddr, ADDRSIZE);
+    empty->lact = now;
+    return 0;
+  }
 }
 
 
 int
-getrouteinfo(const struct array *routes,
+getrouteinfo(struct routemap *routes,
 	     const struct sockaddr_in *taddr,
 	     struct sockaddr_in *addr)
 {
   if(routes == NULL || taddr == NULL || addr == NULL){ errno = EINVAL; return -1; }
 
-  for(size_t i=0; i<routes->_size; i++){
-    struct routeinfo *i_info = (struct routeinfo*) routes->_warehouse[i];
-    if(ISSAMEADDR(&(i_info->taddr), taddr)){
-      memcpy(addr, &(i_info->addr), ADDRSIZE);
-      return 0;
+  time_t now = time(NULL);
+  struct routeinfo *set = &(routes->infos[routemap_setidx(routes->nset, taddr) *
+					  ROUTEMAP_WAYS]);
+  for(size_t w=0; w<ROUTEMAP_WAYS; w++){
+    struct routeinfo *w_info = &(set[w]);
+    if(! w_info->lact || ! ISSAMEADDR(&(w_info->taddr), taddr)) continue;
+
+    if(now - w_info->lact > ROUTEINFO_TIMEOUT){
+      w_info->lact = 0;
+      udpstats.expired ++;
+      return -1;
     }
+    memcpy(addr, &(w_info->addr), ADDRSIZE);
+    w_info->lact = now;
+    return 0;
   }
   return -1;
 }
 
 
+struct peerset*
+peerset_new(int byaddr)
+{
+  struct peerset *ps = (struct peerset*) calloc(sizeof(struct peerset), 1);
+  if(ps == NULL) return NULL;
+
+  ps->byaddr = byaddr;
+  if((ps->list = ary_new()) == NULL || (ps->index = ht_new()) == NULL){
+    peerset_free(&ps);
+    return NULL;
+  }
+  return ps;
+}
+
+
 /*
- Find peer on condition.
+ Free the set, peers in it are NOT freed.
+*/
+void
+peerset_free(struct peerset **ps)
+{
+  if(ps == NULL || *ps == NULL) return;
+
+  ary_free(&((*ps)->list));
+  ht_free(&((*ps)->index));
+  free(*ps);
+  *ps = NULL;
+}
+
+
+/*
+ Key of peer in index, port of @baddr is ignored when keyed by @addr, since
+ r-side peers bind on random port.
+*/
+static void
+udppeer_key(struct udppeerkey *key,
+	    const struct sockaddr_in *baddr, const struct sockaddr_in *addr)
+{
+  key->bip = baddr->sin_addr.s_addr;
+  key->bport = (addr == NULL) ? baddr->sin_port : 0;
+  key->aip = (addr == NULL) ? 0 : addr->sin_addr.s_addr;
+  key->aport = (addr == NULL) ? 0 : addr->sin_port;
+}
+
+
+/*
+ Find peer binding on @baddr, and serving @addr when set keyed by addr.
 */
 struct udppeer*
-udppeer_find(const struct array *peers,
+udppeer_find(const struct peerset *peers,
 	     const struct sockaddr_in *baddr, const struct sockaddr_in *addr)
 {
-  if(peers == NULL || baddr == NULL){ errno = EINVAL; return NULL; }
+  if(peers == NULL || baddr == NULL || (peers->byaddr && addr == NULL)){
+    errno = EINVAL; return NULL;
+  }
+
+  struct udppeerkey key;
+  udppeer_key(&key, baddr, peers->byaddr ? addr : NULL);
+  return (struct udppeer*) ht_get(peers->index, &key, sizeof(key));
+}
+
 
-  for(size_t i=0; i<peers->_size; i++){
-    struct udppeer *i_pr = (struct udppeer*) peers->_warehouse[i];
-    if(ISSAMEADDR(&(i_pr->baddr), baddr)){
-      if(addr == NULL || ISSAMEADDR(&(i_pr->addr), addr)) return i_pr;	
+/*
+ Remove @pr from @peers, the peer itself is NOT freed.
+*/
+void
+udppeer_del(struct peerset *peers, struct udppeer *pr)
+{
+  struct udppeerkey key;
+  udppeer_key(&key, &(pr->baddr), peers->byaddr ? &(pr->addr) : NULL);
+  if(ht_get(peers->index, &key, sizeof(key)) == pr) ht_del(peers->index, &key, sizeof(key));
+  ary_del(peers->list, pr);
+}
+
+
+/*
+ Queue @pr on dirty list of reactor, when not yet.
+*/
+void
+udppeer_mark(struct reactor *rt, struct udppeer *pr)
+{
+  if(pr->pending) return;
+  if(ary_append(rt->udpdirty, pr) < 0){
+    error("could not queue udppeer(fd: %d)", pr->socket);
+    return;
+  }
+  pr->pending = 1;
+}
+
+
+/*
+ Append new peer @pr to @peers, index it, then register it on reactor.
+*/
+int
+udppeer_add(struct reactor *rt, struct peerset *peers, struct udppeer *pr)
+{
+  struct udppeerkey key;
+  udppeer_key(&key, &(pr->baddr), peers->byaddr ? &(pr->addr) : NULL);
+  if(ary_append(peers->list, pr) < 0) return -1;
+  if(ht_put(peers->index, &key, sizeof(key), pr) < 0 ||
+     reactor_add(rt, pr->socket, &(pr->ev)) < 0){
+    udppeer_del(peers, pr);
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+ Find l-side peer binding on @baddr to send pkt back to client, create a
+ new one when non existed.
+
+ @Return: NULL when failed or w_q of it full, pkt should be dropped.
+*/
+static struct udppeer*
+udppeer_lpeer(struct reactor *rt, struct peerset *lpeers, const struct sockaddr_in *baddr)
+{
+  struct udppeer *lp = udppeer_find(lpeers, baddr, NULL);
+  if(lp == NULL){
+    if((lp = udppeer_new(baddr, NULL)) == NULL ||
+       udppeer_add(rt, lpeers, lp) < 0){
+      warn("create l-peer(baddr: %x:%u) failed", FADDR(baddr));
+      // Free resource.
+      if(lp != NULL) udppeer_free(&lp);
+      return NULL;
     }
+    debug("new l-side peer(baddr: %x:%u) added", FADDR(baddr));
+  }else if(lp->w_q.len == lp->w_q.capa){
+    debug("queue of fd_%d full", lp->socket);
+    lp->dropped ++;
+    udpstats.dropped ++;
+    return NULL;
   }
-  return NULL;
+  return lp;
 }
 
 
-void
-udppeer_deliver(struct array *lpeers, struct array *rpeers)
-{
-  struct sockaddr_in nxtsrc, nxtdst;
-
-  // For each peer on l-side, process whose r-buf not empty.
-  for(size_t i=0; i<lpeers->_size; i++){
-    struct udppeer *i_lp = (struct udppeer*) lpeers->_warehouse[i];
-    if(! (i_lp->r_buf->datlen)) continue;
-    
-    // Get route, drop pkt when failed.
-    if(udp_route(i_lp->r_buf->dat, i_lp->r_buf->datlen, &(i_lp->r_buf->src),
-		 &(i_lp->r_buf->dst), &nxtsrc, &nxtdst) < 0){
-      error("drop pkt(src: %x:%u, dst: %x:%u) on fd_%d when route failed",
-	    FADDR(&(i_lp->r_buf->src)), FADDR(&(i_lp->r_buf->dst)), i_lp->socket);
-      i_lp->r_buf->datlen = 0;
-      continue;
+/*
+ Deliver the first pkt in r_q of l-side peer @lp to w_q of a r-side peer,
+ or answer it back from DNS cache via l-side peer, or drop it.
+*/
+static void
+udppeer_deliver_l2r(struct reactor *rt, struct udppeer *lp,
+		    struct peerset *lpeers, struct peerset *rpeers)
+{
+  struct udpbuffer *buf = pktqueue_peek(&(lp->r_q), 0);
+  struct sockaddr_in nxtsrc, nxtdst, altdst;
+
+  // Answered from cache, send it back as from origin dst.
+  size_t anslen = udp_answer(buf->dat, buf->datlen, buf->size, &(buf->src), &(buf->dst));
+  if(anslen > 0){
+    struct udppeer *ap = udppeer_lpeer(rt, lpeers, &(buf->dst));
+    if(ap == NULL){
+      debug("drop answer to %x:%u on fd_%d", FADDR(&(buf->src)), lp->socket);
+      goto ondrop;
     }
-    debug("udp_route(src: %x:%u, dst: %x:%u, nsrc: %x:%u, ndst: %x:%u",
-	  FADDR(&(i_lp->r_buf->src)), FADDR(&(i_lp->r_buf->dst)),
-	  FADDR(&nxtsrc), FADDR(&nxtdst));
-
-    // Find a r-side peer to send pkt, create a new one when non existed.
-    struct udppeer *i_rp = udppeer_find(rpeers, &nxtsrc, &(i_lp->r_buf->src));
-    if(i_rp == NULL){
-      // Create a new r-side peer to send the pkt, drop it when failed.
-      if((i_rp = udppeer_new(&nxtsrc, &(i_lp->r_buf->src))) == NULL ||
-	 (i_rp->routes = ary_new()) == NULL ||
-	 ary_append(rpeers, i_rp) < 0){
-	error("creat r-side peer for pkt(src: %x:%u, dst: %x:%u) on fd_%d failed",
-	      FADDR(&(i_lp->r_buf->src)), FADDR(&(i_lp->r_buf->dst)), i_lp->socket);
-	i_lp->r_buf->datlen = 0;
-	// free resource.
-	if(i_rp != NULL){
-	  if(i_rp->routes != NULL) ary_free(&i_rp->routes);
-	  ary_del(rpeers, i_rp);
-	  udppeer_free(&i_rp);
-	}
-	continue;
-      }
-      debug("new r-side peer(baddr: %x:%u, addr: %x:%u) added",
-	    FADDR(&(i_rp->baddr)), FADDR(&(i_rp->addr)));
-    }else if(i_rp->w_buf != NULL) continue;
-
-    // Bind w_buf on r-side to r_buf on l-side,
-    // then save route info in @routes at r-side.
-    if(addrouteinfo(i_rp->routes, &(i_lp->r_buf->dst), &nxtdst) < 0){
-      error("failed to add route info %x:%u ~ %x:%u on fd_%d, data lost",
-	    FADDR(&(i_lp->r_buf->dst)), FADDR(&nxtdst), i_rp->socket);
-      i_lp->r_buf->datlen = 0;
-      continue;
+    buf->datlen = anslen;
+    memcpy(&(buf->dst), &(buf->src), ADDRSIZE);
+    pktqueue_push(&(ap->w_q), pktqueue_pop(&(lp->r_q)));
+    udppeer_mark(rt, ap);
+    return;
+  }
+
+  // Get route, drop pkt when failed, or when it waits for response of
+  // the identical query in flight.
+  int routed = udp_route(buf->dat, buf->datlen, &(buf->src),
+			 &(buf->dst), &nxtsrc, &nxtdst, &altdst);
+  if(routed < 0){
+    error("drop pkt(src: %x:%u, dst: %x:%u) on fd_%d when route failed",
+	  FADDR(&(buf->src)), FADDR(&(buf->dst)), lp->socket);
+    goto ondrop;
+  }
+  if(routed > 0) goto ondrop;
+  debug("udp_route(src: %x:%u, dst: %x:%u, nsrc: %x:%u, ndst: %x:%u",
+	FADDR(&(buf->src)), FADDR(&(buf->dst)),
+	FADDR(&nxtsrc), FADDR(&nxtdst));
+
+  // Find a r-side peer to send pkt, create a new one when non existed.
+  struct udppeer *rp = udppeer_find(rpeers, &nxtsrc, &(buf->src));
+  if(rp == NULL){
+    // Create a new r-side peer to send the pkt, drop it when failed.
+    if((rp = udppeer_new(&nxtsrc, &(buf->src))) == NULL ||
+       (rp->routes = routemap_new()) == NULL ||
+       udppeer_add(rt, rpeers, rp) < 0){
+      error("creat r-side peer for pkt(src: %x:%u, dst: %x:%u) on fd_%d failed",
+	    FADDR(&(buf->src)), FADDR(&(buf->dst)), lp->socket);
+      // free resource.
+      if(rp != NULL) udppeer_free(&rp);
+      goto ondrop;
     }
-    
-    // Change dst of pkt.
-    memcpy(&(i_lp->r_buf->dst), &nxtdst, ADDRSIZE);
-    i_rp->w_buf = i_lp->r_buf;
+    debug("new r-side peer(baddr: %x:%u, addr: %x:%u) added",
+	  FADDR(&(rp->baddr)), FADDR(&(rp->addr)));
+  }else if(rp->w_q.len == rp->w_q.capa){
+    debug("drop pkt(src: %x:%u, dst: %x:%u) on fd_%d when queue of fd_%d full",
+	  FADDR(&(buf->src)), FADDR(&(buf->dst)), lp->socket, rp->socket);
+    rp->dropped ++;
+    udpstats.dropped ++;
+    goto ondrop;
+  }
+
+  // Save route info in @routes at r-side, then move pkt to w_q on r-side.
+  if(addrouteinfo(rp->routes, &(buf->dst), &nxtdst) < 0){
+    error("failed to add route info %x:%u ~ %x:%u on fd_%d, data lost",
+	  FADDR(&(buf->dst)), FADDR(&nxtdst), rp->socket);
+    goto ondrop;
+  }
+
+  // Race a copy to another upstream, response of which goes back the same
+  // way, skipped when no room.
+  struct udpbuffer *copy = NULL;
+  if(altdst.sin_port != 0 && rp->w_q.len + 1 < rp->w_q.capa &&
+     addrouteinfo(rp->routes, &(buf->dst), &altdst) == 0 &&
+     (copy = udpbuffer_new(buf->datlen)) != NULL){
+    memcpy(copy->dat, buf->dat, buf->datlen);
+    copy->datlen = buf->datlen;
+    memcpy(&(copy->src), &(buf->src), ADDRSIZE);
+    memcpy(&(copy->dst), &altdst, ADDRSIZE);
+  }
+
+  // Change dst of pkt.
+  memcpy(&(buf->dst), &nxtdst, ADDRSIZE);
+  pktqueue_push(&(rp->w_q), pktqueue_pop(&(lp->r_q)));
+  if(copy != NULL) pktqueue_push(&(rp->w_q), copy);
+  udppeer_mark(rt, rp);
+  return;
+
+ ondrop:
+  buf = pktqueue_pop(&(lp->r_q));
+  udpbuffer_free(&buf);
+}
+
+
+/*
+ Deliver the first pkt in r_q of r-side peer @rp back to w_q of a l-side
+ peer, or drop it.
+*/
+static void
+udppeer_deliver_r2l(struct reactor *rt, struct udppeer *rp, struct peerset *lpeers)
+{
+  struct udpbuffer *buf = pktqueue_peek(&(rp->r_q), 0);
+  struct sockaddr_in nxtsrc;
+
+  // Get route info from @routes.
+  if(getrouteinfo(rp->routes, &(buf->src), &nxtsrc) < 0){
+    warn("drop pkt(src: %x:%u) on fd_%d when get route info failed",
+	 FADDR(&(buf->src)), rp->socket);
+    goto ondrop;
   }
 
-  // For each peer on r-side, process whose r_buf not empty.
-  for(size_t i=0; i<rpeers->_size; i++){
-    struct udppeer *i_rp = (struct udppeer*) rpeers->_warehouse[i];
-    if(! (i_rp->r_buf->datlen)) continue;
+  // Find a l-side peer to send the pkt, create a new one when non existed.
+  struct udppeer *lp = udppeer_lpeer(rt, lpeers, &nxtsrc);
+  if(lp == NULL){
+    debug("drop pkt(src: %x:%u) on fd_%d", FADDR(&(buf->src)), rp->socket);
+    goto ondrop;
+  }
 
-    // Get route info from @routes.
-    if(getrouteinfo(i_rp->routes, &(i_rp->r_buf->src), &nxtsrc) < 0){
-      warn("drop pkt(src: %x:%u) on fd_%d when get route info failed",
-	   FADDR(&(i_rp->r_buf->src)), i_rp->socket);
-      i_rp->r_buf->datlen = 0;
+  // Change dst of pkt.
+  memcpy(&(buf->dst), &(rp->addr), ADDRSIZE);
+  pktqueue_push(&(lp->w_q), pktqueue_pop(&(rp->r_q)));
+  udppeer_mark(rt, lp);
+
+  // Hook DNS response.
+  udp_route2(buf->dat, buf->datlen, &(buf->src), &(buf->dst));
+
+  // Fan response out to clients waiting on the same query, each as from
+  // its origin dst, with its own id.
+  struct dnswaiter waiters[DNSFLIGHT_WAITERS];
+  size_t nwaiter = udp_waiters(buf->dat, buf->datlen, &nxtsrc, &(buf->dst), waiters);
+  for(size_t i=0; i<nwaiter; i++){
+    struct dnswaiter *i_waiter = &(waiters[i]);
+    struct udppeer *wp = udppeer_lpeer(rt, lpeers, &(i_waiter->origdst));
+    struct udpbuffer *copy;
+    if(wp == NULL || (copy = udpbuffer_new(buf->datlen)) == NULL){
+      debug("drop response to %x:%u", FADDR(&(i_waiter->addr)));
       continue;
     }
+    memcpy(copy->dat, buf->dat, buf->datlen);
+    copy->datlen = buf->datlen;
+    memcpy(&(copy->src), &(buf->src), ADDRSIZE);
+    memcpy(&(copy->dst), &(i_waiter->addr), ADDRSIZE);
+    ((struct dnshdr*) copy->dat)->id = i_waiter->id;
+    pktqueue_push(&(wp->w_q), copy);
+    udppeer_mark(rt, wp);
+  }
+  return;
+
+ ondrop:
+  buf = pktqueue_pop(&(rp->r_q));
+  udpbuffer_free(&buf);
+}
 
-    // Find a l-side peer to send the pkt, create a new one when non existed.
-    struct udppeer *i_lp = udppeer_find(lpeers, &nxtsrc, NULL);
-    if(i_lp == NULL){
-      if((i_lp = udppeer_new(&nxtsrc, NULL)) == NULL ||
-	 ary_append(lpeers, i_lp) < 0){
-	warn("drop pkt(src: %x:%u) on fd_%d when create l-peer(baddr: %x:%u) failed",
-	   FADDR(&(i_rp->r_buf->src)), i_rp->socket, FADDR(&nxtsrc));
-	i_rp->r_buf->datlen = 0;
-	// Free resource.
-	if(i_lp != NULL){
-	  ary_del(lpeers, i_lp);
-	  udppeer_free(&i_lp);
-	}
-	continue;
-      }
-      debug("new l-side peer(baddr: %x:%u) added", FADDR(&nxtsrc));
-    }else if(i_lp->w_buf != NULL) continue;
 
-    // Change dst of pkt.
-    memcpy(&(i_rp->r_buf->dst), &(i_rp->addr), ADDRSIZE);
-    i_lp->w_buf = i_rp->r_buf;
+/*
+ Deliver pkts held by peers on held list, l-side peers to r-side and r-side
+ peers(with @routes) back to l-side, in order. Pkt to a peer whose w_q is
+ full is dropped, so r_q is always drained and a slow target never stalls
+ other clients behind the same source.
+*/
+void
+udppeer_deliver(struct reactor *rt, struct peerset *lpeers, struct peerset *rpeers)
+{
+  struct array *held = rt->udpheld;
 
-    // Hook DNS response.
-    udp_route2(i_rp->r_buf->dat, i_rp->r_buf->datlen,
-	       &(i_rp->r_buf->src), &(i_rp->r_buf->dst));
+  for(size_t i=0; i<held->_size; i++){
+    struct udppeer *i_pr = (struct udppeer*) held->_warehouse[i];
+    while(i_pr->r_q.len > 0){
+      if(i_pr->routes == NULL) udppeer_deliver_l2r(rt, i_pr, lpeers, rpeers);
+      else udppeer_deliver_r2l(rt, i_pr, lpeers);
+    }
+
+    // Peer would read again once r_q drained.
+    i_pr->held = 0;
+    udppeer_mark(rt, i_pr);
   }
+  held->_size = 0;
 }
 
 
 /*
- Track peer on status of r_buf and w_buf, remove peer when
- 1). NOT the first one.(usually live forever).
- 2). NO WRITE track
- 3). timeout.
-
-@return: max fd to be tracked.
+ Invoke RW handler on peers on dirty list, peer got pkts would be held for
+ delivering, peer whose r_q has room again would be marked to read again.
 */
-int
-udppeer_fillfdset(struct array **peers, size_t size, fd_set *rfds, fd_set *wfds)
+void
+udppeer_process(struct reactor *rt)
 {
-  int maxfd = 0;
-  time_t currtime = time(NULL);
-  
+  struct array *dirty = rt->udpdirty;
+  size_t size = dirty->_size, left = 0;
+
   for(size_t i=0; i<size; i++){
-    size_t j = -1;
-    while(++j < peers[i]->_size){
-      struct udppeer *ij_pr = (struct udppeer*) peers[i]->_warehouse[j];
-      int ij_fd = ij_pr->socket, tr = 0, tw = 0;
-
-      // Track READ when r_buf is empty.
-      if(! (ij_pr->r_buf->datlen)){
-	FD_SET(ij_fd, rfds);
-	tr = 1;
-      }
+    struct udppeer *i_pr = (struct udppeer*) dirty->_warehouse[i];
+    i_pr->pending = 0;
 
-      // Track WRITE when w_buf not NULL.
-      if(ij_pr->w_buf != NULL){
-	FD_SET(ij_fd, wfds);
-	tw = 1;
-      }
+    if((i_pr->ev.events & EPOLLOUT) && i_pr->w_q.len > 0){
+      udppeer_wready(i_pr);
+      // More than a batch queued, continue on next loop.
+      if((i_pr->ev.events & EPOLLOUT) && i_pr->w_q.len > 0) udppeer_mark(rt, i_pr);
+    }
 
-      // Remove timeout peer.
-      if((i+j != 0) && (! tw) && (currtime - ij_pr->lact > UDPPEER_TIMEOUT)){
-	debug("remove fd_%d when timeout", ij_pr->socket);
-	FD_CLR(ij_pr->socket, rfds); // make sure not track anymore.
-	ary_del(peers[i], ij_pr);
-	udppeer_free(&ij_pr);
-	--j;
+    if((i_pr->ev.events & EPOLLIN) && i_pr->r_q.len < i_pr->r_q.capa){
+      if(! udppeer_rready(i_pr)){
+	// Nothing accepted, try again on next loop unless drained.
+	if(i_pr->ev.events & EPOLLIN) udppeer_mark(rt, i_pr);
+	continue;
       }
-
-      if(tr || tw){
-	if(ij_fd > maxfd) maxfd = ij_fd;
-	debug("track fd_%d on R(%d), W(%d)", ij_fd, tr, tw);
+      if(i_pr->held) continue;
+      if(ary_append(rt->udpheld, i_pr) < 0){
+	error("could not hold pkts on fd_%d, data lost", i_pr->socket);
+	pktqueue_clear(&(i_pr->r_q));
+	udppeer_mark(rt, i_pr);
+	continue;
       }
+      i_pr->held = 1;
     }
   }
 
-  return maxfd;
+  // Keep peers marked during processing.
+  for(size_t i=size; i<dirty->_size; i++)
+    dirty->_warehouse[left++] = dirty->_warehouse[i];
+  dirty->_size = left;
 }
 
 
+/*
+ Remove peer when
+ 1). NOT the first one.(usually live forever).
+ 2). NOT referenced by reactor, and no pkt queued.
+ 3). timeout.
+*/
 void
-udppeer_checkevent(struct array **peers, size_t size, fd_set *rfds, fd_set *wfds)
+udppeer_sweep(struct peerset **peers, size_t size)
 {
-  // Invoke RW event handler, then update last active time.
+  time_t currtime = time(NULL);
+
   for(size_t i=0; i<size; i++){
-    for(size_t j=0; j<peers[i]->_size; j++){
-      struct udppeer *ij_pr = (struct udppeer*) peers[i]->_warehouse[j];
-      if(FD_ISSET(ij_pr->socket, rfds)){
-	udppeer_rready(ij_pr);
-	ij_pr->lact = time(NULL);
-      }
-      
-      if(FD_ISSET(ij_pr->socket, wfds)){
-	udppeer_wready(ij_pr);
-	ij_pr->lact = time(NULL);
+    struct array *i_list = peers[i]->list;
+    size_t left = 0;
+    for(size_t j=0; j<i_list->_size; j++){
+      struct udppeer *ij_pr = (struct udppeer*) i_list->_warehouse[j];
+      if((i+j != 0) && ! (ij_pr->pending) && ! (ij_pr->held) &&
+	 ij_pr->w_q.len == 0 && ij_pr->r_q.len == 0 &&
+	 (currtime - ij_pr->lact > UDPPEER_TIMEOUT)){
+	debug("remove fd_%d when timeout", ij_pr->socket);
+	struct udppeerkey key;
+	udppeer_key(&key, &(ij_pr->baddr), peers[i]->byaddr ? &(ij_pr->addr) : NULL);
+	ht_del(peers[i]->index, &key, sizeof(key));
+	udppeer_free(&ij_pr);
+	continue;
       }
+      i_list->_warehouse[left++] = ij_pr;
     }
+    i_list->_size = left;
   }
 }
-
@@ -4,10 +4,22 @@
 #include "common.h"
 
 
-#define UDPPEER_BUF_SIZE   0xFFFF
+#define UDPPEER_BUF_SIZE   0xFFFF  // size of buffer in large class.
+#define UDPPEER_BUF_MTU    1500    // size of buffer in small class.
 #define UDPPEER_TIMEOUT    300   // seconds.
+#define UDPPEER_SWEEP      5     // seconds, interval to remove timeout peers.
+#define UDPPEER_BATCH_MAX  64    // max pkts per recvmmsg/sendmmsg.
 
+#define ROUTEMAP_WAYS      4     // route info per set of map.
+#define ROUTEMAP_MAX       256   // max route info per map.
+#define ROUTEINFO_TIMEOUT  120   // seconds, idle route info would be expired.
 
+
+/*
+ Buffer of a pkt in flight, borrowed from size classes by a peer when pkt
+ recv, moved from r_q of it to w_q of target peer when delivered, and given
+ back once pkt sent or dropped.
+*/
 struct udpbuffer{
   struct sockaddr_in src, dst;
   void *dat;
@@ -15,28 +27,75 @@ struct udpbuffer{
 };
 
 
+/*
+ Bounded FIFO of pkts, ring of slots.
+
+@bufs: @capa slots, allocated along with the owner peer.
+@head: index of the first pkt.
+@len: count of pkts queued.
+*/
+struct pktqueue{
+  struct udpbuffer **bufs;
+  size_t head, len, capa;
+};
+
+
 /*
  UDP peer.
 
+@ev: event source registered on reactor, MUST be the first member.
+@pending: 1 when queued on dirty list of reactor.
+@held: 1 when queued on held list of reactor, i.e. pkts in r_q not delivered.
 @lact: last active time, get from time(...).
 @baddr: real binding address, get from getsockname(...).
 @addr: address of origin source on l-side. [r-side only].
 
-@routes: list of route info about all out pkts, use to lookup back-path
+@routes: map of route info about out pkts, use to lookup back-path
   when recv pkt. [r-side only].
 
-@r_buf: A real buffer store pkt recv.
-@w_buf: Just a pointer, reference to some r_buf on other side.
+@r_q: pkts recv by last batch, waiting to be delivered to other side.
+@w_q: pkts delivered from other side, waiting to be sent, at most
+  opts.qdepth. Pkt is dropped when it's full, instead of stalling r_q of
+  source, which may be shared by many clients.
+@dropped: count of pkts dropped when @w_q full.
 */
 struct udppeer{
+  struct evsrc ev;
+  unsigned pending, held;
   int socket;
   time_t lact;
   struct sockaddr_in baddr, addr;
   
-  struct array *routes;
+  struct routemap *routes;
 
-  struct udpbuffer *r_buf;
-  struct udpbuffer *w_buf;
+  struct pktqueue r_q, w_q;
+  unsigned long dropped;
+};
+
+
+/*
+ Peers on one side, listed for sweeping and indexed for lookup.
+
+@list: list of struct udppeer.
+@index: struct udppeer indexed by struct udppeerkey.
+@byaddr: 1 when peers are keyed by @addr as well, i.e. r-side.
+*/
+struct peerset{
+  struct array *list;
+  struct htable *index;
+  int byaddr;
+};
+
+
+/*
+ Key of peer in index of peerset.
+
+@bip, @bport: binding address, @bport is zero when keyed by addr.
+@aip, @aport: address of origin source on l-side, zero when not keyed by addr.
+*/
+struct udppeerkey{
+  unsigned bip, aip;
+  unsigned short bport, aport;
 };
 
 
@@ -45,22 +104,58 @@ struct udppeer{
 
 @addr: the origin dst.
 @taddr: the transform dst.
+@lact: last active time, zero when unused.
 */
 struct routeinfo{
   struct sockaddr_in addr, taddr;
+  time_t lact;
+};
+
+
+/*
+ Return-path map keyed by @taddr, set associative with ROUTEMAP_WAYS route
+ info per set, grows until ROUTEMAP_MAX then evicts least recently used.
+
+@nset: count of sets, power of 2.
+@infos: @nset * ROUTEMAP_WAYS route info.
+*/
+struct routemap{
+  size_t nset;
+  struct routeinfo *infos;
+};
+
+
+/*
+ Counters of UDP path, per worker.
+
+@evicted: route info evicted when return-path map full.
+@expired: route info dropped when idle for ROUTEINFO_TIMEOUT.
+@dropped: pkts dropped when w_q of target peer full.
+*/
+struct udpstats{
+  unsigned long evicted, expired, dropped;
 };
 
 
 ssize_t
 socket_recvmsg(int fd,
-	       void *buf, size_t buflen, struct sockaddr_in *src,
+	       struct iovec *vec, size_t veclen, struct sockaddr_in *src,
 	       int *hasorigdst, struct sockaddr_in *origdst);
 
-struct routeinfo*
-routeinfo_new(const struct sockaddr_in *addr, const struct sockaddr_in *taddr);
+struct udpbuffer*
+udpbuffer_new(size_t size);
 
 void
-routeinfo_free(struct routeinfo **info);
+udpbuffer_free(struct udpbuffer **buf);
+
+struct routemap*
+routemap_new(void);
+
+void
+routemap_free(struct routemap **map);
+
+void
+udpstats_report(unsigned id);
 
 struct udppeer*
 udppeer_new(const struct sockaddr_in *baddr, const struct sockaddr_in *addr);
@@ -68,37 +163,49 @@ udppeer_new(const struct sockaddr_in *baddr, const struct sockaddr_in *addr);
 void
 udppeer_free(struct udppeer **pr);
 
-void
+int
 udppeer_rready(struct udppeer *pr);
 
-void
+int
 udppeer_wready(struct udppeer *pr);
 
+void
+udppeer_mark(struct reactor *rt, struct udppeer *pr);
+
 int
-addrouteinfo(struct array *routes,
+udppeer_add(struct reactor *rt, struct peerset *peers, struct udppeer *pr);
+
+void
+udppeer_del(struct peerset *peers, struct udppeer *pr);
+
+struct peerset*
+peerset_new(int byaddr);
+
+void
+peerset_free(struct peerset **ps);
+
+int
+addrouteinfo(struct routemap *routes,
 	     const struct sockaddr_in *addr,
 	     const struct sockaddr_in *taddr);
 
 int
-getrouteinfo(const struct array *routes,
+getrouteinfo(struct routemap *routes,
 	     const struct sockaddr_in *taddr,
 	     struct sockaddr_in *addr);
 
 struct udppeer*
-udppeer_find(const struct array *peers,
+udppeer_find(const struct peerset *peers,
 	     const struct sockaddr_in *baddr, const struct sockaddr_in *addr);
 
 void
-udppeer_deliver(struct array *lpeers, struct array *rpeers);
-
-int
-udppeer_fillfdset(struct array **peers, size_t size, fd_set *rfds, fd_set *wfds);
+udppeer_deliver(struct reactor *rt, struct peerset *lpeers, struct peerset *rpeers);
 
 void
-udppeer_checkevent(struct array **peers, size_t size, fd_set *rfds, fd_set *wfds);
+udppeer_process(struct reactor *rt);
 
 void
-udppeer_deliver(struct array *lpeers, struct array *rpeers);
+udppeer_sweep(struct peerset **peers, size_t size);
 
 
 #endif
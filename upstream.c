@@ -0,0 +1,159 @@
+#include "upstream.h"
+
+
+int
+upstats_init(struct upstats *s)
+{
+  if(s == NULL){ errno = EINVAL; return -1; }
+
+  memset(s, 0, sizeof(struct upstats));
+  if((s->index = ht_new()) == NULL) return -1;
+  if((s->list = ary_new()) == NULL){
+    ht_free(&(s->index));
+    return -1;
+  }
+  return 0;
+}
+
+
+/*
+ @Return: state of upstream @ip, created when not yet and @create set, or
+   NULL.
+*/
+struct upstat*
+upstats_get(struct upstats *s, unsigned ip, int create)
+{
+  struct upstat *st = (struct upstat*) ht_get(s->index, &ip, sizeof(ip));
+  if(st != NULL || ! create) return st;
+
+  if((st = (struct upstat*) calloc(sizeof(struct upstat), 1)) == NULL) return NULL;
+  st->ip = ip;
+  if(ary_append(s->list, st) < 0){
+    free(st);
+    return NULL;
+  }
+  if(ht_put(s->index, &(st->ip), sizeof(st->ip), st) < 0){
+    s->list->_size --;
+    free(st);
+    return NULL;
+  }
+  return st;
+}
+
+
+/*
+ Mark upstream failing when queries not answered for UPSTREAM_TIMEOUT, one
+ lost is tolerated, and healthy again after UPSTREAM_RETRY to probe it.
+*/
+static void
+upstat_check(struct upstat *st, long now)
+{
+  if(st->failtime == 0){
+    if(st->unanswered < 2 || now - st->waiting <= UPSTREAM_TIMEOUT) return;
+    st->failtime = now;
+    st->failed ++;
+    warn("upstream %08X not answered %u queries in %ldms",
+	 st->ip, st->unanswered, now - st->waiting);
+    return;
+  }
+  if(now - st->failtime <= UPSTREAM_RETRY) return;
+  st->failtime = 0;
+  st->waiting = 0;
+  st->unanswered = 0;
+}
+
+
+/*
+ @Return: 1 when @a is preferred to @b, healthy first, then faster, the one
+   not measured is the fastest.
+*/
+static int
+upstat_better(const struct upstat *a, const struct upstat *b)
+{
+  if(b == NULL) return 1;
+  if((a->failtime == 0) != (b->failtime == 0)) return a->failtime == 0;
+  return a->srtt < b->srtt;
+}
+
+
+/*
+ Pick one of upstreams @ips, @n in all, the fastest healthy one, or every
+ UPSTREAM_PROBE queries the next healthy one in turn, to keep RTT of all
+ measured. Upstream untracked is taken as healthy and fast.
+
+ @Return: ip picked.
+*/
+unsigned
+upstream_pick(struct upstats *s, const unsigned *ips, size_t n, long now)
+{
+  if(n == 1) return ips[0];
+
+  unsigned long nquery = s->nquery++;
+  struct upstat *best = NULL;
+  unsigned bestip = ips[0];
+  for(size_t i=0; i<n; i++){
+    struct upstat *i_st = upstats_get(s, ips[i], 1);
+    if(i_st == NULL) return ips[i];
+    upstat_check(i_st, now);
+    if(upstat_better(i_st, best)){
+      best = i_st;
+      bestip = ips[i];
+    }
+  }
+
+  if(nquery % UPSTREAM_PROBE == UPSTREAM_PROBE - 1){
+    struct upstat *st = upstats_get(s, ips[(nquery / UPSTREAM_PROBE) % n], 0);
+    if(st != NULL && st->failtime == 0) return st->ip;
+  }
+  return bestip;
+}
+
+
+/*
+ Pick another upstream to race @ip, when query to @ip not answered beyond
+ its deadline, twice its RTT at least UPSTREAM_RACE_MIN.
+
+ @Return: the fastest healthy one but @ip, or 0 when no need or none.
+*/
+unsigned
+upstream_race(struct upstats *s, const unsigned *ips, size_t n, unsigned ip, long now)
+{
+  struct upstat *st = upstats_get(s, ip, 0);
+  if(n == 1 || st == NULL || st->waiting == 0) return 0;
+  long deadline = st->srtt / 4;
+  if(deadline < UPSTREAM_RACE_MIN) deadline = UPSTREAM_RACE_MIN;
+  if(now - st->waiting <= deadline) return 0;
+
+  struct upstat *alt = NULL;
+  for(size_t i=0; i<n; i++){
+    struct upstat *i_st = upstats_get(s, ips[i], 0);
+    if(ips[i] == ip || i_st == NULL || i_st->failtime) continue;
+    if(upstat_better(i_st, alt)) alt = i_st;
+  }
+  return (alt != NULL) ? alt->ip : 0;
+}
+
+
+void
+upstream_sent(struct upstat *st, long now)
+{
+  if(st->waiting == 0) st->waiting = now;
+  st->unanswered ++;
+  st->sent ++;
+}
+
+
+/*
+ Response got from upstream, @rtt ms after the query sent, negative when
+ not known.
+*/
+void
+upstream_answered(struct upstat *st, long rtt)
+{
+  if(rtt >= 0 && st->srtt == 0) st->srtt = rtt * 8;
+  else if(rtt >= 0) st->srtt += rtt - st->srtt / 8;
+  st->waiting = 0;
+  st->unanswered = 0;
+  st->failtime = 0;
+  st->answered ++;
+}
@@ -0,0 +1,65 @@
+#ifndef _UPSTREAM_H_
+#define _UPSTREAM_H_
+
+#include "common.h"
+
+
+#define UPSTREAM_TIMEOUT   1000  // ms, upstream not answering since is failing.
+#define UPSTREAM_RETRY     5000  // ms, failing upstream is tried again after.
+#define UPSTREAM_PROBE     64    // every so many queries go to next upstream.
+#define UPSTREAM_RACE_MIN  50    // ms, min deadline of upstream to race another.
+
+
+/*
+ State of an upstream DNS server, observed by one worker.
+
+@ip: address of upstream, host order.
+@srtt: smoothed RTT in 1/8 ms, 0 when not measured yet.
+@waiting: ms of the first query not answered since last response, 0 when
+  none.
+@unanswered: count of queries not answered since last response.
+@failtime: ms when found failing, 0 when healthy.
+@sent, @answered, @failed: counters of queries sent, responses, failures.
+*/
+struct upstat{
+  unsigned ip;
+  long srtt, waiting;
+  unsigned unanswered;
+  long failtime;
+  unsigned long sent, answered, failed;
+};
+
+
+/*
+ Upstreams observed, NOT thread safe, each worker owns its own.
+
+@index: struct upstat by ip.
+@list: all struct upstat, to report.
+@nquery: count of queries picked upstream for.
+*/
+struct upstats{
+  struct htable *index;
+  struct array *list;
+  unsigned long nquery;
+};
+
+
+int
+upstats_init(struct upstats *s);
+
+struct upstat*
+upstats_get(struct upstats *s, unsigned ip, int create);
+
+unsigned
+upstream_pick(struct upstats *s, const unsigned *ips, size_t n, long now);
+
+unsigned
+upstream_race(struct upstats *s, const unsigned *ips, size_t n, unsigned ip, long now);
+
+void
+upstream_sent(struct upstat *st, long now);
+
+void
+upstream_answered(struct upstat *st, long rtt);
+
+#endif